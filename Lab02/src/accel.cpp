@@ -0,0 +1,56 @@
+#include "accel.h"
+#include "bvh.h"
+#include "qbvh.h"
+#include "wbvh.h"
+
+size_t Accelerator::UncompressedMemoryUsage()
+{
+	return MemoryUsage();
+}
+
+void Accelerator::OccludedPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip)
+{
+	// One ray at a time for structures without a packet traversal
+	for (int i = 0; i < packet.count; i++)
+	{
+		if ((packet.active & (1 << i)) && Occluded(rayOrg, packet.Dir(i), packet.maxDist[i], self, skip))
+			packet.active &= ~(1 << i);
+	}
+}
+
+Accelerator* CreateAccelerator(AccelType type)
+{
+	if (type == AccelType::QBVH)
+		return new QBVH;
+	else if (type == AccelType::BVH4)
+		return new WideBVH<4>;
+	else if (type == AccelType::BVH8)
+		return new WideBVH<8>;
+	return new BVH;
+}
+
+bool ParseAccelType(std::string name, AccelType& type)
+{
+	if (name == "BVH")
+		type = AccelType::BVH;
+	else if (name == "QBVH")
+		type = AccelType::QBVH;
+	else if (name == "BVH4")
+		type = AccelType::BVH4;
+	else if (name == "BVH8")
+		type = AccelType::BVH8;
+	else
+		return false;
+	return true;
+}
+
+std::string AccelTypeName(AccelType type)
+{
+	if (type == AccelType::QBVH)
+		return "QBVH";
+	else if (type == AccelType::BVH4)
+		return "BVH4";
+	else if (type == AccelType::BVH8)
+		return "BVH8";
+	return "BVH";
+}
@@ -0,0 +1,56 @@
+#ifndef __ACCEL_H__
+#define __ACCEL_H__
+
+#include <vector>
+#include <string>
+#include <glm/glm.hpp>
+
+#include "shapes.h"
+
+enum class AccelType
+{
+	BVH,	// Binary BVH with float boxes
+	QBVH,	// Binary BVH with 16 bit quantized boxes, 32 byte nodes
+	BVH4,	// 4 wide BVH, children tested with SSE
+	BVH8,	// 8 wide BVH, children tested with AVX
+};
+
+// Ray query structure over a list of shapes
+class Accelerator
+{
+public:
+	// Primitive tests are added to heatCounters, for HEATMAP TESTS. Queries
+	// then take a traversal compiled with the counting, so other frames only
+	// pay a branch per query.
+	bool countTests;
+
+	Accelerator() : countTests(false) {}
+	virtual ~Accelerator() {}
+
+	virtual void Build(const std::vector<Shape*>& shapes) = 0;
+	// Update the bounds after shapes moved, the tree is kept
+	virtual void Refit() = 0;
+	virtual AABB GetBounds() = 0;
+
+	// Closest hit. Shapes equal to "self" are tested with "skip" so that a
+	// shape group can still be hit by rays leaving one of its primitives.
+	// Equal depths are resolved in input order so the result does not
+	// depend on the tree.
+	virtual bool Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim) = 0;
+	// Any hit closer than maxDist
+	virtual bool Occluded(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip) = 0;
+	// Clears the active bit of every ray of the packet that is occluded.
+	// Traverses once for all rays and stops when all of them are blocked.
+	virtual void OccludedPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip);
+
+	// Bytes used by the nodes and primitive references
+	virtual size_t MemoryUsage() = 0;
+	// Bytes the same tree would use as a binary BVH with float boxes
+	virtual size_t UncompressedMemoryUsage();
+};
+
+Accelerator* CreateAccelerator(AccelType type);
+bool ParseAccelType(std::string name, AccelType& type);
+std::string AccelTypeName(AccelType type);
+
+#endif
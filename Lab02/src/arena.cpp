@@ -0,0 +1,58 @@
+#include "arena.h"
+
+Arena::Arena(size_t blockSize)
+{
+	this->blockSize = blockSize;
+	offset = 0;
+	used = 0;
+}
+
+Arena::~Arena()
+{
+	Clear();
+}
+
+void* Arena::Allocate(size_t size, size_t align)
+{
+	if (!blocks.empty())
+	{
+		size_t start = (offset + align - 1) & ~(align - 1);
+		if (start + size <= blockSizes.back())
+		{
+			offset = start + size;
+			used += size;
+			return blocks.back() + start;
+		}
+	}
+	// Objects larger than a block get a block of their own. Blocks come
+	// from operator new, aligned for any fundamental type.
+	size_t bytes = size > blockSize ? size : blockSize;
+	blocks.push_back((char*)::operator new(bytes));
+	blockSizes.push_back(bytes);
+	offset = size;
+	used += size;
+	return blocks.back();
+}
+
+void Arena::Clear()
+{
+	for (char* b : blocks)
+		::operator delete(b);
+	blocks.clear();
+	blockSizes.clear();
+	offset = 0;
+	used = 0;
+}
+
+size_t Arena::BytesUsed() const
+{
+	return used;
+}
+
+size_t Arena::BytesReserved() const
+{
+	size_t bytes = 0;
+	for (size_t s : blockSizes)
+		bytes += s;
+	return bytes;
+}
@@ -0,0 +1,43 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+// Bump allocator that hands out memory from large blocks, so objects
+// allocated one after the other end up next to each other. Nothing is
+// freed on its own, everything goes at once in Clear.
+class Arena
+{
+public:
+	Arena(size_t blockSize = ARENA_BLOCK_SIZE);
+	~Arena();
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* Allocate(size_t size, size_t align);
+	// Destructors are never run, so only types that do not need one
+	template <class T> T* New()
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "Arena objects are never destroyed");
+		return new (Allocate(sizeof(T), alignof(T))) T;
+	}
+	// Frees every block, all objects of the arena become invalid
+	void Clear();
+	// Bytes handed out, and bytes of the blocks they come from
+	size_t BytesUsed() const;
+	size_t BytesReserved() const;
+
+private:
+	std::vector<char*> blocks;
+	std::vector<size_t> blockSizes;
+	size_t blockSize;
+	size_t offset;	// First free byte of the last block
+	size_t used;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <iostream>
+#include <vector>
+#include <chrono>
+
+#include "batch.h"
+#include "image.h"
+#include "raytracer.h"
+#include "omp.h"
+
+#pragma warning(disable : 4996)
+
+// Frames per second of rendering since start
+static void ReportRenderRate(int frames, std::chrono::steady_clock::time_point start)
+{
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Rendered " << frames << " frames in " << seconds << " s, " << frames / seconds << " frames/s" << std::endl;
+}
+
+bool BatchRender(std::string file, std::string options, int first, int last, std::string pattern, const EncodeSettings& encode, std::string heatPattern)
+{
+	if (last < first)
+	{
+		std::cout << "Empty frame range: " << first << " " << last << std::endl;
+		return false;
+	}
+	int frameCount = last - first + 1;
+	int numThreads = omp_get_max_threads();
+	if (numThreads > frameCount)
+		numThreads = frameCount;
+
+	// Scenes are loaded up front, animation state is not shared
+	std::vector<RayTracer*> tracers;
+	std::vector<GLubyte*> images;
+	for (int i = 0; i < numThreads; i++)
+	{
+		RayTracer* rt = new RayTracer();
+		if (!rt->LoadScene(file, options))
+		{
+			delete rt;
+			break;
+		}
+		glm::ivec2 res = rt->GetResolution();
+		GLubyte* img = new GLubyte[res.x * res.y * 3];
+		rt->SetOutImage(img);
+		tracers.push_back(rt);
+		images.push_back(img);
+	}
+	bool ok = !tracers.empty();
+	if (ok && !heatPattern.empty() && !tracers[0]->RendersHeatmap())
+	{
+		std::cout << "-heatdump needs HEATMAP TESTS, SHADOWS, DEPTH or CYCLES" << std::endl;
+		ok = false;
+	}
+	if (ok)
+	{
+		tracers[0]->ReportMemoryUsage();
+		EncodeQueue queue;
+		queue.Start(encode);
+		auto start = std::chrono::steady_clock::now();
+		// One frame per thread, the pixel loop inside runs serially
+		omp_set_nested(0);
+		#pragma omp parallel for schedule(dynamic, 1) num_threads((int)tracers.size())
+		for (int frame = first; frame <= last; frame++)
+		{
+			int t = omp_get_thread_num();
+			tracers[t]->RenderFrame(frame);
+			char name[1024];
+			if (!heatPattern.empty())
+			{
+				snprintf(name, sizeof(name), heatPattern.c_str(), frame);
+				tracers[t]->WriteHeatmap(name);
+			}
+			snprintf(name, sizeof(name), pattern.c_str(), frame);
+			queue.Push(name, images[t], tracers[t]->GetResolution());
+		}
+		ReportRenderRate(frameCount, start);
+		ok = queue.Finish();
+		queue.Report();
+		RayStats stats;
+		for (RayTracer* rt : tracers)
+			stats.Add(rt->GetRayStats());
+		stats.Report();
+	}
+
+	for (int i = 0; i < (int)tracers.size(); i++)
+	{
+		delete tracers[i];
+		delete[] images[i];
+	}
+	return ok;
+}
+
+bool BatchRender(Coordinator& coordinator, int first, int last, std::string pattern, const EncodeSettings& encode)
+{
+	glm::ivec2 res = coordinator.GetResolution();
+	std::vector<GLubyte> img(res.x * res.y * 3);
+	EncodeQueue queue;
+	queue.Start(encode);
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = first; frame <= last; frame++)
+	{
+		coordinator.RenderFrame(frame, &img[0]);
+		char name[1024];
+		snprintf(name, sizeof(name), pattern.c_str(), frame);
+		queue.Push(name, &img[0], res);
+	}
+	if (last >= first)
+		ReportRenderRate(last - first + 1, start);
+	bool ok = queue.Finish();
+	queue.Report();
+	return ok;
+}
@@ -0,0 +1,20 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <string>
+
+#include "distributed.h"
+#include "encodequeue.h"
+
+// Renders the animation steps first to last (inclusive) without a window and
+// writes each one to an image named after pattern, e.g. "frame%04d.ppm",
+// in the format of its extension. Frames are spread over the cores, every
+// thread renders whole frames with its own copy of the scene. Images are
+// the same as in the interactive view. Finished frames go to an EncodeQueue
+// and are written while the next ones render. With heatPattern the values
+// of HEATMAP frames are also written, see RayTracer::WriteHeatmap.
+bool BatchRender(std::string file, std::string options, int first, int last, std::string pattern, const EncodeSettings& encode, std::string heatPattern = "");
+// Same, one frame after the other with the tiles spread over the workers
+bool BatchRender(Coordinator& coordinator, int first, int last, std::string pattern, const EncodeSettings& encode);
+
+#endif
@@ -0,0 +1,689 @@
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "accel.h"
+#include "bench.h"
+#include "image.h"
+#include "kernels.h"
+#include "perfcounters.h"
+#include "pixelorder.h"
+#include "raytracer.h"
+#include "simd.h"
+
+bool BenchmarkPixelOrders(std::string file, std::string options, int frames)
+{
+	if (frames < 1)
+		frames = 1;
+	// Before any render thread exists, so all of them are counted
+	PerfCounters counters;
+	if (!counters.Open())
+		std::cout << "Cache counters are not available" << std::endl;
+
+	std::cout << "Kernels: " << SimdLevelName(simdKernels->level) << std::endl;
+	PixelOrder orders[] = { PixelOrder::SCANLINE, PixelOrder::TILED, PixelOrder::MORTON, PixelOrder::HILBERT };
+	printf("%-10s %10s %10s %14s %14s %10s\n", "order", "ms/frame", "Mrays/s", "cache refs", "cache misses", "miss rate");
+	for (PixelOrder order : orders)
+	{
+		RayTracer raytracer;
+		if (!raytracer.LoadScene(file, options + " PIXELORDER " + PixelOrderName(order)))
+			return false;
+		glm::ivec2 res = raytracer.GetResolution();
+		std::vector<GLubyte> img(res.x * res.y * 3);
+		raytracer.SetOutImage(&img[0]);
+		// Warm up caches and threads
+		raytracer.RenderFrame(1);
+
+		counters.Start();
+		auto start = std::chrono::steady_clock::now();
+		for (int f = 0; f < frames; f++)
+			raytracer.RenderFrame(1);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+		counters.Stop();
+
+		glm::ivec2 native = raytracer.GetNativeResolution();
+		double mrays = (double)native.x * native.y / (ms * 1000.0);
+		printf("%-10s %10.1f %10.2f", PixelOrderName(order).c_str(), ms, mrays);
+		if (counters.Available())
+		{
+			double rate = counters.cacheReferences > 0 ? (double)counters.cacheMisses / counters.cacheReferences : 0.0;
+			printf(" %14lld %14lld %9.2f%%\n", counters.cacheReferences / frames, counters.cacheMisses / frames, rate * 100.0);
+		}
+		else
+			printf(" %14s %14s %10s\n", "n/a", "n/a", "n/a");
+	}
+	return true;
+}
+
+bool BenchmarkSparseTrace(std::string file, std::string options, int frames)
+{
+	if (frames < 1)
+		frames = 1;
+	std::cout << "Kernels: " << SimdLevelName(simdKernels->level) << std::endl;
+	SparsePattern patterns[] = { SparsePattern::NONE, SparsePattern::CHECKERBOARD, SparsePattern::HALF };
+	printf("%-14s %10s %10s %10s\n", "pattern", "ms/frame", "speedup", "PSNR dB");
+	std::vector<GLubyte> reference;
+	double referenceMs = 0.0;
+	for (SparsePattern pattern : patterns)
+	{
+		RayTracer raytracer;
+		if (!raytracer.LoadScene(file, options + " SPARSETRACE " + SparsePatternName(pattern)))
+			return false;
+		glm::ivec2 res = raytracer.GetResolution();
+		std::vector<GLubyte> img(res.x * res.y * 3);
+		raytracer.SetOutImage(&img[0]);
+		raytracer.RenderFrame(1);
+
+		auto start = std::chrono::steady_clock::now();
+		for (int f = 0; f < frames; f++)
+			raytracer.RenderFrame(1);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+
+		if (pattern == SparsePattern::NONE)
+		{
+			reference = img;
+			referenceMs = ms;
+		}
+		double psnr = ImagePSNR(&img[0], &reference[0], res);
+		printf("%-14s %10.1f %9.2fx %10.2f\n", SparsePatternName(pattern).c_str(), ms, referenceMs / ms, psnr);
+	}
+	return true;
+}
+
+// Same bits for a seed with every compiler, unlike std::uniform_real_distribution
+static float Uniform(std::mt19937& rng, float a, float b)
+{
+	return a + (b - a) * (float)(rng() >> 8) * (1.0f / 16777216.0f);
+}
+
+static glm::vec3 RandomUnit(std::mt19937& rng)
+{
+	while (1)
+	{
+		glm::vec3 v(Uniform(rng, -1.0f, 1.0f), Uniform(rng, -1.0f, 1.0f), Uniform(rng, -1.0f, 1.0f));
+		float len = glm::length(v);
+		if (len > 0.1f && len <= 1.0f)
+			return v / len;
+	}
+}
+
+// Direction from org to a point offset from center, across the line from
+// org. With org at least 5 times further than offset, the ray passes
+// center within 3% of offset.
+static glm::vec3 AimPast(std::mt19937& rng, glm::vec3 org, glm::vec3 center, float offset)
+{
+	glm::vec3 w = glm::normalize(org - center);
+	glm::vec3 p;
+	do
+		p = glm::cross(w, RandomUnit(rng));
+	while (glm::length(p) < 0.1f);
+	return glm::normalize(center + glm::normalize(p) * offset - org);
+}
+
+// Reference tests in double precision, with the rules of the float kernels
+static bool SphereHitDouble(const Sphere& sphere, glm::vec3 rayOrg, glm::vec3 rayDir, double& hitDepth)
+{
+	glm::dvec3 oc = glm::dvec3(sphere.center) - glm::dvec3(rayOrg);
+	glm::dvec3 dir(rayDir);
+	double op = glm::dot(dir, oc);
+	if (op < 0.0)
+		return false;
+	double d2 = glm::dot(oc, oc) - op * op;
+	double r2 = (double)sphere.radius * sphere.radius;
+	if (d2 > r2)
+		return false;
+	double discriminant = r2 - d2;
+	if (discriminant < EPSILON)
+		hitDepth = op;
+	else
+	{
+		hitDepth = op - sqrt(discriminant);
+		if (hitDepth < 0.0)
+			hitDepth = op + sqrt(discriminant);
+	}
+	return true;
+}
+
+static bool QuadHitDouble(const Quad& quad, glm::vec3 rayOrg, glm::vec3 rayDir, double& hitDepth)
+{
+	glm::dvec3 v1(quad.vertex1);
+	glm::dvec3 e1 = glm::dvec3(quad.vertex2) - v1;
+	glm::dvec3 e2 = glm::dvec3(quad.vertex3) - v1;
+	glm::dvec3 n = glm::normalize(glm::cross(e1, e2));
+	glm::dvec3 org(rayOrg);
+	glm::dvec3 dir(rayDir);
+	double dn = glm::dot(dir, n);
+	if (dn == 0.0)
+		return false;
+	double d = glm::dot(v1 - org, n) / dn;
+	if (d < EPSILON)
+		return false;
+	// Coordinates of the hit along the edges
+	glm::dvec3 q = org + dir * d - v1;
+	double a = glm::dot(e1, e1);
+	double b = glm::dot(e1, e2);
+	double c = glm::dot(e2, e2);
+	double x = glm::dot(q, e1);
+	double y = glm::dot(q, e2);
+	double det = a * c - b * b;
+	double s = (c * x - b * y) / det;
+	double t = (a * y - b * x) / det;
+	if (s < 0.0 || s > 1.0 || t < 0.0 || t > 1.0)
+		return false;
+	hitDepth = d;
+	return true;
+}
+
+static bool BoxHitDouble(const AABB& box, glm::vec3 rayOrg, glm::vec3 rayDir, double maxDist)
+{
+	double tNear = 0.0;
+	double tFar = maxDist;
+	for (int k = 0; k < 3; k++)
+	{
+		double inv = 1.0 / rayDir[k];
+		double t0 = ((double)box.bmin[k] - rayOrg[k]) * inv;
+		double t1 = ((double)box.bmax[k] - rayOrg[k]) * inv;
+		tNear = std::max(tNear, std::min(t0, t1));
+		tFar = std::min(tFar, std::max(t0, t1));
+	}
+	return tNear <= tFar;
+}
+
+static bool SameHit(bool hit, float depth, bool refHit, double refDepth)
+{
+	return hit == refHit && (!hit || fabs(depth - refDepth) <= 1e-4 * std::max(1.0, refDepth));
+}
+
+// Shapes and rays of one kernel, with the results of the reference
+class KernelTests
+{
+public:
+	std::vector<Sphere> spheres;
+	std::vector<Quad> quads;
+	std::vector<AABB> boxes;
+	std::vector<glm::vec3> orgs;
+	std::vector<glm::vec3> dirs;
+	std::vector<ShadowPacket> packets;
+	std::vector<bool> refHits;
+	std::vector<double> refDepths;
+	int rays;
+	int hits;
+
+	KernelTests() : rays(0), hits(0) {}
+	void AddReference(bool hit, double depth)
+	{
+		refHits.push_back(hit);
+		refDepths.push_back(depth);
+		rays++;
+		hits += hit ? 1 : 0;
+	}
+};
+
+static void MakeSphereTests(std::mt19937& rng, int count, float hitRatio, KernelTests& tests)
+{
+	for (int i = 0; i < count; i++)
+	{
+		Sphere sphere;
+		sphere.SetCenter(glm::vec3(Uniform(rng, -10.0f, 10.0f), Uniform(rng, -10.0f, 10.0f), Uniform(rng, -10.0f, 10.0f)));
+		sphere.SetRadius(Uniform(rng, 0.2f, 2.0f));
+		float r = sphere.radius;
+		bool hit = Uniform(rng, 0.0f, 1.0f) < hitRatio;
+		glm::vec3 org = sphere.center + RandomUnit(rng) * r * Uniform(rng, 5.0f, 20.0f);
+		glm::vec3 dir = AimPast(rng, org, sphere.center, r * (hit ? Uniform(rng, 0.0f, 0.95f) : Uniform(rng, 1.05f, 3.0f)));
+		double depth = 0.0;
+		bool refHit = SphereHitDouble(sphere, org, dir, depth);
+		tests.spheres.push_back(sphere);
+		tests.orgs.push_back(org);
+		tests.dirs.push_back(dir);
+		tests.AddReference(refHit, depth);
+	}
+}
+
+static void MakeQuadTests(std::mt19937& rng, int count, float hitRatio, KernelTests& tests)
+{
+	for (int i = 0; i < count; i++)
+	{
+		glm::vec3 v1(Uniform(rng, -10.0f, 10.0f), Uniform(rng, -10.0f, 10.0f), Uniform(rng, -10.0f, 10.0f));
+		glm::vec3 e1, e2;
+		// Edges far from parallel, so a hit 5% outside an edge is clear of it
+		do
+		{
+			e1 = RandomUnit(rng) * Uniform(rng, 0.5f, 4.0f);
+			e2 = RandomUnit(rng) * Uniform(rng, 0.5f, 4.0f);
+		} while (fabs(glm::dot(glm::normalize(e1), glm::normalize(e2))) > 0.9f);
+		Quad quad;
+		quad.SetV1(v1);
+		quad.SetV2(v1 + e1);
+		quad.SetV3(v1 + e2);
+
+		float s, t;
+		if (Uniform(rng, 0.0f, 1.0f) < hitRatio)
+		{
+			s = Uniform(rng, 0.05f, 0.95f);
+			t = Uniform(rng, 0.05f, 0.95f);
+		}
+		else
+		{
+			s = Uniform(rng, 1.05f, 2.0f);
+			if (rng() & 1)
+				s = 1.0f - s;
+			t = Uniform(rng, -1.0f, 2.0f);
+			if (rng() & 1)
+				std::swap(s, t);
+		}
+		glm::vec3 aim = v1 + e1 * s + e2 * t;
+		float side = (rng() & 1) ? 1.0f : -1.0f;
+		glm::vec3 org = quad.center + quad.normal * side * Uniform(rng, 1.0f, 10.0f) + RandomUnit(rng) * Uniform(rng, 0.0f, 3.0f);
+		glm::vec3 dir = glm::normalize(aim - org);
+		double depth = 0.0;
+		bool refHit = QuadHitDouble(quad, org, dir, depth);
+		tests.quads.push_back(quad);
+		tests.orgs.push_back(org);
+		tests.dirs.push_back(dir);
+		tests.AddReference(refHit, depth);
+	}
+}
+
+// Packets of PACKET_SIZE shadow rays from one origin to a sphere, their
+// lights are past it
+static void MakeSpherePacketTests(std::mt19937& rng, int count, float hitRatio, KernelTests& tests)
+{
+	for (int i = 0; i < count; i += PACKET_SIZE)
+	{
+		Sphere sphere;
+		sphere.SetCenter(glm::vec3(Uniform(rng, -10.0f, 10.0f), Uniform(rng, -10.0f, 10.0f), Uniform(rng, -10.0f, 10.0f)));
+		sphere.SetRadius(Uniform(rng, 0.2f, 2.0f));
+		float r = sphere.radius;
+		float distance = r * Uniform(rng, 5.0f, 20.0f);
+		glm::vec3 org = sphere.center + RandomUnit(rng) * distance;
+		ShadowPacket packet;
+		for (int k = 0; k < PACKET_SIZE; k++)
+		{
+			bool hit = Uniform(rng, 0.0f, 1.0f) < hitRatio;
+			glm::vec3 dir = AimPast(rng, org, sphere.center, r * (hit ? Uniform(rng, 0.0f, 0.95f) : Uniform(rng, 1.05f, 3.0f)));
+			float maxDist = distance * Uniform(rng, 2.0f, 4.0f);
+			packet.Add(dir, maxDist);
+			double depth = 0.0;
+			bool refHit = SphereHitDouble(sphere, org, dir, depth) && depth < maxDist;
+			tests.AddReference(refHit, depth);
+		}
+		tests.spheres.push_back(sphere);
+		tests.orgs.push_back(org);
+		tests.packets.push_back(packet);
+	}
+}
+
+// Packets of shadow rays to a box, aimed inside the sphere it contains to
+// hit and outside the one containing it to miss
+static void MakeBoxPacketTests(std::mt19937& rng, int count, float hitRatio, KernelTests& tests)
+{
+	for (int i = 0; i < count; i += PACKET_SIZE)
+	{
+		glm::vec3 center(Uniform(rng, -10.0f, 10.0f), Uniform(rng, -10.0f, 10.0f), Uniform(rng, -10.0f, 10.0f));
+		glm::vec3 half(Uniform(rng, 0.2f, 2.0f), Uniform(rng, 0.2f, 2.0f), Uniform(rng, 0.2f, 2.0f));
+		AABB box;
+		box.Expand(center - half);
+		box.Expand(center + half);
+		float inner = std::min(half.x, std::min(half.y, half.z));
+		float outer = glm::length(half);
+		float distance = outer * Uniform(rng, 5.0f, 20.0f);
+		glm::vec3 org = center + RandomUnit(rng) * distance;
+		ShadowPacket packet;
+		for (int k = 0; k < PACKET_SIZE; k++)
+		{
+			bool hit = Uniform(rng, 0.0f, 1.0f) < hitRatio;
+			glm::vec3 dir = AimPast(rng, org, center, hit ? inner * Uniform(rng, 0.0f, 0.95f) : outer * Uniform(rng, 1.05f, 3.0f));
+			float maxDist = distance * Uniform(rng, 2.0f, 4.0f);
+			packet.Add(dir, maxDist);
+			tests.AddReference(BoxHitDouble(box, org, dir, maxDist), 0.0);
+		}
+		tests.boxes.push_back(box);
+		tests.orgs.push_back(org);
+		tests.packets.push_back(packet);
+	}
+}
+
+// Rays across a cloud of spheres, from outside of it. Candidates are drawn
+// until the ray hits or misses as wanted, and again if it passes a sphere
+// where float and double may not agree: at its edge, or where the kernel
+// takes the middle of a tangent ray.
+static void MakeSceneTests(std::mt19937& rng, int count, float hitRatio, KernelTests& tests)
+{
+	for (int i = 0; i < KERNEL_BENCH_SPHERES; i++)
+	{
+		Sphere sphere;
+		sphere.SetCenter(glm::vec3(Uniform(rng, -20.0f, 20.0f), Uniform(rng, -20.0f, 20.0f), Uniform(rng, -20.0f, 20.0f)));
+		sphere.SetRadius(Uniform(rng, 0.1f, 0.5f));
+		tests.spheres.push_back(sphere);
+	}
+	for (int i = 0; i < count; i++)
+	{
+		bool wanted = Uniform(rng, 0.0f, 1.0f) < hitRatio;
+		while (1)
+		{
+			glm::vec3 org = RandomUnit(rng) * 40.0f;
+			glm::vec3 aim(Uniform(rng, -20.0f, 20.0f), Uniform(rng, -20.0f, 20.0f), Uniform(rng, -20.0f, 20.0f));
+			glm::vec3 dir = glm::normalize(aim - org);
+			glm::dvec3 o(org);
+			glm::dvec3 d(dir);
+			bool hit = false;
+			bool grazed = false;
+			double closest = INFINITY;
+			for (const Sphere& sphere : tests.spheres)
+			{
+				glm::dvec3 oc = glm::dvec3(sphere.center) - o;
+				double op = glm::dot(d, oc);
+				double d2 = glm::dot(oc, oc) - op * op;
+				double r2 = (double)sphere.radius * sphere.radius;
+				// Float rounds d2 to about a millionth of oc2
+				double margin = 1e-6 * glm::dot(oc, oc);
+				if (op >= 0.0 && (fabs(d2 - r2) < margin || fabs(r2 - d2 - EPSILON) < margin))
+					grazed = true;
+				double depth;
+				if (SphereHitDouble(sphere, org, dir, depth) && depth < closest)
+				{
+					closest = depth;
+					hit = true;
+				}
+			}
+			if (grazed || hit != wanted)
+				continue;
+			tests.orgs.push_back(org);
+			tests.dirs.push_back(dir);
+			tests.AddReference(hit, closest);
+			break;
+		}
+	}
+}
+
+// Runs pass for KERNEL_BENCH_SECONDS, at least 3 times, and keeps the
+// fastest time and time stamp ticks of one pass. Passes are timed in rounds
+// of at least KERNEL_BENCH_MIN_ROUND seconds, so short ones are not lost in
+// the resolution of the clock. result is what the last pass returned.
+template <class F>
+static void TimePasses(F pass, double& seconds, unsigned long long& ticks, unsigned int& result)
+{
+	int passes = 1;
+	for (;;)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (int k = 0; k < passes; k++)
+			result = pass();
+		if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= KERNEL_BENCH_MIN_ROUND || passes >= (1 << 20))
+			break;
+		passes *= 2;
+	}
+	seconds = INFINITY;
+	ticks = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (int n = 0; n < 3 || std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() < KERNEL_BENCH_SECONDS; n++)
+	{
+		unsigned long long startTicks = ReadTimestamp();
+		auto start = std::chrono::steady_clock::now();
+		for (int k = 0; k < passes; k++)
+			result = pass();
+		double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / passes;
+		unsigned long long passTicks = (ReadTimestamp() - startTicks) / passes;
+		if (s < seconds)
+		{
+			seconds = s;
+			ticks = passTicks;
+		}
+	}
+}
+
+// Rows of the kernel benchmark, compared with the baseline
+class KernelBenchmark
+{
+public:
+	std::map<std::string, double> baseline;
+	std::map<std::string, double> results;
+	bool failed;
+
+	KernelBenchmark() : failed(false) {}
+
+	bool Slower(std::string key, double ns)
+	{
+		auto base = baseline.find(key);
+		return base != baseline.end() && ns / base->second - 1.0 > KERNEL_BENCH_TOLERANCE;
+	}
+
+	// Times pass, timed again up to KERNEL_BENCH_RETRIES times while it
+	// looks slower than the baseline, and reports the fastest time. pass
+	// returns its hits, which must be checkedHits.
+	template <class F>
+	void Run(std::string kernel, std::string level, const KernelTests& tests, int errors, unsigned int checkedHits, F pass)
+	{
+		double seconds;
+		unsigned long long ticks;
+		unsigned int timedHits;
+		TimePasses(pass, seconds, ticks, timedHits);
+		for (int retry = 0; retry < KERNEL_BENCH_RETRIES && Slower(kernel + " " + level, seconds * 1e9 / tests.rays); retry++)
+		{
+			double s;
+			unsigned long long t;
+			TimePasses(pass, s, t, timedHits);
+			if (s < seconds)
+			{
+				seconds = s;
+				ticks = t;
+			}
+		}
+		errors += timedHits == checkedHits ? 0 : 1;
+		Report(kernel, level, tests, errors, seconds, ticks);
+	}
+
+	void Report(std::string kernel, std::string level, const KernelTests& tests, int errors, double seconds, unsigned long long ticks)
+	{
+		double ns = seconds * 1e9 / tests.rays;
+		printf("%-18s %-8s %8.1f%% %10.2f", kernel.c_str(), level.c_str(), 100.0 * tests.hits / tests.rays, ns);
+		if (ticks > 0)
+			printf(" %12.2f", (double)ticks / tests.rays);
+		else
+			printf(" %12s", "n/a");
+		printf(" %8d", errors);
+		std::string key = kernel + " " + level;
+		results[key] = ns;
+		auto base = baseline.find(key);
+		if (base != baseline.end())
+		{
+			double change = ns / base->second - 1.0;
+			printf(" %+9.1f%%", change * 100.0);
+			if (Slower(key, ns))
+			{
+				printf(" slower");
+				failed = true;
+			}
+		}
+		printf("\n");
+		if (errors > 0)
+			failed = true;
+	}
+};
+
+// Kernel tables of the levels this processor runs, as SelectSimdKernels
+// picks them
+static std::vector<const SimdKernels*> SupportedKernels()
+{
+	std::vector<const SimdKernels*> kernels;
+	SimdLevel best = DetectSimdLevel();
+	kernels.push_back(&scalarKernels);
+#ifdef RT_SSE
+	if (best >= SimdLevel::SSE)
+		kernels.push_back(&sseKernels);
+#endif
+#ifdef RT_X86
+	if (best >= SimdLevel::AVX2)
+		kernels.push_back(&avx2Kernels);
+	if (best >= SimdLevel::AVX512)
+		kernels.push_back(&avx512Kernels);
+#endif
+	return kernels;
+}
+
+bool BenchmarkKernels(int tests, float hitRatio, std::string baseline)
+{
+	if (tests < PACKET_SIZE)
+		tests = PACKET_SIZE;
+	hitRatio = std::min(std::max(hitRatio, 0.0f), 1.0f);
+	KernelBenchmark bench;
+	bool haveBaseline = false;
+	std::ifstream in(baseline);
+	if (!baseline.empty() && in)
+	{
+		std::string tag;
+		float ratio = -1.0f;
+		in >> tag >> ratio;
+		if (tag != "HITRATIO" || fabs(ratio - hitRatio) > 1e-6f)
+		{
+			std::cout << "Baseline " << baseline << " was not recorded with hit ratio " << hitRatio << std::endl;
+			return false;
+		}
+		std::string kernel, level;
+		double ns;
+		while (in >> kernel >> level >> ns)
+			bench.baseline[kernel + " " + level] = ns;
+		haveBaseline = true;
+	}
+	in.close();
+
+	std::mt19937 rng(1);
+	KernelTests sphereTests, quadTests, spherePacketTests, boxPacketTests, sceneTests;
+	MakeSphereTests(rng, tests, hitRatio, sphereTests);
+	MakeQuadTests(rng, tests, hitRatio, quadTests);
+	MakeSpherePacketTests(rng, tests, hitRatio, spherePacketTests);
+	MakeBoxPacketTests(rng, tests, hitRatio, boxPacketTests);
+	MakeSceneTests(rng, std::max(tests / 4, 1), hitRatio, sceneTests);
+
+	std::cout << "Kernels: " << SimdLevelName(simdKernels->level) << ", " << tests << " tests, cycles of the time stamp counter" << std::endl;
+	printf("%-18s %-8s %9s %10s %12s %8s %10s\n", "kernel", "level", "hits", "ns/test", "cycles/test", "errors", "baseline");
+	for (const SimdKernels* kernels : SupportedKernels())
+	{
+		std::string level = SimdLevelName(kernels->level);
+		int errors = 0;
+		unsigned int checkedHits = 0;
+		for (int i = 0; i < tests; i++)
+		{
+			float depth = 0.0f;
+			bool hit = kernels->sphereHit(sphereTests.spheres[i], sphereTests.orgs[i], sphereTests.dirs[i], depth);
+			errors += SameHit(hit, depth, sphereTests.refHits[i], sphereTests.refDepths[i]) ? 0 : 1;
+			checkedHits += hit ? 1 : 0;
+		}
+		bench.Run("sphereHit", level, sphereTests, errors, checkedHits, [&]() {
+			unsigned int hits = 0;
+			float depth;
+			for (int i = 0; i < tests; i++)
+				hits += kernels->sphereHit(sphereTests.spheres[i], sphereTests.orgs[i], sphereTests.dirs[i], depth) ? 1 : 0;
+			return hits;
+		});
+
+		errors = 0;
+		checkedHits = 0;
+		for (int i = 0; i < tests; i++)
+		{
+			float depth = 0.0f;
+			bool hit = kernels->quadHit(quadTests.quads[i], quadTests.orgs[i], quadTests.dirs[i], depth);
+			errors += SameHit(hit, depth, quadTests.refHits[i], quadTests.refDepths[i]) ? 0 : 1;
+			checkedHits += hit ? 1 : 0;
+		}
+		bench.Run("quadHit", level, quadTests, errors, checkedHits, [&]() {
+			unsigned int hits = 0;
+			float depth;
+			for (int i = 0; i < tests; i++)
+				hits += kernels->quadHit(quadTests.quads[i], quadTests.orgs[i], quadTests.dirs[i], depth) ? 1 : 0;
+			return hits;
+		});
+
+		// Packet tests are timed per ray
+		errors = 0;
+		checkedHits = 0;
+		for (size_t p = 0; p < spherePacketTests.packets.size(); p++)
+		{
+			const ShadowPacket& packet = spherePacketTests.packets[p];
+			unsigned int mask = kernels->sphereOccludesPacket(spherePacketTests.spheres[p], spherePacketTests.orgs[p], packet, packet.active);
+			checkedHits |= mask;
+			for (int k = 0; k < PACKET_SIZE; k++)
+				errors += (((mask >> k) & 1) != 0) == spherePacketTests.refHits[p * PACKET_SIZE + k] ? 0 : 1;
+		}
+		bench.Run("sphereOccludes", level, spherePacketTests, errors, checkedHits, [&]() {
+			unsigned int hits = 0;
+			for (size_t p = 0; p < spherePacketTests.packets.size(); p++)
+				hits |= kernels->sphereOccludesPacket(spherePacketTests.spheres[p], spherePacketTests.orgs[p], spherePacketTests.packets[p], spherePacketTests.packets[p].active);
+			return hits;
+		});
+
+		errors = 0;
+		checkedHits = 0;
+		for (size_t p = 0; p < boxPacketTests.packets.size(); p++)
+		{
+			const ShadowPacket& packet = boxPacketTests.packets[p];
+			unsigned int mask = kernels->boxHitPacket(boxPacketTests.boxes[p], boxPacketTests.orgs[p], packet, packet.active);
+			checkedHits |= mask;
+			for (int k = 0; k < PACKET_SIZE; k++)
+				errors += (((mask >> k) & 1) != 0) == boxPacketTests.refHits[p * PACKET_SIZE + k] ? 0 : 1;
+		}
+		bench.Run("boxHitPacket", level, boxPacketTests, errors, checkedHits, [&]() {
+			unsigned int hits = 0;
+			for (size_t p = 0; p < boxPacketTests.packets.size(); p++)
+				hits |= kernels->boxHitPacket(boxPacketTests.boxes[p], boxPacketTests.orgs[p], boxPacketTests.packets[p], boxPacketTests.packets[p].active);
+			return hits;
+		});
+	}
+
+	// Closest hits through the accelerators, with the kernels in use
+	std::vector<Shape*> shapes;
+	for (Sphere& sphere : sceneTests.spheres)
+		shapes.push_back(&sphere);
+	AccelType types[] = { AccelType::BVH, AccelType::QBVH, AccelType::BVH4, AccelType::BVH8 };
+	for (AccelType type : types)
+	{
+		Accelerator* accel = CreateAccelerator(type);
+		accel->Build(shapes);
+		int errors = 0;
+		unsigned int checkedHits = 0;
+		for (int i = 0; i < sceneTests.rays; i++)
+		{
+			float depth = 0.0f;
+			Shape* hitObj = 0;
+			Shape* hitPrim = 0;
+			bool hit = accel->Intersect(sceneTests.orgs[i], sceneTests.dirs[i], 0, 0, depth, hitObj, hitPrim);
+			errors += SameHit(hit, depth, sceneTests.refHits[i], sceneTests.refDepths[i]) ? 0 : 1;
+			checkedHits += hit ? 1 : 0;
+		}
+		bench.Run(AccelTypeName(type) + ".Intersect", SimdLevelName(simdKernels->level), sceneTests, errors, checkedHits, [&]() {
+			unsigned int hits = 0;
+			for (int i = 0; i < sceneTests.rays; i++)
+			{
+				float depth;
+				Shape* hitObj;
+				Shape* hitPrim;
+				hits += accel->Intersect(sceneTests.orgs[i], sceneTests.dirs[i], 0, 0, depth, hitObj, hitPrim) ? 1 : 0;
+			}
+			return hits;
+		});
+		delete accel;
+	}
+
+	if (!haveBaseline && !baseline.empty())
+	{
+		std::ofstream out(baseline);
+		out << "HITRATIO " << hitRatio << std::endl;
+		for (auto& result : bench.results)
+			out << result.first << " " << result.second << std::endl;
+		if (!out)
+		{
+			std::cout << "Can't write baseline " << baseline << std::endl;
+			return false;
+		}
+		std::cout << "Baseline written to " << baseline << std::endl;
+	}
+	if (bench.failed)
+		std::cout << "Kernel benchmark failed: wrong results or more than " << KERNEL_BENCH_TOLERANCE * 100.0 << "% slower than the baseline" << std::endl;
+	return !bench.failed;
+}
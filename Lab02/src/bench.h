@@ -0,0 +1,39 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <string>
+
+// Renders the first animation frame of the scene frames times with every
+// pixel order and prints the time per frame, primary rays per second and
+// the cache miss rate where hardware counters are available
+bool BenchmarkPixelOrders(std::string file, std::string options, int frames);
+
+// Renders the first animation frame frames times with every sparse tracing
+// pattern and prints the time per frame and the PSNR of the reconstructed
+// image against the one with every pixel traced
+bool BenchmarkSparseTrace(std::string file, std::string options, int frames);
+
+// Kernel benchmark: passes over the tests are repeated for this long and
+// the fastest one is kept
+const double KERNEL_BENCH_SECONDS = 0.2;
+// Shortest time passes are timed over, a few tests are passed over several
+// times in a row so the clock resolution does not decide the comparison
+const double KERNEL_BENCH_MIN_ROUND = 0.01;
+// Slowdown against the baseline that fails the kernel benchmark
+const double KERNEL_BENCH_TOLERANCE = 0.15;
+// Times a kernel that got slower is timed again, the best time counts
+const int KERNEL_BENCH_RETRIES = 2;
+// Spheres of the scene the accelerators are timed on
+const int KERNEL_BENCH_SPHERES = 4096;
+
+// Times the ray-sphere, ray-quad, shadow packet and box kernels of every
+// instruction set level the processor supports, and the closest hit query
+// of every accelerator, on tests random shapes and rays of which about
+// hitRatio hit. The seed is fixed, so runs test the same rays. Results are
+// checked against the same tests done in double precision. If the baseline
+// file exists, the times are compared with it and a kernel still more than
+// KERNEL_BENCH_TOLERANCE slower after KERNEL_BENCH_RETRIES more timings
+// fails, otherwise the times are written to it. False on wrong results or a slowdown.
+bool BenchmarkKernels(int tests, float hitRatio, std::string baseline);
+
+#endif
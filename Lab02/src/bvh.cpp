@@ -0,0 +1,324 @@
+#include <math.h>
+#include <algorithm>
+
+#include "bvh.h"
+#include "heatmap.h"
+
+const int BVH_BINS = 12;
+const int BVH_LEAF_SIZE = 2;
+const int BVH_STACK_SIZE = 64;
+
+void BVH::Build(const std::vector<Shape*>& shapes)
+{
+	nodes.clear();
+	prims = shapes;
+	primIndex.clear();
+	for (int i = 0; i < (int)prims.size(); i++)
+		primIndex.push_back(i);
+	if (prims.empty())
+		return;
+
+	std::vector<AABB> boxes;
+	boxes.reserve(prims.size());
+	for (auto s : prims)
+		boxes.push_back(s->GetBounds());
+
+	nodes.reserve(prims.size() * 2);
+	BVHNode root;
+	root.left = 0;
+	root.first = 0;
+	root.count = (int)prims.size();
+	nodes.push_back(root);
+	Subdivide(0, boxes);
+	nodes.shrink_to_fit();
+}
+
+void BVH::Subdivide(int node, std::vector<AABB>& boxes)
+{
+	int first = nodes[node].first;
+	int count = nodes[node].count;
+
+	AABB box;
+	AABB centroids;
+	for (int i = first; i < first + count; i++)
+	{
+		box.Expand(boxes[i]);
+		centroids.Expand(boxes[i].Center());
+	}
+	nodes[node].box = box;
+	if (count <= BVH_LEAF_SIZE)
+		return;
+
+	// Binned SAH split
+	int bestAxis = -1;
+	int bestSplit = 0;
+	float bestCost = count * box.Area();
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float lo = centroids.bmin[axis];
+		float hi = centroids.bmax[axis];
+		if (hi <= lo)
+			continue;
+		AABB binBoxes[BVH_BINS];
+		int binCounts[BVH_BINS] = { 0 };
+		float scale = BVH_BINS / (hi - lo);
+		for (int i = first; i < first + count; i++)
+		{
+			int b = std::min(BVH_BINS - 1, (int)((boxes[i].Center()[axis] - lo) * scale));
+			binBoxes[b].Expand(boxes[i]);
+			binCounts[b]++;
+		}
+		float rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		AABB acc;
+		int n = 0;
+		for (int b = BVH_BINS - 1; b > 0; b--)
+		{
+			acc.Expand(binBoxes[b]);
+			n += binCounts[b];
+			rightArea[b] = acc.Area();
+			rightCount[b] = n;
+		}
+		acc = AABB();
+		n = 0;
+		for (int b = 0; b < BVH_BINS - 1; b++)
+		{
+			acc.Expand(binBoxes[b]);
+			n += binCounts[b];
+			if (n == 0 || rightCount[b + 1] == 0)
+				continue;
+			float cost = n * acc.Area() + rightCount[b + 1] * rightArea[b + 1];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b + 1;
+			}
+		}
+	}
+
+	int mid = first;
+	if (bestAxis >= 0)
+	{
+		float lo = centroids.bmin[bestAxis];
+		float scale = BVH_BINS / (centroids.bmax[bestAxis] - lo);
+		for (int i = first; i < first + count; i++)
+		{
+			int b = std::min(BVH_BINS - 1, (int)((boxes[i].Center()[bestAxis] - lo) * scale));
+			if (b < bestSplit)
+			{
+				std::swap(prims[i], prims[mid]);
+				std::swap(primIndex[i], primIndex[mid]);
+				std::swap(boxes[i], boxes[mid]);
+				mid++;
+			}
+		}
+	}
+	else if (count > BVH_LEAF_SIZE * 4)
+	{
+		// No useful split (e.g. identical centroids), halve to bound leaf size
+		mid = first + count / 2;
+	}
+	if (mid == first || mid == first + count)
+		return;
+
+	int left = (int)nodes.size();
+	BVHNode child;
+	child.left = 0;
+	child.first = first;
+	child.count = mid - first;
+	nodes.push_back(child);
+	child.first = mid;
+	child.count = first + count - mid;
+	nodes.push_back(child);
+	nodes[node].left = left;
+	nodes[node].count = 0;
+
+	Subdivide(left, boxes);
+	Subdivide(left + 1, boxes);
+}
+
+void BVH::Refit()
+{
+	// Children are always stored after their parent
+	for (int i = (int)nodes.size() - 1; i >= 0; i--)
+	{
+		BVHNode& node = nodes[i];
+		AABB box;
+		if (node.count > 0)
+		{
+			for (int j = node.first; j < node.first + node.count; j++)
+				box.Expand(prims[j]->GetBounds());
+		}
+		else
+		{
+			box.Expand(nodes[node.left].box);
+			box.Expand(nodes[node.left + 1].box);
+		}
+		node.box = box;
+	}
+}
+
+AABB BVH::GetBounds()
+{
+	if (nodes.empty())
+		return AABB();
+	return nodes[0].box;
+}
+
+template <bool CountTests>
+bool BVH::ClosestHit(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim)
+{
+	if (nodes.empty())
+		return false;
+	glm::vec3 invDir = 1.0f / rayDir;
+	float currDepth = INFINITY;
+	int currIndex = -1;
+
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const BVHNode& node = nodes[stack[--top]];
+		if (!node.box.Hit(rayOrg, invDir, currDepth))
+			continue;
+		if (node.count == 0)
+		{
+			stack[top++] = node.left + 1;
+			stack[top++] = node.left;
+			continue;
+		}
+		if (CountTests)
+			heatCounters.tests += node.count;
+		for (int i = node.first; i < node.first + node.count; i++)
+		{
+			Shape* s = prims[i];
+			float depth = 0.0f;
+			Shape* prim = 0;
+			if (s->Intersect(rayOrg, rayDir, s == self ? skip : 0, depth, prim))
+			{
+				if (depth < currDepth || (depth == currDepth && primIndex[i] < currIndex))
+				{
+					currDepth = depth;
+					currIndex = primIndex[i];
+					hitObj = s;
+					hitPrim = prim;
+				}
+			}
+		}
+	}
+	if (currIndex < 0)
+		return false;
+	hitDepth = currDepth;
+	return true;
+}
+
+bool BVH::Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim)
+{
+	if (countTests)
+		return ClosestHit<true>(rayOrg, rayDir, self, skip, hitDepth, hitObj, hitPrim);
+	return ClosestHit<false>(rayOrg, rayDir, self, skip, hitDepth, hitObj, hitPrim);
+}
+
+template <bool CountTests>
+bool BVH::AnyHit(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip)
+{
+	if (nodes.empty())
+		return false;
+	glm::vec3 invDir = 1.0f / rayDir;
+
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const BVHNode& node = nodes[stack[--top]];
+		if (!node.box.Hit(rayOrg, invDir, maxDist))
+			continue;
+		if (node.count == 0)
+		{
+			stack[top++] = node.left + 1;
+			stack[top++] = node.left;
+			continue;
+		}
+		if (CountTests)
+			heatCounters.tests += node.count;
+		for (int i = node.first; i < node.first + node.count; i++)
+		{
+			Shape* s = prims[i];
+			float depth = 0.0f;
+			Shape* prim = 0;
+			if (s->Intersect(rayOrg, rayDir, s == self ? skip : 0, depth, prim))
+			{
+				if (depth < maxDist)
+					return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool BVH::Occluded(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip)
+{
+	if (countTests)
+		return AnyHit<true>(rayOrg, rayDir, maxDist, self, skip);
+	return AnyHit<false>(rayOrg, rayDir, maxDist, self, skip);
+}
+
+template <bool CountTests>
+void BVH::AnyHitPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip)
+{
+	if (nodes.empty())
+		return;
+
+	// Each entry keeps the rays that entered the parent box
+	int stack[BVH_STACK_SIZE];
+	unsigned int masks[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top] = 0;
+	masks[top] = packet.active;
+	top++;
+	while (top > 0)
+	{
+		top--;
+		const BVHNode& node = nodes[stack[top]];
+		unsigned int mask = node.box.HitPacket(rayOrg, packet, masks[top] & packet.active);
+		if (!mask)
+			continue;
+		if (node.count == 0)
+		{
+			stack[top] = node.left + 1;
+			masks[top] = mask;
+			top++;
+			stack[top] = node.left;
+			masks[top] = mask;
+			top++;
+			continue;
+		}
+		if (CountTests)
+			heatCounters.tests += node.count;
+		for (int i = node.first; i < node.first + node.count && mask; i++)
+		{
+			Shape* s = prims[i];
+			unsigned int occluded = s->OccludesPacket(rayOrg, packet, mask, s == self ? skip : 0);
+			packet.active &= ~occluded;
+			mask &= ~occluded;
+		}
+		if (!packet.active)
+			return;
+	}
+}
+
+void BVH::OccludedPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip)
+{
+	if (countTests)
+		AnyHitPacket<true>(rayOrg, packet, self, skip);
+	else
+		AnyHitPacket<false>(rayOrg, packet, self, skip);
+}
+
+size_t BVH::MemoryUsage()
+{
+	return nodes.size() * sizeof(BVHNode) + prims.size() * (sizeof(Shape*) + sizeof(int));
+}
@@ -0,0 +1,50 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "shapes.h"
+#include "accel.h"
+
+class BVHNode
+{
+public:
+	AABB box;
+	int left;	// Index of the first child, the second one is left + 1
+	int first;	// Index of the first primitive of a leaf
+	int count;	// Number of primitives, 0 for inner nodes
+};
+
+// Binary bounding volume hierarchy over a list of shapes
+class BVH : public Accelerator
+{
+public:
+	std::vector<BVHNode> nodes;
+	std::vector<Shape*> prims;
+	// Position of each primitive in the input list
+	std::vector<int> primIndex;
+
+	void Build(const std::vector<Shape*>& shapes);
+	void Refit();
+	AABB GetBounds();
+
+	bool Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim);
+	bool Occluded(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip);
+	void OccludedPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip);
+
+	size_t MemoryUsage();
+
+private:
+	// Traversals of the queries above, CountTests adds the primitives tested
+	// to heatCounters
+	template <bool CountTests>
+	bool ClosestHit(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim);
+	template <bool CountTests>
+	bool AnyHit(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip);
+	template <bool CountTests>
+	void AnyHitPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip);
+	void Subdivide(int node, std::vector<AABB>& boxes);
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include <ctype.h>
+#include <algorithm>
+
+#include "cpu.h"
+#include "simd.h"
+
+#ifdef RT_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+static void CpuId(int leaf, int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	for (int i = 0; i < 4; i++)
+		regs[i] = (unsigned int)r[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on context switches
+static unsigned long long XGetBV()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+#endif
+
+SimdLevel DetectSimdLevel()
+{
+#ifdef RT_X86
+	unsigned int regs[4];
+	CpuId(0, 0, regs);
+	unsigned int maxLeaf = regs[0];
+	CpuId(1, 0, regs);
+	bool sse2 = (regs[3] & (1 << 26)) != 0;
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	bool avx = (regs[2] & (1 << 28)) != 0;
+	if (!sse2)
+		return SimdLevel::SCALAR;
+	if (!osxsave || !avx || maxLeaf < 7)
+		return SimdLevel::SSE;
+	unsigned long long xcr0 = XGetBV();
+	// XMM and YMM state, then opmask and both halves of ZMM state
+	if ((xcr0 & 0x6) != 0x6)
+		return SimdLevel::SSE;
+	CpuId(7, 0, regs);
+	bool avx2 = (regs[1] & (1 << 5)) != 0;
+	bool avx512f = (regs[1] & (1 << 16)) != 0;
+	if (!avx2)
+		return SimdLevel::SSE;
+	if (!avx512f || (xcr0 & 0xE0) != 0xE0)
+		return SimdLevel::AVX2;
+	return SimdLevel::AVX512;
+#elif defined(RT_SSE)
+	return SimdLevel::SSE;
+#else
+	return SimdLevel::SCALAR;
+#endif
+}
+
+bool ParseSimdLevel(std::string name, SimdLevel& level)
+{
+	std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+	if (name == "SCALAR")
+		level = SimdLevel::SCALAR;
+	else if (name == "SSE")
+		level = SimdLevel::SSE;
+	else if (name == "AVX2")
+		level = SimdLevel::AVX2;
+	else if (name == "AVX512")
+		level = SimdLevel::AVX512;
+	else
+		return false;
+	return true;
+}
+
+std::string SimdLevelName(SimdLevel level)
+{
+	if (level == SimdLevel::SSE)
+		return "SSE";
+	else if (level == SimdLevel::AVX2)
+		return "AVX2";
+	else if (level == SimdLevel::AVX512)
+		return "AVX512";
+	return "SCALAR";
+}
+
+unsigned long long ReadTimestamp()
+{
+#ifdef RT_X86
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,24 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#include <string>
+
+// Instruction set levels kernels are compiled for, from oldest to newest
+enum class SimdLevel
+{
+	SCALAR,
+	SSE,
+	AVX2,
+	AVX512,
+};
+
+// Newest level both the processor and the OS support
+SimdLevel DetectSimdLevel();
+bool ParseSimdLevel(std::string name, SimdLevel& level);
+std::string SimdLevelName(SimdLevel level);
+
+// Time stamp counter, which ticks at the nominal clock of the processor
+// whatever its current frequency. 0 where there is none.
+unsigned long long ReadTimestamp();
+
+#endif
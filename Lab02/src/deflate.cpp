@@ -0,0 +1,251 @@
+#include "deflate.h"
+
+const int HASH_BITS = 15;
+const int MIN_MATCH = 3;
+const int MAX_MATCH = 258;
+
+static const int lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+static unsigned int Reverse(unsigned int code, int bits)
+{
+	unsigned int r = 0;
+	for (int i = 0; i < bits; i++)
+		r |= ((code >> i) & 1) << (bits - 1 - i);
+	return r;
+}
+
+// Fixed Huffman codes of RFC 1951, bit reversed as they are written
+// least significant bit first
+class FixedCodes
+{
+public:
+	unsigned short litCode[288];
+	unsigned char litBits[288];
+	unsigned short distCode[30];
+	unsigned char lengthSymbol[MAX_MATCH + 1];	// Index in lengthBase
+
+	FixedCodes()
+	{
+		for (int s = 0; s < 288; s++)
+		{
+			unsigned int code;
+			int bits;
+			if (s < 144)
+			{
+				code = 0x30 + s;
+				bits = 8;
+			}
+			else if (s < 256)
+			{
+				code = 0x190 + s - 144;
+				bits = 9;
+			}
+			else if (s < 280)
+			{
+				code = s - 256;
+				bits = 7;
+			}
+			else
+			{
+				code = 0xC0 + s - 280;
+				bits = 8;
+			}
+			litCode[s] = (unsigned short)Reverse(code, bits);
+			litBits[s] = (unsigned char)bits;
+		}
+		for (int d = 0; d < 30; d++)
+			distCode[d] = (unsigned short)Reverse(d, 5);
+		int s = 0;
+		for (int len = MIN_MATCH; len <= MAX_MATCH; len++)
+		{
+			while (s < 28 && len >= lengthBase[s + 1])
+				s++;
+			lengthSymbol[len] = (unsigned char)s;
+		}
+	}
+};
+
+static const FixedCodes& Codes()
+{
+	static const FixedCodes codes;
+	return codes;
+}
+
+class BitWriter
+{
+public:
+	std::vector<unsigned char>& out;
+	unsigned long long bits;
+	int count;
+
+	BitWriter(std::vector<unsigned char>& o) : out(o), bits(0), count(0) {}
+	void Put(unsigned int value, int n)
+	{
+		bits |= (unsigned long long)value << count;
+		count += n;
+		while (count >= 8)
+		{
+			out.push_back((unsigned char)bits);
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+	void Align()
+	{
+		if (count > 0)
+			out.push_back((unsigned char)bits);
+		bits = 0;
+		count = 0;
+	}
+};
+
+static void PutMatch(BitWriter& w, const FixedCodes& c, int len, int dist)
+{
+	int s = c.lengthSymbol[len];
+	w.Put(c.litCode[257 + s], c.litBits[257 + s]);
+	if (lengthExtra[s])
+		w.Put(len - lengthBase[s], lengthExtra[s]);
+	// Distance codes come in pairs per power of 2 above 4
+	unsigned int x = dist - 1;
+	if (x < 4)
+	{
+		w.Put(c.distCode[x], 5);
+		return;
+	}
+	int h = 31;
+	while (!(x >> h))
+		h--;
+	int symbol = 2 * h + ((x >> (h - 1)) & 1);
+	w.Put(c.distCode[symbol], 5);
+	w.Put(x & ((1u << (h - 1)) - 1), h - 1);
+}
+
+static unsigned int Hash3(const unsigned char* p)
+{
+	return (((unsigned int)p[0] << 16 | (unsigned int)p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+void DeflatePart(const unsigned char* data, size_t size, bool last, std::vector<unsigned char>& out)
+{
+	const FixedCodes& c = Codes();
+	BitWriter w(out);
+	w.Put(last ? 1 : 0, 1);
+	w.Put(1, 2);	// Fixed Huffman codes
+
+	// Positions are 32 bit, parts are cut well below that
+	std::vector<int> head(1 << HASH_BITS, -1);
+	std::vector<int> prev(DEFLATE_WINDOW, -1);
+	int n = (int)size;
+	int i = 0;
+	while (i < n)
+	{
+		int bestLen = 0;
+		int bestDist = 0;
+		if (i + MIN_MATCH <= n)
+		{
+			unsigned int h = Hash3(data + i);
+			int maxLen = n - i < MAX_MATCH ? n - i : MAX_MATCH;
+			int cand = head[h];
+			for (int chain = 0; cand >= 0 && i - cand <= DEFLATE_WINDOW && chain < DEFLATE_CHAIN; chain++)
+			{
+				if (data[cand + bestLen] == data[i + bestLen])
+				{
+					int len = 0;
+					while (len < maxLen && data[cand + len] == data[i + len])
+						len++;
+					if (len > bestLen)
+					{
+						bestLen = len;
+						bestDist = i - cand;
+						if (len == maxLen)
+							break;
+					}
+				}
+				// Entries of positions that left the window were reused
+				int next = prev[cand & (DEFLATE_WINDOW - 1)];
+				if (next >= cand)
+					break;
+				cand = next;
+			}
+			prev[i & (DEFLATE_WINDOW - 1)] = head[h];
+			head[h] = i;
+		}
+		if (bestLen >= MIN_MATCH)
+		{
+			PutMatch(w, c, bestLen, bestDist);
+			for (int k = i + 1; k < i + bestLen && k + MIN_MATCH <= n; k++)
+			{
+				unsigned int h = Hash3(data + k);
+				prev[k & (DEFLATE_WINDOW - 1)] = head[h];
+				head[h] = k;
+			}
+			i += bestLen;
+		}
+		else
+		{
+			w.Put(c.litCode[data[i]], c.litBits[data[i]]);
+			i++;
+		}
+	}
+	w.Put(c.litCode[256], c.litBits[256]);
+	if (!last)
+	{
+		// Empty stored block, the next part starts on a byte
+		w.Put(0, 3);
+		w.Align();
+		out.push_back(0);
+		out.push_back(0);
+		out.push_back(0xFF);
+		out.push_back(0xFF);
+	}
+	w.Align();
+}
+
+unsigned int Adler32(const unsigned char* data, size_t size, unsigned int adler)
+{
+	unsigned int a = adler & 0xFFFF;
+	unsigned int b = adler >> 16;
+	while (size > 0)
+	{
+		// Largest run before b can overflow 32 bits
+		size_t run = size < 5552 ? size : 5552;
+		size -= run;
+		for (size_t i = 0; i < run; i++)
+		{
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+class CrcTable
+{
+public:
+	unsigned int t[256];
+
+	CrcTable()
+	{
+		for (unsigned int n = 0; n < 256; n++)
+		{
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[n] = c;
+		}
+	}
+};
+
+unsigned int Crc32(const unsigned char* data, size_t size, unsigned int crc)
+{
+	static const CrcTable table;
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table.t[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
@@ -0,0 +1,21 @@
+#ifndef __DEFLATE_H__
+#define __DEFLATE_H__
+
+#include <stddef.h>
+#include <vector>
+
+// Matches are searched this many steps down the hash chain
+const int DEFLATE_CHAIN = 8;
+const int DEFLATE_WINDOW = 32768;
+
+// Compresses data into out as part of a raw deflate stream, with the fixed
+// Huffman codes. Matches never reach before data, so parts compressed on
+// their own can be concatenated in order: every part but the last ends on
+// a byte boundary with an empty stored block, the last one ends the stream.
+void DeflatePart(const unsigned char* data, size_t size, bool last, std::vector<unsigned char>& out);
+
+// Checksums of zlib and PNG, continued from the value of the data before
+unsigned int Adler32(const unsigned char* data, size_t size, unsigned int adler = 1);
+unsigned int Crc32(const unsigned char* data, size_t size, unsigned int crc = 0);
+
+#endif
@@ -0,0 +1,297 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+#include "distributed.h"
+
+#pragma warning(disable : 4996)
+
+// Seconds to wait for spawned workers to connect
+const int SPAWN_TIMEOUT = 30;
+// Seconds a worker may take for a tile, or block a send or receive, before
+// it is dropped and its tile given to another one
+const int TILE_TIMEOUT = 60;
+
+// Starts this program again as a worker of the coordinator on port
+static long long SpawnWorker(int port)
+{
+	char address[64];
+	snprintf(address, sizeof(address), "127.0.0.1:%d", port);
+#ifdef _WIN32
+	char exe[MAX_PATH];
+	GetModuleFileNameA(0, exe, MAX_PATH);
+	std::string cmd = std::string("\"") + exe + "\" -worker " + address;
+	STARTUPINFOA si;
+	PROCESS_INFORMATION pi;
+	memset(&si, 0, sizeof(si));
+	si.cb = sizeof(si);
+	if (!CreateProcessA(0, &cmd[0], 0, 0, FALSE, 0, 0, 0, &si, &pi))
+		return -1;
+	CloseHandle(pi.hThread);
+	return (long long)pi.hProcess;
+#else
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		execl("/proc/self/exe", "Lab02", "-worker", address, (char*)0);
+		_exit(1);
+	}
+	return pid;
+#endif
+}
+
+static void WaitChild(long long child)
+{
+#ifdef _WIN32
+	WaitForSingleObject((HANDLE)child, INFINITE);
+	CloseHandle((HANDLE)child);
+#else
+	waitpid((pid_t)child, 0, 0);
+#endif
+}
+
+Coordinator::Coordinator()
+{
+	listener = INVALID_SOCK;
+}
+
+Coordinator::~Coordinator()
+{
+	MessageHeader msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = (int)MessageType::QUIT;
+	for (auto& w : workers)
+	{
+		NetSend(w.socket, &msg, sizeof(msg));
+		NetClose(w.socket);
+	}
+	workers.clear();
+	if (listener != INVALID_SOCK)
+		NetClose(listener);
+	for (auto c : children)
+		WaitChild(c);
+}
+
+bool Coordinator::Start(std::string file, std::string options, int port, int spawnCount)
+{
+	if (!NetInit())
+	{
+		std::cout << "Failed to initialize sockets" << std::endl;
+		return false;
+	}
+	if (!Scene::ReadSceneFile(file, options, sceneText) || !local.LoadSceneText(sceneText))
+		return false;
+	local.ReportMemoryUsage();
+	listener = NetListen(port);
+	if (listener == INVALID_SOCK)
+	{
+		std::cout << "Failed to listen on port " << port << std::endl;
+		return false;
+	}
+	port = NetLocalPort(listener);
+	std::cout << "Waiting for workers on port " << port << std::endl;
+
+	for (int i = 0; i < spawnCount; i++)
+	{
+		long long child = SpawnWorker(port);
+		if (child == -1)
+			std::cout << "Failed to start a local worker" << std::endl;
+		else
+			children.push_back(child);
+	}
+	std::vector<Socket> sockets(1, listener);
+	std::vector<bool> ready;
+	while ((int)workers.size() < (int)children.size())
+	{
+		if (!NetWait(sockets, SPAWN_TIMEOUT * 1000, ready))
+		{
+			std::cout << "Only " << workers.size() << " of " << children.size() << " local workers connected" << std::endl;
+			break;
+		}
+		AcceptWorker();
+	}
+	return true;
+}
+
+glm::ivec2 Coordinator::GetResolution()
+{
+	return local.GetResolution();
+}
+
+void Coordinator::AcceptWorker()
+{
+	Worker w;
+	w.socket = NetAccept(listener);
+	w.tile = -1;
+	if (w.socket == INVALID_SOCK)
+		return;
+	// A worker that stops halfway through a message can't stall the frame
+	NetSetTimeout(w.socket, TILE_TIMEOUT * 1000);
+	MessageHeader msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = (int)MessageType::SCENE;
+	msg.size = (int)sceneText.size();
+	if (!NetSend(w.socket, &msg, sizeof(msg)) || !NetSend(w.socket, sceneText.data(), sceneText.size()))
+	{
+		NetClose(w.socket);
+		return;
+	}
+	workers.push_back(w);
+}
+
+void Coordinator::DropWorker(int w, std::vector<int>& queue)
+{
+	std::cout << "Lost a worker, " << workers.size() - 1 << " left" << std::endl;
+	if (workers[w].tile >= 0)
+		queue.push_back(workers[w].tile);
+	NetClose(workers[w].socket);
+	workers.erase(workers.begin() + w);
+}
+
+void Coordinator::RenderFrame(int frame, GLubyte* out)
+{
+	glm::ivec2 res = GetResolution();
+	std::vector<glm::ivec4> tiles;	// x, y, w, h
+	for (int y = 0; y < res.y; y += TILE_SIZE)
+		for (int x = 0; x < res.x; x += TILE_SIZE)
+			tiles.push_back(glm::ivec4(x, y, glm::min(TILE_SIZE, res.x - x), glm::min(TILE_SIZE, res.y - y)));
+	// Tiles left to hand out, taken from the back
+	std::vector<int> queue;
+	for (int i = (int)tiles.size() - 1; i >= 0; i--)
+		queue.push_back(i);
+
+	std::vector<GLubyte> pixels(TILE_SIZE * TILE_SIZE * 3);
+	int done = 0;
+	while (done < (int)tiles.size())
+	{
+		// Keep every worker busy
+		for (int w = 0; w < (int)workers.size() && !queue.empty(); w++)
+		{
+			if (workers[w].tile >= 0)
+				continue;
+			int t = queue.back();
+			queue.pop_back();
+			workers[w].tile = t;
+			workers[w].deadline = std::chrono::steady_clock::now() + std::chrono::seconds(TILE_TIMEOUT);
+			MessageHeader msg;
+			msg.type = (int)MessageType::TILE;
+			msg.frame = frame;
+			msg.x = tiles[t].x;
+			msg.y = tiles[t].y;
+			msg.w = tiles[t].z;
+			msg.h = tiles[t].w;
+			msg.size = 0;
+			if (!NetSend(workers[w].socket, &msg, sizeof(msg)))
+				DropWorker(w--, queue);
+		}
+
+		std::vector<Socket> sockets(1, listener);
+		std::vector<int> busy;
+		auto now = std::chrono::steady_clock::now();
+		auto deadline = now + std::chrono::seconds(TILE_TIMEOUT);
+		for (int w = 0; w < (int)workers.size(); w++)
+		{
+			if (workers[w].tile < 0)
+				continue;
+			sockets.push_back(workers[w].socket);
+			busy.push_back(w);
+			if (workers[w].deadline < deadline)
+				deadline = workers[w].deadline;
+		}
+		std::vector<bool> ready;
+		if (busy.empty())
+		{
+			// Nobody to give the tiles to, render one here and look for new workers
+			int t = queue.back();
+			queue.pop_back();
+			local.RenderTile(frame, glm::ivec2(tiles[t].x, tiles[t].y), glm::ivec2(tiles[t].z, tiles[t].w), &pixels[0]);
+			for (int i = 0; i < tiles[t].w; i++)
+				memcpy(&out[((res.y - 1 - tiles[t].y - i) * res.x + tiles[t].x) * 3], &pixels[i * tiles[t].z * 3], tiles[t].z * 3);
+			done++;
+			if (NetWait(std::vector<Socket>(1, listener), 0, ready))
+				AcceptWorker();
+			continue;
+		}
+
+		// Wake up when the first tile is due, to drop a worker that hangs
+		long long waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+		NetWait(sockets, waitMs > 0 ? (int)waitMs + 1 : 0, ready);
+		now = std::chrono::steady_clock::now();
+		// Back to front, dropping a worker moves the ones after it
+		for (int b = (int)busy.size() - 1; b >= 0; b--)
+		{
+			int w = busy[b];
+			if (!ready[b + 1])
+			{
+				if (now >= workers[w].deadline)
+				{
+					std::cout << "A worker took more than " << TILE_TIMEOUT << " s for a tile" << std::endl;
+					DropWorker(w, queue);
+				}
+				continue;
+			}
+			int t = workers[w].tile;
+			MessageHeader msg;
+			int size = tiles[t].z * tiles[t].w * 3;
+			if (!NetRecv(workers[w].socket, &msg, sizeof(msg)) || msg.type != (int)MessageType::RESULT ||
+				msg.frame != frame || msg.x != tiles[t].x || msg.y != tiles[t].y || msg.size != size ||
+				!NetRecv(workers[w].socket, &pixels[0], size))
+			{
+				DropWorker(w, queue);
+				continue;
+			}
+			for (int i = 0; i < tiles[t].w; i++)
+				memcpy(&out[((res.y - 1 - tiles[t].y - i) * res.x + tiles[t].x) * 3], &pixels[i * tiles[t].z * 3], tiles[t].z * 3);
+			workers[w].tile = -1;
+			done++;
+		}
+		if (ready[0])
+			AcceptWorker();
+	}
+}
+
+bool RunWorker(std::string host, int port)
+{
+	if (!NetInit())
+		return false;
+	Socket s = NetConnect(host, port);
+	if (s == INVALID_SOCK)
+	{
+		std::cout << "Failed to connect to " << host << ":" << port << std::endl;
+		return false;
+	}
+	MessageHeader msg;
+	std::string text;
+	if (!NetRecv(s, &msg, sizeof(msg)) || msg.type != (int)MessageType::SCENE)
+	{
+		NetClose(s);
+		return false;
+	}
+	text.resize(msg.size);
+	RayTracer raytracer;
+	if (!NetRecv(s, &text[0], text.size()) || !raytracer.LoadSceneText(text))
+	{
+		NetClose(s);
+		return false;
+	}
+
+	std::vector<GLubyte> pixels;
+	while (NetRecv(s, &msg, sizeof(msg)) && msg.type == (int)MessageType::TILE)
+	{
+		pixels.resize(msg.w * msg.h * 3);
+		raytracer.RenderTile(msg.frame, glm::ivec2(msg.x, msg.y), glm::ivec2(msg.w, msg.h), &pixels[0]);
+		msg.type = (int)MessageType::RESULT;
+		msg.size = (int)pixels.size();
+		if (!NetSend(s, &msg, sizeof(msg)) || !NetSend(s, &pixels[0], pixels.size()))
+			break;
+	}
+	NetClose(s);
+	return true;
+}
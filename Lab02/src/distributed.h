@@ -0,0 +1,72 @@
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "net.h"
+#include "raytracer.h"
+
+enum class MessageType
+{
+	SCENE,	// Coordinator to worker: contents of the scene file
+	TILE,	// Coordinator to worker: render a tile
+	RESULT,	// Worker to coordinator: pixels of a tile
+	QUIT,
+};
+
+// Every message is a header followed by size bytes. Workers and the
+// coordinator must have the same byte order.
+class MessageHeader
+{
+public:
+	int type;
+	int frame;
+	int x, y;	// Top left pixel of the tile
+	int w, h;
+	int size;
+};
+
+// Renders frames by splitting them into tiles and handing the tiles to
+// worker processes, connected over TCP. Workers can join at any time, tiles
+// of a worker that disconnects or takes longer than TILE_TIMEOUT are given
+// to another one. When no worker is
+// connected the coordinator renders the tiles itself.
+class Coordinator
+{
+private:
+	class Worker
+	{
+	public:
+		Socket socket;
+		int tile;	// Tile being rendered, -1 if idle
+		std::chrono::steady_clock::time_point deadline;	// When the tile is given up on
+	};
+
+	std::string sceneText;
+	RayTracer local;	// Used when there are no workers
+	Socket listener;
+	std::vector<Worker> workers;
+	std::vector<long long> children;	// Spawned local workers
+
+	void AcceptWorker();
+	void DropWorker(int w, std::vector<int>& queue);
+
+public:
+	Coordinator();
+	~Coordinator();
+	// Loads the scene, listens on port (0 for any free port) and starts
+	// spawnCount local worker processes
+	bool Start(std::string file, std::string options, int port, int spawnCount);
+	glm::ivec2 GetResolution();
+	// Same image as RayTracer::RenderFrame(frame), written to out
+	void RenderFrame(int frame, GLubyte* out);
+};
+
+// Connects to a coordinator and renders tiles until it disconnects
+bool RunWorker(std::string host, int port);
+
+#endif
@@ -0,0 +1,224 @@
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+
+#include "encodequeue.h"
+#include "timeline.h"
+
+#pragma warning(disable : 4996)
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+EncodeSettings::EncodeSettings()
+{
+	encoders = 2;
+	queueSize = 8;
+	strips = 1;
+	syncEvery = 0;
+}
+
+EncodeQueue::EncodeQueue()
+{
+	reserved = 0;
+	closing = false;
+	failed = false;
+	frames = 0;
+	inputBytes = 0;
+	outputBytes = 0;
+	encodeSeconds = 0.0;
+	writeSeconds = 0.0;
+	waitSeconds = 0.0;
+	format = ImageFormat::PPM;
+}
+
+EncodeQueue::~EncodeQueue()
+{
+	Finish();
+	for (EncodeJob* job : freeJobs)
+		delete job;
+}
+
+void EncodeQueue::Start(const EncodeSettings& settings)
+{
+	Finish();
+	this->settings = settings;
+	if (this->settings.encoders < 1)
+		this->settings.encoders = 1;
+	if (this->settings.queueSize < 1)
+		this->settings.queueSize = 1;
+	closing = false;
+	failed = false;
+	for (int i = 0; i < this->settings.encoders; i++)
+		threads.push_back(std::thread(&EncodeQueue::Run, this));
+}
+
+void EncodeQueue::Push(std::string file, const GLubyte* img, glm::ivec2 res)
+{
+	EncodeJob* job = 0;
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		if ((int)(jobs.size()) + reserved >= settings.queueSize)
+		{
+			TimelineScope scope("QueueFull");
+			auto start = std::chrono::steady_clock::now();
+			notFull.wait(guard, [this]() { return (int)jobs.size() + reserved < settings.queueSize; });
+			waitSeconds += Seconds(start);
+		}
+		reserved++;
+		if (!freeJobs.empty())
+		{
+			job = freeJobs.back();
+			freeJobs.pop_back();
+		}
+	}
+	// The copy is made outside the lock, other threads keep pushing
+	if (!job)
+		job = new EncodeJob;
+	job->file = file;
+	job->res = res;
+	job->img.assign(img, img + (size_t)res.x * res.y * 3);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		reserved--;
+		jobs.push_back(job);
+		format = ImageFormatOf(file);
+	}
+	notEmpty.notify_one();
+}
+
+void EncodeQueue::Run()
+{
+	TimelineNameThread("encoder");
+	std::vector<unsigned char> data;
+	while (1)
+	{
+		EncodeJob* job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			notEmpty.wait(guard, [this]() { return closing || !jobs.empty(); });
+			if (jobs.empty())
+				return;
+			job = jobs.front();
+			jobs.pop_front();
+		}
+		notFull.notify_one();
+
+		auto start = std::chrono::steady_clock::now();
+		{
+			TimelineScope scope("Encode");
+			EncodeImage(ImageFormatOf(job->file), &job->img[0], job->res, settings.strips, data);
+		}
+		double encoded = Seconds(start);
+		start = std::chrono::steady_clock::now();
+		bool ok;
+		{
+			TimelineScope scope("Write");
+			ok = WriteBytes(job->file, data);
+		}
+		double written = Seconds(start);
+
+		std::vector<std::string> batch;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			frames++;
+			inputBytes += job->img.size();
+			outputBytes += data.size();
+			encodeSeconds += encoded;
+			writeSeconds += written;
+			failed = failed || !ok;
+			if (ok && settings.syncEvery > 0)
+			{
+				unsynced.push_back(job->file);
+				if ((int)unsynced.size() >= settings.syncEvery)
+					batch.swap(unsynced);
+			}
+			freeJobs.push_back(job);
+		}
+		if (!batch.empty())
+		{
+			start = std::chrono::steady_clock::now();
+			Sync(batch);
+			std::lock_guard<std::mutex> guard(lock);
+			writeSeconds += Seconds(start);
+		}
+	}
+}
+
+// Makes the files of a batch durable. On Linux one syncfs covers them all.
+void EncodeQueue::Sync(const std::vector<std::string>& files)
+{
+	TimelineScope scope("Sync");
+#ifdef _WIN32
+	for (const std::string& file : files)
+	{
+		int fd = _open(file.c_str(), _O_RDWR | _O_BINARY);
+		if (fd < 0)
+			continue;
+		_commit(fd);
+		_close(fd);
+	}
+#elif defined(__linux__)
+	int fd = open(files.back().c_str(), O_RDONLY);
+	if (fd >= 0)
+	{
+		syncfs(fd);
+		close(fd);
+	}
+#else
+	for (const std::string& file : files)
+	{
+		int fd = open(file.c_str(), O_RDONLY);
+		if (fd < 0)
+			continue;
+		fsync(fd);
+		close(fd);
+	}
+#endif
+}
+
+bool EncodeQueue::Finish()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closing = true;
+	}
+	notEmpty.notify_all();
+	for (std::thread& t : threads)
+		t.join();
+	threads.clear();
+	if (!unsynced.empty())
+	{
+		auto start = std::chrono::steady_clock::now();
+		Sync(unsynced);
+		unsynced.clear();
+		writeSeconds += Seconds(start);
+	}
+	return !failed;
+}
+
+void EncodeQueue::Report()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (frames == 0)
+		return;
+	double mb = 1024.0 * 1024.0;
+	std::cout << "Encoded " << frames << " frames as " << ImageFormatName(format) << " on " << settings.encoders << " threads: "
+		<< outputBytes / mb << " MB (" << 100.0 * outputBytes / inputBytes << "% of raw), "
+		<< frames / encodeSeconds << " frames/s and " << inputBytes / mb / encodeSeconds << " MB/s per thread encoding, "
+		<< writeSeconds * 1000.0 / frames << " ms per frame writing" << std::endl;
+	std::cout << "Rendering waited " << waitSeconds * 1000.0 << " ms for a full queue of " << settings.queueSize << " frames" << std::endl;
+}
@@ -0,0 +1,77 @@
+#ifndef __ENCODEQUEUE_H__
+#define __ENCODEQUEUE_H__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "image.h"
+
+// How finished frames are written by batch rendering
+class EncodeSettings
+{
+public:
+	int encoders;	// Threads encoding and writing frames
+	int queueSize;	// Frames waiting for an encoder before rendering waits
+	int strips;		// PNG strips of a frame compressed in parallel
+	int syncEvery;	// Written files are fsynced in batches of this many, 0 for never
+
+	EncodeSettings();
+};
+
+// A frame waiting in the queue
+class EncodeJob
+{
+public:
+	std::string file;
+	std::vector<GLubyte> img;
+	glm::ivec2 res;
+};
+
+// Frames go into a bounded queue and are encoded and written by a pool of
+// threads, so tracing only waits for the disk when the queue is full
+class EncodeQueue
+{
+public:
+	EncodeQueue();
+	~EncodeQueue();
+	void Start(const EncodeSettings& settings);
+	// Copies the image into the queue, waits while the queue is full. Can be
+	// called from several threads.
+	void Push(std::string file, const GLubyte* img, glm::ivec2 res);
+	// Waits until every frame is written and synced, false if any failed
+	bool Finish();
+	// Frames and bytes written, encoder time and the time rendering waited
+	void Report();
+
+private:
+	EncodeSettings settings;
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+	std::deque<EncodeJob*> jobs;
+	std::vector<EncodeJob*> freeJobs;	// Image buffers kept for the next frames
+	int reserved;	// Slots taken by frames being copied in
+	bool closing;
+	bool failed;
+	std::vector<std::string> unsynced;
+
+	int frames;
+	size_t inputBytes;
+	size_t outputBytes;
+	double encodeSeconds;
+	double writeSeconds;
+	double waitSeconds;
+	ImageFormat format;
+
+	void Run();
+	void Sync(const std::vector<std::string>& files);
+};
+
+#endif
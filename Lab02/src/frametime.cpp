@@ -0,0 +1,63 @@
+#include <math.h>
+
+#include "frametime.h"
+
+// Weight of the last frame in the smoothed time per sample
+const float FRAME_TIME_SMOOTHING = 0.25f;
+// Relative scale changes below this are ignored, so the resolution does not
+// flicker between close values
+const float SCALE_DEADBAND = 0.05f;
+// Antialiasing is lowered only once the resolution would drop below this,
+// otherwise frames near the target alternate between two levels
+const float KEEP_ANTIALIAS_SCALE = 0.85f;
+
+FrameTimeController::FrameTimeController()
+{
+	Setup(0.0f, 1.0f, 1, 1);
+}
+
+void FrameTimeController::Setup(float targetMs, float minScale, int minAntialias, int maxAntialias)
+{
+	this->targetMs = targetMs;
+	this->minScale = glm::clamp(minScale, 0.01f, 1.0f);
+	this->maxAntialias = glm::max(maxAntialias, 1);
+	this->minAntialias = glm::clamp(minAntialias, 1, this->maxAntialias);
+	scale = 1.0f;
+	antialias = this->maxAntialias;
+	lastMs = 0.0f;
+	msPerSample = 0.0f;
+}
+
+void FrameTimeController::Update(float ms)
+{
+	lastMs = ms;
+	float samples = scale * scale * antialias * antialias;
+	float cost = ms / samples;
+	if (msPerSample > 0.0f)
+		msPerSample += FRAME_TIME_SMOOTHING * (cost - msPerSample);
+	else
+		msPerSample = cost;
+	if (msPerSample <= 0.0f)
+		return;
+
+	// Native pixels per output pixel along an axis that fit the target,
+	// spent first on resolution and the rest on antialiasing
+	float budget = sqrtf(targetMs / msPerSample);
+	int aa = glm::clamp((int)budget, minAntialias, maxAntialias);
+	if (aa < antialias && budget >= antialias * KEEP_ANTIALIAS_SCALE)
+		aa = antialias;
+	float s = glm::clamp(budget / aa, minScale, 1.0f);
+	if (aa != antialias || fabsf(s - scale) > SCALE_DEADBAND * scale)
+	{
+		antialias = aa;
+		scale = s;
+	}
+}
+
+glm::ivec2 FrameTimeController::Resolution(glm::ivec2 full)
+{
+	glm::ivec2 res;
+	res.x = glm::max((int)(full.x * scale + 0.5f), 1);
+	res.y = glm::max((int)(full.y * scale + 0.5f), 1);
+	return res;
+}
@@ -0,0 +1,33 @@
+#ifndef __FRAMETIME_H__
+#define __FRAMETIME_H__
+
+#include <glm/glm.hpp>
+
+// Picks the render resolution and antialiasing of each frame from the time
+// the last frames took, to keep frames near a target time. The time of a
+// frame is taken as proportional to the number of native pixels.
+class FrameTimeController
+{
+public:
+	float targetMs;
+	float minScale;
+	int minAntialias;
+	int maxAntialias;
+	// Settings of the next frame, scale is the render resolution over the
+	// output resolution along each axis
+	float scale;
+	int antialias;
+	float lastMs;
+
+	FrameTimeController();
+	void Setup(float targetMs, float minScale, int minAntialias, int maxAntialias);
+	// Adjusts scale and antialias after a frame rendered with them took ms
+	void Update(float ms);
+	// Render resolution for output resolution full
+	glm::ivec2 Resolution(glm::ivec2 full);
+
+private:
+	float msPerSample;	// Smoothed frame time over (scale * antialias)^2
+};
+
+#endif
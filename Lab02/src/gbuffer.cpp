@@ -0,0 +1,47 @@
+#include "gbuffer.h"
+
+// Relative depth difference at which a neighbor counts half
+const float GBUFFER_DEPTH_SIGMA = 0.02f;
+// Exponent of the normal term, (1 + cos) / 2 to this power
+const int GBUFFER_NORMAL_POWER = 8;
+// Factor for neighbors on other objects, used only when no neighbor is on
+// the same one
+const float GBUFFER_OTHER_OBJECT = 1e-4f;
+
+bool ParseSparsePattern(std::string name, SparsePattern& pattern)
+{
+	if (name == "NONE")
+		pattern = SparsePattern::NONE;
+	else if (name == "CHECKERBOARD")
+		pattern = SparsePattern::CHECKERBOARD;
+	else if (name == "HALF")
+		pattern = SparsePattern::HALF;
+	else
+		return false;
+	return true;
+}
+
+std::string SparsePatternName(SparsePattern pattern)
+{
+	if (pattern == SparsePattern::CHECKERBOARD)
+		return "CHECKERBOARD";
+	else if (pattern == SparsePattern::HALF)
+		return "HALF";
+	return "NONE";
+}
+
+float GBufferWeight(const GBufferSample& pixel, const GBufferSample& neighbor, int di, int dj)
+{
+	float w = 1.0f / (float)(di * di + dj * dj);
+	if (pixel.object != neighbor.object)
+		return w * GBUFFER_OTHER_OBJECT;
+	if (!pixel.object)
+		return w;
+	float d = (pixel.depth - neighbor.depth) / (GBUFFER_DEPTH_SIGMA * pixel.depth);
+	w /= 1.0f + d * d;
+	float c = 0.5f + 0.5f * glm::dot(pixel.normal, neighbor.normal);
+	for (int k = 0; k < GBUFFER_NORMAL_POWER; k++)
+		w *= c;
+	// Opposite normals still leave a tiny weight, so the sum is never 0
+	return glm::max(w, 1e-12f);
+}
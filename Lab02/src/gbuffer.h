@@ -0,0 +1,45 @@
+#ifndef __GBUFFER_H__
+#define __GBUFFER_H__
+
+#include <string>
+#include <glm/glm.hpp>
+
+#include "shapes.h"
+
+// Native pixels traced by SPARSETRACE, the others are reconstructed from
+// their traced neighbors
+enum class SparsePattern
+{
+	NONE,			// Every pixel is traced
+	CHECKERBOARD,	// Pixels with i + j even, half of them
+	HALF,			// Pixels with i and j even, a quarter of them
+};
+
+bool ParseSparsePattern(std::string name, SparsePattern& pattern);
+std::string SparsePatternName(SparsePattern pattern);
+
+inline bool IsTracedPixel(SparsePattern pattern, int i, int j)
+{
+	if (pattern == SparsePattern::CHECKERBOARD)
+		return ((i + j) & 1) == 0;
+	if (pattern == SparsePattern::HALF)
+		return ((i | j) & 1) == 0;
+	return true;
+}
+
+// Primary hit of a native pixel
+class GBufferSample
+{
+public:
+	float depth;		// Distance along the ray, INF for none
+	glm::vec3 normal;
+	Shape* object;		// Object or instance hit, 0 for none
+	Shape* prim;		// Primitive hit, the object itself for shapes
+	bool valid;			// Kept from an earlier frame by PRIMARYCACHE, Trace uses it as is
+};
+
+// Weight of the color of a traced pixel for a reconstructed one, from how
+// much their hits look like the same surface. Neighbors di, dj away.
+float GBufferWeight(const GBufferSample& pixel, const GBufferSample& neighbor, int di, int dj);
+
+#endif
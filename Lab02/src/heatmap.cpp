@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <chrono>
+#include <iostream>
+
+#include "heatmap.h"
+#include "simd.h"
+#include "cpu.h"
+
+#pragma warning(disable : 4996)
+
+thread_local HeatCounters heatCounters = { 0, 0, 0 };
+
+bool ParseHeatmapMode(std::string name, HeatmapMode& mode)
+{
+	if (name == "NONE")
+		mode = HeatmapMode::NONE;
+	else if (name == "TESTS")
+		mode = HeatmapMode::TESTS;
+	else if (name == "SHADOWS")
+		mode = HeatmapMode::SHADOWS;
+	else if (name == "DEPTH")
+		mode = HeatmapMode::DEPTH;
+	else if (name == "CYCLES")
+		mode = HeatmapMode::CYCLES;
+	else
+		return false;
+	return true;
+}
+
+std::string HeatmapModeName(HeatmapMode mode)
+{
+	if (mode == HeatmapMode::TESTS)
+		return "TESTS";
+	else if (mode == HeatmapMode::SHADOWS)
+		return "SHADOWS";
+	else if (mode == HeatmapMode::DEPTH)
+		return "DEPTH";
+	else if (mode == HeatmapMode::CYCLES)
+		return "CYCLES";
+	return "NONE";
+}
+
+unsigned long long HeatClock()
+{
+#ifdef RT_X86
+	return ReadTimestamp();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+glm::vec3 HeatColor(float v)
+{
+	static const glm::vec3 palette[5] =
+	{
+		glm::vec3(0.0f, 0.0f, 1.0f),
+		glm::vec3(0.0f, 1.0f, 1.0f),
+		glm::vec3(0.0f, 1.0f, 0.0f),
+		glm::vec3(1.0f, 1.0f, 0.0f),
+		glm::vec3(1.0f, 0.0f, 0.0f),
+	};
+	float x = glm::clamp(v, 0.0f, 1.0f) * 4.0f;
+	int k = glm::min((int)x, 3);
+	return glm::mix(palette[k], palette[k + 1], x - k);
+}
+
+bool WriteHeatCounts(std::string file, HeatmapMode mode, glm::ivec2 res, const std::vector<double>& values)
+{
+	FILE* f = fopen(file.c_str(), "w");
+	if (!f)
+	{
+		std::cout << "Can't write heatmap: " << file << std::endl;
+		return false;
+	}
+	fprintf(f, "HEATMAP %s %d %d\n", HeatmapModeName(mode).c_str(), res.x, res.y);
+	for (int i = 0; i < res.y; i++)
+	{
+		for (int j = 0; j < res.x; j++)
+			fprintf(f, j == 0 ? "%.0f" : " %.0f", values[(size_t)i * res.x + j]);
+		fprintf(f, "\n");
+	}
+	bool ok = fclose(f) == 0;
+	if (!ok)
+		std::cout << "Can't write heatmap: " << file << std::endl;
+	return ok;
+}
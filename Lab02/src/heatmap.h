@@ -0,0 +1,47 @@
+#ifndef __HEATMAP_H__
+#define __HEATMAP_H__
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Cost of a pixel a HEATMAP frame shows instead of its color
+enum class HeatmapMode
+{
+	NONE,		// Colors are rendered
+	TESTS,		// Primitive intersection tests, those of instance geometries too
+	SHADOWS,	// Shadow rays, answered by a visibility cache or traced
+	DEPTH,		// Deepest reflection reached
+	CYCLES,		// Time stamp counter ticks spent on the pixel
+};
+
+bool ParseHeatmapMode(std::string name, HeatmapMode& mode);
+std::string HeatmapModeName(HeatmapMode mode);
+
+// Fraction of the output pixels below the value drawn red, so a few
+// outliers do not leave the rest of the map blue
+const double HEATMAP_PERCENTILE = 0.999;
+
+// Work done by the calling thread, only counted while a heatmap of it is
+// rendered. A pixel costs the difference over its trace.
+class HeatCounters
+{
+public:
+	unsigned long long tests;
+	unsigned long long shadowRays;
+	int depth;	// Deepest reflection since it was last reset
+};
+
+extern thread_local HeatCounters heatCounters;
+
+// Ticks of the time stamp counter, nanoseconds where there is none
+unsigned long long HeatClock();
+
+// Blue through cyan, green and yellow to red for v from 0 to 1
+glm::vec3 HeatColor(float v);
+
+// Writes the values of a res.x x res.y heatmap as text, a header line with
+// the mode and the size and then one line per row from the top
+bool WriteHeatCounts(std::string file, HeatmapMode mode, glm::ivec2 res, const std::vector<double>& values);
+
+#endif
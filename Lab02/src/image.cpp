@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <iostream>
+#include <limits>
+
+#include "image.h"
+#include "deflate.h"
+
+#pragma warning(disable : 4996)
+
+ImageFormat ImageFormatOf(std::string file)
+{
+	size_t dot = file.rfind('.');
+	std::string ext = dot == std::string::npos ? "" : file.substr(dot + 1);
+	for (char& c : ext)
+		c = (char)tolower(c);
+	if (ext == "png")
+		return ImageFormat::PNG;
+	if (ext == "qoi")
+		return ImageFormat::QOI;
+	return ImageFormat::PPM;
+}
+
+std::string ImageFormatName(ImageFormat format)
+{
+	if (format == ImageFormat::PNG)
+		return "PNG";
+	else if (format == ImageFormat::QOI)
+		return "QOI";
+	return "PPM";
+}
+
+static void PutBigEndian(std::vector<unsigned char>& out, unsigned int v)
+{
+	out.push_back((unsigned char)(v >> 24));
+	out.push_back((unsigned char)(v >> 16));
+	out.push_back((unsigned char)(v >> 8));
+	out.push_back((unsigned char)v);
+}
+
+static void EncodePPM(const GLubyte* img, glm::ivec2 res, std::vector<unsigned char>& out)
+{
+	char header[64];
+	int n = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", res.x, res.y);
+	out.insert(out.end(), header, header + n);
+	for (int i = res.y - 1; i >= 0; i--)
+		out.insert(out.end(), img + (size_t)i * res.x * 3, img + (size_t)(i + 1) * res.x * 3);
+}
+
+static void EncodeQOI(const GLubyte* img, glm::ivec2 res, std::vector<unsigned char>& out)
+{
+	const char magic[] = "qoif";
+	out.insert(out.end(), magic, magic + 4);
+	PutBigEndian(out, res.x);
+	PutBigEndian(out, res.y);
+	out.push_back(3);	// RGB
+	out.push_back(0);	// sRGB
+	// Entries start as transparent black, which no pixel here matches
+	unsigned char seen[64][3] = {};
+	bool filled[64] = {};
+	unsigned char last[3] = { 0, 0, 0 };
+	int run = 0;
+	for (int i = res.y - 1; i >= 0; i--)
+	{
+		const GLubyte* row = img + (size_t)i * res.x * 3;
+		for (int j = 0; j < res.x; j++)
+		{
+			const GLubyte* p = row + j * 3;
+			if (p[0] == last[0] && p[1] == last[1] && p[2] == last[2])
+			{
+				if (++run == 62)
+				{
+					out.push_back((unsigned char)(0xC0 | (run - 1)));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0)
+			{
+				out.push_back((unsigned char)(0xC0 | (run - 1)));
+				run = 0;
+			}
+			// Alpha is always 255
+			int index = (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+			if (filled[index] && seen[index][0] == p[0] && seen[index][1] == p[1] && seen[index][2] == p[2])
+				out.push_back((unsigned char)index);
+			else
+			{
+				filled[index] = true;
+				seen[index][0] = p[0];
+				seen[index][1] = p[1];
+				seen[index][2] = p[2];
+				signed char dr = (signed char)(p[0] - last[0]);
+				signed char dg = (signed char)(p[1] - last[1]);
+				signed char db = (signed char)(p[2] - last[2]);
+				signed char drg = (signed char)(dr - dg);
+				signed char dbg = (signed char)(db - dg);
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+					out.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+				else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+				{
+					out.push_back((unsigned char)(0x80 | (dg + 32)));
+					out.push_back((unsigned char)((drg + 8) << 4 | (dbg + 8)));
+				}
+				else
+				{
+					out.push_back(0xFE);
+					out.push_back(p[0]);
+					out.push_back(p[1]);
+					out.push_back(p[2]);
+				}
+			}
+			last[0] = p[0];
+			last[1] = p[1];
+			last[2] = p[2];
+		}
+	}
+	if (run > 0)
+		out.push_back((unsigned char)(0xC0 | (run - 1)));
+	const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	out.insert(out.end(), end, end + 8);
+}
+
+static int Paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// Prediction of filter f (None, Sub, Up, Average, Paeth) from the bytes to
+// the left (a), above (b) and above left (c)
+static int Predict(int f, int a, int b, int c)
+{
+	if (f == 1)
+		return a;
+	else if (f == 2)
+		return b;
+	else if (f == 3)
+		return (a + b) / 2;
+	else if (f == 4)
+		return Paeth(a, b, c);
+	return 0;
+}
+
+// Filters a row of width RGB pixels into dst, the filter byte first. The
+// filter with the smallest sum of absolute values is kept. Prior is the
+// row above, 0 for the first row.
+static void FilterRow(const GLubyte* row, const GLubyte* prior, int width, unsigned char* dst)
+{
+	int bytes = width * 3;
+	long long best = -1;
+	int bestFilter = 0;
+	for (int f = 0; f < 5; f++)
+	{
+		long long sum = 0;
+		for (int k = 0; k < bytes; k++)
+		{
+			int a = k >= 3 ? row[k - 3] : 0;
+			int b = prior ? prior[k] : 0;
+			int c = k >= 3 && prior ? prior[k - 3] : 0;
+			sum += abs((signed char)(row[k] - Predict(f, a, b, c)));
+		}
+		if (best < 0 || sum < best)
+		{
+			best = sum;
+			bestFilter = f;
+		}
+	}
+	dst[0] = (unsigned char)bestFilter;
+	for (int k = 0; k < bytes; k++)
+	{
+		int a = k >= 3 ? row[k - 3] : 0;
+		int b = prior ? prior[k] : 0;
+		int c = k >= 3 && prior ? prior[k - 3] : 0;
+		dst[k + 1] = (unsigned char)(row[k] - Predict(bestFilter, a, b, c));
+	}
+}
+
+static void PutChunk(std::vector<unsigned char>& out, const char* type, const unsigned char* data, size_t size)
+{
+	PutBigEndian(out, (unsigned int)size);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	if (size > 0)
+		out.insert(out.end(), data, data + size);
+	PutBigEndian(out, Crc32(&out[start], size + 4));
+}
+
+static void EncodePNG(const GLubyte* img, glm::ivec2 res, int strips, std::vector<unsigned char>& out)
+{
+	const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	out.insert(out.end(), signature, signature + 8);
+	std::vector<unsigned char> header;
+	PutBigEndian(header, res.x);
+	PutBigEndian(header, res.y);
+	header.push_back(8);	// Bits per channel
+	header.push_back(2);	// RGB
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	PutChunk(out, "IHDR", &header[0], header.size());
+
+	// Rows go top down, filtered against the row above
+	size_t stride = (size_t)res.x * 3 + 1;
+	size_t rowBytes = (size_t)res.x * 3;
+	std::vector<unsigned char> filtered(stride * res.y);
+	strips = glm::clamp(strips, 1, glm::max(res.y, 1));
+	#pragma omp parallel for num_threads(strips)
+	for (int r = 0; r < res.y; r++)
+	{
+		const GLubyte* row = img + (size_t)(res.y - 1 - r) * rowBytes;
+		FilterRow(row, r > 0 ? row + rowBytes : 0, res.x, &filtered[r * stride]);
+	}
+	// Strips are compressed on their own and joined into one zlib stream
+	std::vector<std::vector<unsigned char>> parts(strips);
+	#pragma omp parallel for num_threads(strips) schedule(dynamic, 1)
+	for (int s = 0; s < strips; s++)
+	{
+		size_t first = (size_t)res.y * s / strips;
+		size_t last = (size_t)res.y * (s + 1) / strips;
+		DeflatePart(filtered.empty() ? 0 : &filtered[first * stride], (last - first) * stride, s == strips - 1, parts[s]);
+	}
+	std::vector<unsigned char> stream;
+	stream.push_back(0x78);	// Deflate, 32K window
+	stream.push_back(0x01);	// No dictionary, fastest
+	for (auto& p : parts)
+		stream.insert(stream.end(), p.begin(), p.end());
+	PutBigEndian(stream, Adler32(filtered.empty() ? 0 : &filtered[0], filtered.size()));
+	PutChunk(out, "IDAT", &stream[0], stream.size());
+	PutChunk(out, "IEND", 0, 0);
+}
+
+void EncodeImage(ImageFormat format, const GLubyte* img, glm::ivec2 res, int strips, std::vector<unsigned char>& out)
+{
+	out.clear();
+	if (format == ImageFormat::PNG)
+		EncodePNG(img, res, strips, out);
+	else if (format == ImageFormat::QOI)
+		EncodeQOI(img, res, out);
+	else
+		EncodePPM(img, res, out);
+}
+
+bool WriteBytes(std::string file, const std::vector<unsigned char>& data)
+{
+	FILE* f = fopen(file.c_str(), "wb");
+	if (!f)
+	{
+		std::cout << "Can't open file: " << file << std::endl;
+		return false;
+	}
+	bool ok = fwrite(&data[0], 1, data.size(), f) == data.size();
+	ok = fclose(f) == 0 && ok;
+	if (!ok)
+		std::cout << "Can't write file: " << file << std::endl;
+	return ok;
+}
+
+bool WriteImage(std::string file, const GLubyte* img, glm::ivec2 res)
+{
+	std::vector<unsigned char> data;
+	EncodeImage(ImageFormatOf(file), img, res, 1, data);
+	return WriteBytes(file, data);
+}
+
+// Next number of a PPM header, skipping white space and comments
+static bool ReadHeaderNumber(FILE* f, int& value)
+{
+	int c = fgetc(f);
+	while (c == '#' || isspace(c))
+	{
+		if (c == '#')
+			while (c != '\n' && c != EOF)
+				c = fgetc(f);
+		c = fgetc(f);
+	}
+	if (!isdigit(c))
+		return false;
+	value = 0;
+	while (isdigit(c))
+	{
+		value = value * 10 + c - '0';
+		c = fgetc(f);
+	}
+	// One white space character ends the header
+	return isspace(c) != 0;
+}
+
+bool ReadImage(std::string file, std::vector<GLubyte>& img, glm::ivec2& res)
+{
+	FILE* f = fopen(file.c_str(), "rb");
+	if (!f)
+		return false;
+	int maxValue = 0;
+	bool ok = fgetc(f) == 'P' && fgetc(f) == '6' && ReadHeaderNumber(f, res.x) && ReadHeaderNumber(f, res.y)
+		&& ReadHeaderNumber(f, maxValue) && maxValue == 255 && res.x > 0 && res.y > 0;
+	if (ok)
+	{
+		size_t row = (size_t)res.x * 3;
+		img.resize(row * res.y);
+		for (int i = res.y - 1; i >= 0 && ok; i--)
+			ok = fread(&img[row * i], 1, row, f) == row;
+	}
+	fclose(f);
+	if (!ok)
+		std::cout << "Can't read PPM image: " << file << std::endl;
+	return ok;
+}
+
+double ImagePSNR(const GLubyte* img, const GLubyte* ref, glm::ivec2 res)
+{
+	size_t count = (size_t)res.x * res.y * 3;
+	double error = 0.0;
+	for (size_t i = 0; i < count; i++)
+	{
+		double d = (double)img[i] - ref[i];
+		error += d * d;
+	}
+	if (error == 0.0)
+		return std::numeric_limits<double>::infinity();
+	return 10.0 * log10(255.0 * 255.0 * count / error);
+}
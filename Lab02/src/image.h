@@ -0,0 +1,40 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <string>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+
+// File formats images are written in, picked by the file extension
+enum class ImageFormat
+{
+	PPM,	// Binary PPM, uncompressed
+	QOI,	// Quite OK Image format, fast lossless compression
+	PNG,	// Deflate with fixed codes, strips can be compressed in parallel
+};
+
+// PNG for .png, QOI for .qoi, PPM for anything else
+ImageFormat ImageFormatOf(std::string file);
+std::string ImageFormatName(ImageFormat format);
+
+// Encodes an RGB image stored bottom row first, as rendered for OpenGL, into
+// out. PNG images are cut into strips rows that are compressed in parallel.
+void EncodeImage(ImageFormat format, const GLubyte* img, glm::ivec2 res, int strips, std::vector<unsigned char>& out);
+
+// Writes encoded data to a file, reports the file if it fails
+bool WriteBytes(std::string file, const std::vector<unsigned char>& data);
+// Writes an RGB image stored bottom row first to a file, in the format of
+// its extension
+bool WriteImage(std::string file, const GLubyte* img, glm::ivec2 res);
+
+// Reads a binary PPM with 8 bit channels into an RGB image stored bottom
+// row first. False if the file can't be read or is in another format.
+bool ReadImage(std::string file, std::vector<GLubyte>& img, glm::ivec2& res);
+
+// Peak signal to noise ratio of img against ref in dB, both RGB images of
+// res pixels. Identical images give infinity.
+double ImagePSNR(const GLubyte* img, const GLubyte* ref, glm::ivec2 res);
+
+#endif
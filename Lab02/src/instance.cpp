@@ -0,0 +1,120 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "instance.h"
+
+Geometry::Geometry()
+{
+	accel = 0;
+}
+
+Geometry::~Geometry()
+{
+	if (accel)
+	{
+		delete accel;
+		accel = 0;
+	}
+}
+
+void Geometry::Build(AccelType type)
+{
+	if (accel)
+		delete accel;
+	accel = CreateAccelerator(type);
+	accel->Build(shapes);
+}
+
+Instance::Instance()
+{
+	type = ShapeType::INSTANCE;
+	geometry = 0;
+	localTransform = glm::mat4(1.0f);
+	transform = glm::mat4(1.0f);
+	invTransform = glm::mat4(1.0f);
+	normalTransform = glm::mat3(1.0f);
+	overrideMaterial = false;
+}
+
+void Instance::SetGeometry(Geometry* g)
+{
+	geometry = g;
+}
+
+void Instance::Rotate(glm::vec3 axis, float angle)
+{
+	localTransform = glm::rotate(glm::mat4(1.0f), angle, axis) * localTransform;
+	UpdateTransform();
+}
+
+void Instance::Scale(glm::vec3 s)
+{
+	localTransform = glm::scale(glm::mat4(1.0f), s) * localTransform;
+	UpdateTransform();
+}
+
+void Instance::UpdateTransform()
+{
+	transform = glm::translate(glm::mat4(1.0f), center) * localTransform;
+	invTransform = glm::inverse(transform);
+	normalTransform = glm::transpose(glm::mat3(invTransform));
+}
+
+Shape* Instance::Material(Shape* prim)
+{
+	if (overrideMaterial)
+		return this;
+	return prim;
+}
+
+glm::vec3 Instance::Normal(glm::vec3 p, Shape* prim)
+{
+	glm::vec3 objP = glm::vec3(invTransform * glm::vec4(p, 1.0f));
+	return glm::normalize(normalTransform * prim->Normal(objP));
+}
+
+bool Instance::Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth)
+{
+	Shape* prim = 0;
+	return Intersect(rayOrg, rayDir, 0, hitDepth, prim);
+}
+
+bool Instance::Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* skip, float& hitDepth, Shape*& hitPrim)
+{
+	if (!geometry || !geometry->accel)
+		return false;
+	glm::vec3 org = glm::vec3(invTransform * glm::vec4(rayOrg, 1.0f));
+	glm::vec3 dir = glm::vec3(invTransform * glm::vec4(rayDir, 0.0f));
+	// Shapes expect unit directions, rescale the depth back to world space
+	float scale = glm::length(dir);
+	dir /= scale;
+	float depth = 0.0f;
+	Shape* hitObj = 0;
+	if (!geometry->accel->Intersect(org, dir, skip, skip, depth, hitObj, hitPrim))
+		return false;
+	hitDepth = depth / scale;
+	return true;
+}
+
+AABB Instance::GetBounds()
+{
+	AABB box;
+	if (!geometry || !geometry->accel)
+		return box;
+	AABB objBox = geometry->accel->GetBounds();
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner = glm::vec3(
+			(i & 1) ? objBox.bmax.x : objBox.bmin.x,
+			(i & 2) ? objBox.bmax.y : objBox.bmin.y,
+			(i & 4) ? objBox.bmax.z : objBox.bmin.z);
+		box.Expand(glm::vec3(transform * glm::vec4(corner, 1.0f)));
+	}
+	return box;
+}
+
+void Instance::MoveTo(int step)
+{
+	Shape::MoveTo(step);
+	UpdateTransform();
+}
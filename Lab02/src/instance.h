@@ -0,0 +1,52 @@
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include <vector>
+#include <string>
+#include <glm/glm.hpp>
+
+#include "shapes.h"
+#include "accel.h"
+
+// A group of shapes declared once with DEFINE and shared by all its instances
+class Geometry
+{
+public:
+	std::string name;
+	std::vector<Shape*> shapes;	// Owned by the arena of the scene
+	Accelerator* accel;
+
+	Geometry();
+	~Geometry();
+	void Build(AccelType type);
+};
+
+// Places a Geometry in the scene with its own transform and material.
+// The shapes of the geometry are kept in object space, rays are transformed
+// into object space instead, so moving an instance never touches them.
+class Instance : public Shape
+{
+public:
+	Geometry* geometry;
+	glm::mat4 localTransform;	// Rotation and scale, translation is the center
+	glm::mat4 transform;		// Object to world
+	glm::mat4 invTransform;		// World to object
+	glm::mat3 normalTransform;
+	bool overrideMaterial;
+
+	Instance();
+	void SetGeometry(Geometry* g);
+	void Rotate(glm::vec3 axis, float angle);
+	void Scale(glm::vec3 s);
+	void UpdateTransform();
+	// Shape that holds the material of a primitive of this instance
+	Shape* Material(Shape* prim);
+	glm::vec3 Normal(glm::vec3 p, Shape* prim);
+
+	bool Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth);
+	bool Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* skip, float& hitDepth, Shape*& hitPrim);
+	AABB GetBounds();
+	void MoveTo(int step);
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include <iostream>
+
+#include "kernels.h"
+#include "simd.h"
+
+#define KERNEL_SCALAR
+#include "kernels.inl"
+#undef KERNEL_SCALAR
+
+#ifdef RT_SSE
+#define KERNEL_SSE
+#include "kernels.inl"
+#undef KERNEL_SSE
+#endif
+
+const SimdKernels* SelectSimdKernels(const char* name)
+{
+	SimdLevel best = DetectSimdLevel();
+	SimdLevel level = best;
+	if (name && *name)
+	{
+		if (!ParseSimdLevel(name, level))
+		{
+			std::cout << "Unknown instruction set in RT_SIMD: " << name << std::endl;
+			level = best;
+		}
+		else if (level > best)
+		{
+			std::cout << "RT_SIMD=" << name << " is not supported here, using " << SimdLevelName(best) << std::endl;
+			level = best;
+		}
+	}
+#ifdef RT_X86
+	if (level == SimdLevel::AVX512)
+		return &avx512Kernels;
+	if (level == SimdLevel::AVX2)
+		return &avx2Kernels;
+#endif
+#ifdef RT_SSE
+	if (level >= SimdLevel::SSE)
+		return &sseKernels;
+#endif
+	return &scalarKernels;
+}
+
+const SimdKernels* simdKernels = SelectSimdKernels(getenv("RT_SIMD"));
@@ -0,0 +1,48 @@
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include <stddef.h>
+#include <glm/glm.hpp>
+
+#include "cpu.h"
+#include "shapes.h"
+
+class ShadingBatch;
+template <int N>
+class WideBVHNode;
+
+// The hot loops, compiled once per instruction set level from kernels.inl.
+// All levels give bit for bit the same results, so tiles rendered on
+// different machines match.
+class SimdKernels
+{
+public:
+	SimdLevel level;
+	bool (*sphereHit)(const Sphere& sphere, const glm::vec3& rayOrg, const glm::vec3& rayDir, float& hitDepth);
+	unsigned int (*sphereOccludesPacket)(const Sphere& sphere, const glm::vec3& rayOrg, const ShadowPacket& packet, unsigned int mask);
+	bool (*quadHit)(const Quad& quad, const glm::vec3& rayOrg, const glm::vec3& rayDir, float& hitDepth);
+	unsigned int (*boxHitPacket)(const AABB& box, const glm::vec3& rayOrg, const ShadowPacket& packet, unsigned int mask);
+	// Sum of the batch as RGB, the batch is padded to the kernel width
+	void (*shadeBatch)(ShadingBatch& batch, float* color);
+	// Averages the diagonal of level x level blocks of RGB pixels into width
+	// pixels. Row k of a block starts rowStep * k bytes after src.
+	void (*downScaleRow)(const unsigned char* src, ptrdiff_t rowStep, int level, int width, unsigned char* dst);
+	// Children of a 4 or 8 wide BVH node the ray enters before tMax as a bit
+	// mask, their entry distances go to tEnter
+	int (*childBoxHit4)(const WideBVHNode<4>& node, const glm::vec3& rayOrg, const glm::vec3& invDir, float tMax, float* tEnter);
+	int (*childBoxHit8)(const WideBVHNode<8>& node, const glm::vec3& rayOrg, const glm::vec3& invDir, float tMax, float* tEnter);
+};
+
+extern const SimdKernels scalarKernels;
+extern const SimdKernels sseKernels;
+extern const SimdKernels avx2Kernels;
+extern const SimdKernels avx512Kernels;
+
+// Kernels in use, picked when the program starts: the newest level the
+// processor supports, or the one named by the RT_SIMD environment variable
+// (scalar, sse, avx2, avx512) if it is supported
+extern const SimdKernels* simdKernels;
+
+const SimdKernels* SelectSimdKernels(const char* name);
+
+#endif
@@ -0,0 +1,614 @@
+// Kernel bodies, included once for every instruction set level with one of
+// KERNEL_SCALAR, KERNEL_SSE, KERNEL_AVX2 or KERNEL_AVX512 defined. Code here
+// may only call intrinsics and functions of this file: an inline function
+// shared with other files (glm, std) could be kept by the linker in its copy
+// built for a newer instruction set and crash older processors.
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "shading.h"
+#include "simd.h"
+#include "wbvh.h"
+#if defined(KERNEL_AVX2) || defined(KERNEL_AVX512)
+#include <immintrin.h>
+#endif
+
+#if defined(KERNEL_SCALAR)
+#define KERNEL_NAMESPACE ScalarKernels
+#define KERNEL_TABLE scalarKernels
+#define KERNEL_LEVEL SimdLevel::SCALAR
+#elif defined(KERNEL_SSE)
+#define KERNEL_NAMESPACE SSEKernels
+#define KERNEL_TABLE sseKernels
+#define KERNEL_LEVEL SimdLevel::SSE
+#elif defined(KERNEL_AVX2)
+#define KERNEL_NAMESPACE AVX2Kernels
+#define KERNEL_TABLE avx2Kernels
+#define KERNEL_LEVEL SimdLevel::AVX2
+#if defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#elif defined(KERNEL_AVX512)
+#define KERNEL_NAMESPACE AVX512Kernels
+#define KERNEL_TABLE avx512Kernels
+#define KERNEL_LEVEL SimdLevel::AVX512
+// Only the lane kernels are built for AVX-512. Scalar AVX-512 code also uses
+// registers 16 to 31, which vzeroupper leaves dirty, and SSE code running
+// after it gets slow.
+#if defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#endif
+
+namespace KERNEL_NAMESPACE
+{
+
+// Same operation order as glm, so results match the rest of the renderer
+static float Dot(float ax, float ay, float az, float bx, float by, float bz)
+{
+	return ax * bx + ay * by + az * bz;
+}
+
+static bool SphereHit(const Sphere& sphere, const glm::vec3& rayOrg, const glm::vec3& rayDir, float& hitDepth)
+{
+	float ocx = sphere.center.x - rayOrg.x;
+	float ocy = sphere.center.y - rayOrg.y;
+	float ocz = sphere.center.z - rayOrg.z;
+	float op = Dot(rayDir.x, rayDir.y, rayDir.z, ocx, ocy, ocz);
+	if (op < 0.0f)
+		return false;
+	float oc2 = Dot(ocx, ocy, ocz, ocx, ocy, ocz);
+	float d2 = oc2 - op * op;
+	float r2 = sphere.radius * sphere.radius;
+	if (d2 > r2)
+		return false;
+	float discriminant = r2 - d2;
+	if (discriminant < EPSILON)
+		hitDepth = op;
+	else
+	{
+		discriminant = sqrtf(discriminant);
+		hitDepth = op - discriminant;
+		if (hitDepth < 0.0f)
+			hitDepth = op + discriminant;
+	}
+	return true;
+}
+
+// Angle at p between the directions to a and b, as glm::normalize and
+// glm::acos compute it
+static float Angle(float px, float py, float pz, const glm::vec3& a, const glm::vec3& b)
+{
+	float ax = a.x - px, ay = a.y - py, az = a.z - pz;
+	float bx = b.x - px, by = b.y - py, bz = b.z - pz;
+	float ia = 1.0f / sqrtf(Dot(ax, ay, az, ax, ay, az));
+	float ib = 1.0f / sqrtf(Dot(bx, by, bz, bx, by, bz));
+	return acosf(Dot(ax * ia, ay * ia, az * ia, bx * ib, by * ib, bz * ib));
+}
+
+static bool QuadHit(const Quad& quad, const glm::vec3& rayOrg, const glm::vec3& rayDir, float& hitDepth)
+{
+	const glm::vec3& n = quad.normal;
+	float dn = Dot(rayDir.x, rayDir.y, rayDir.z, n.x, n.y, n.z);
+	if (dn == 0.0f)
+		return false;
+	float d = Dot(quad.vertex1.x - rayOrg.x, quad.vertex1.y - rayOrg.y, quad.vertex1.z - rayOrg.z, n.x, n.y, n.z) / dn;
+	if (d < EPSILON)
+		return false;
+	float px = d * rayDir.x + rayOrg.x;
+	float py = d * rayDir.y + rayOrg.y;
+	float pz = d * rayDir.z + rayOrg.z;
+
+	// The angles between the corners seen from p add up to 2 pi inside
+	float r = 0.0f;
+	r += Angle(px, py, pz, quad.vertex1, quad.vertex2);
+	r += Angle(px, py, pz, quad.vertex2, quad.vertex4);
+	r += Angle(px, py, pz, quad.vertex4, quad.vertex3);
+	r += Angle(px, py, pz, quad.vertex3, quad.vertex1);
+	if (fabs(r - 2.0f * M_PI) < EPSILON)
+	{
+		hitDepth = d;
+		return true;
+	}
+	return false;
+}
+
+// Sums as four interleaved partial sums whatever the width, the order of
+// the 4 wide SSE kernel
+static float SumRecords(const float* v, int count)
+{
+	float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < count; i++)
+		sum[i % 4] += v[i];
+	return sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+static void DownScaleRow(const unsigned char* src, ptrdiff_t rowStep, int level, int width, unsigned char* dst)
+{
+	for (int j = 0; j < width; j++)
+	{
+		int r = 0;
+		int g = 0;
+		int b = 0;
+		const unsigned char* block = src + (ptrdiff_t)j * level * 3;
+		for (int k = 0; k < level; k++)
+		{
+			const unsigned char* p = block + rowStep * k + k * 3;
+			r += p[0];
+			g += p[1];
+			b += p[2];
+		}
+		dst[j * 3] = r / level;
+		dst[j * 3 + 1] = g / level;
+		dst[j * 3 + 2] = b / level;
+	}
+}
+
+// Slab test of one ray against all children of a wide BVH node. Returns a
+// bit mask of the children entered before tMax, with their entry distances
+// in tEnter. Empty slots have all bounds at +infinity which never passes the
+// test. Min and max are those of SSE, so every level gives the same mask.
+#if defined(KERNEL_SCALAR)
+static float Min(float a, float b)
+{
+	return a < b ? a : b;
+}
+
+static float Max(float a, float b)
+{
+	return a > b ? a : b;
+}
+
+template <int N>
+static int ChildBoxHit(const WideBVHNode<N>& node, const glm::vec3& rayOrg, const glm::vec3& invDir, float tMax, float* tEnter)
+{
+	int mask = 0;
+	for (int c = 0; c < N; c++)
+	{
+		float t0x = (node.minX[c] - rayOrg.x) * invDir.x;
+		float t1x = (node.maxX[c] - rayOrg.x) * invDir.x;
+		float t0y = (node.minY[c] - rayOrg.y) * invDir.y;
+		float t1y = (node.maxY[c] - rayOrg.y) * invDir.y;
+		float t0z = (node.minZ[c] - rayOrg.z) * invDir.z;
+		float t1z = (node.maxZ[c] - rayOrg.z) * invDir.z;
+		float tNear = Max(Max(Min(t0x, t1x), Min(t0y, t1y)), Max(Min(t0z, t1z), 0.0f));
+		float tFar = Min(Min(Max(t0x, t1x), Max(t0y, t1y)), Min(Max(t0z, t1z), tMax));
+		tEnter[c] = tNear;
+		if (tNear <= tFar)
+			mask |= 1 << c;
+	}
+	return mask;
+}
+#else
+// Children c to c + 3
+template <int N>
+static int ChildBoxHit4(const WideBVHNode<N>& node, int c, __m128 ox, __m128 oy, __m128 oz, __m128 ix, __m128 iy, __m128 iz, __m128 tMax, float* tEnter)
+{
+	__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX + c), ox), ix);
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX + c), ox), ix);
+	__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY + c), oy), iy);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY + c), oy), iy);
+	__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ + c), oz), iz);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ + c), oz), iz);
+	__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+	__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_min_ps(_mm_max_ps(t0z, t1z), tMax));
+	_mm_storeu_ps(tEnter + c, tNear);
+	return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) << c;
+}
+
+template <int N>
+static int ChildBoxHit(const WideBVHNode<N>& node, const glm::vec3& rayOrg, const glm::vec3& invDir, float tMax, float* tEnter)
+{
+	__m128 ox = _mm_set1_ps(rayOrg.x);
+	__m128 oy = _mm_set1_ps(rayOrg.y);
+	__m128 oz = _mm_set1_ps(rayOrg.z);
+	__m128 ix = _mm_set1_ps(invDir.x);
+	__m128 iy = _mm_set1_ps(invDir.y);
+	__m128 iz = _mm_set1_ps(invDir.z);
+	__m128 tm = _mm_set1_ps(tMax);
+	int mask = 0;
+	for (int c = 0; c < N; c += 4)
+		mask |= ChildBoxHit4(node, c, ox, oy, oz, ix, iy, iz, tm, tEnter);
+	return mask;
+}
+#endif
+
+#if defined(KERNEL_AVX2) || defined(KERNEL_AVX512)
+// All 8 children at once
+template <>
+int ChildBoxHit<8>(const WideBVHNode<8>& node, const glm::vec3& rayOrg, const glm::vec3& invDir, float tMax, float* tEnter)
+{
+	__m256 ox = _mm256_set1_ps(rayOrg.x);
+	__m256 oy = _mm256_set1_ps(rayOrg.y);
+	__m256 oz = _mm256_set1_ps(rayOrg.z);
+	__m256 ix = _mm256_set1_ps(invDir.x);
+	__m256 iy = _mm256_set1_ps(invDir.y);
+	__m256 iz = _mm256_set1_ps(invDir.z);
+	__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minX), ox), ix);
+	__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxX), ox), ix);
+	__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minY), oy), iy);
+	__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxY), oy), iy);
+	__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minZ), oz), iz);
+	__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxZ), oz), iz);
+	__m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)), _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_setzero_ps()));
+	__m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)), _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(tMax)));
+	_mm256_storeu_ps(tEnter, tNear);
+	int mask = _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+	_mm256_zeroupper();
+	return mask;
+}
+#endif
+
+#if defined(KERNEL_AVX512) && defined(__GNUC__)
+#pragma GCC target("avx512f")
+#endif
+
+// Lane operations the packet kernels are written with. Masks are the result
+// of comparisons, Bits gives one bit per lane.
+#if defined(KERNEL_SCALAR)
+class Lanes
+{
+public:
+	typedef float F;
+	typedef bool M;
+	static const int WIDTH = 1;
+	static void Leave() {}
+	static F Set(float a) { return a; }
+	static F Load(const float* p) { return *p; }
+	static void Store(float* p, F a) { *p = a; }
+	static F Add(F a, F b) { return a + b; }
+	static F Sub(F a, F b) { return a - b; }
+	static F Mul(F a, F b) { return a * b; }
+	static F Div(F a, F b) { return a / b; }
+	static F Sqrt(F a) { return sqrtf(a); }
+	static F Min(F a, F b) { return a < b ? a : b; }
+	static F Max(F a, F b) { return a > b ? a : b; }
+	static M Less(F a, F b) { return a < b; }
+	static M LessEqual(F a, F b) { return a <= b; }
+	static M Greater(F a, F b) { return a > b; }
+	static M GreaterEqual(F a, F b) { return a >= b; }
+	static M And(M a, M b) { return a && b; }
+	static F Select(M mask, F a, F b) { return mask ? a : b; }
+	static unsigned int Bits(M mask) { return mask ? 1 : 0; }
+	// Nearest whole number, ties to even like the SIMD conversions
+	static F Round(F a) { return nearbyintf(a); }
+	// Unbiased exponent and mantissa in [1, 2) of positive numbers
+	static F Exponent(F a)
+	{
+		unsigned int bits;
+		memcpy(&bits, &a, sizeof(bits));
+		return (float)((int)((bits >> 23) & 0xFF) - 127);
+	}
+	static F Mantissa(F a)
+	{
+		unsigned int bits;
+		memcpy(&bits, &a, sizeof(bits));
+		bits = (bits & 0x007FFFFF) | 0x3F800000;
+		memcpy(&a, &bits, sizeof(a));
+		return a;
+	}
+	// a * 2^k for whole numbers k
+	static F Scale2(F a, F k)
+	{
+		unsigned int bits = (unsigned int)((int)k + 127) << 23;
+		float s;
+		memcpy(&s, &bits, sizeof(s));
+		return a * s;
+	}
+};
+#elif defined(KERNEL_SSE)
+class Lanes
+{
+public:
+	typedef __m128 F;
+	typedef __m128 M;
+	static const int WIDTH = 4;
+	static void Leave() {}
+	static F Set(float a) { return _mm_set1_ps(a); }
+	static F Load(const float* p) { return _mm_loadu_ps(p); }
+	static void Store(float* p, F a) { _mm_storeu_ps(p, a); }
+	static F Add(F a, F b) { return _mm_add_ps(a, b); }
+	static F Sub(F a, F b) { return _mm_sub_ps(a, b); }
+	static F Mul(F a, F b) { return _mm_mul_ps(a, b); }
+	static F Div(F a, F b) { return _mm_div_ps(a, b); }
+	static F Sqrt(F a) { return _mm_sqrt_ps(a); }
+	static F Min(F a, F b) { return _mm_min_ps(a, b); }
+	static F Max(F a, F b) { return _mm_max_ps(a, b); }
+	static M Less(F a, F b) { return _mm_cmplt_ps(a, b); }
+	static M LessEqual(F a, F b) { return _mm_cmple_ps(a, b); }
+	static M Greater(F a, F b) { return _mm_cmpgt_ps(a, b); }
+	static M GreaterEqual(F a, F b) { return _mm_cmpge_ps(a, b); }
+	static M And(M a, M b) { return _mm_and_ps(a, b); }
+	static F Select(M mask, F a, F b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+	static unsigned int Bits(M mask) { return _mm_movemask_ps(mask); }
+	static F Round(F a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+	static F Exponent(F a)
+	{
+		__m128i e = _mm_and_si128(_mm_srli_epi32(_mm_castps_si128(a), 23), _mm_set1_epi32(0xFF));
+		return _mm_cvtepi32_ps(_mm_sub_epi32(e, _mm_set1_epi32(127)));
+	}
+	static F Mantissa(F a)
+	{
+		__m128i m = _mm_and_si128(_mm_castps_si128(a), _mm_set1_epi32(0x007FFFFF));
+		return _mm_castsi128_ps(_mm_or_si128(m, _mm_set1_epi32(0x3F800000)));
+	}
+	static F Scale2(F a, F k)
+	{
+		__m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(k), _mm_set1_epi32(127)), 23);
+		return _mm_mul_ps(a, _mm_castsi128_ps(e));
+	}
+};
+#elif defined(KERNEL_AVX2)
+class Lanes
+{
+public:
+	typedef __m256 F;
+	typedef __m256 M;
+	static const int WIDTH = 8;
+	// Clean upper register halves, or SSE code built for older processors
+	// runs slow after the kernel
+	static void Leave() { _mm256_zeroupper(); }
+	static F Set(float a) { return _mm256_set1_ps(a); }
+	static F Load(const float* p) { return _mm256_loadu_ps(p); }
+	static void Store(float* p, F a) { _mm256_storeu_ps(p, a); }
+	static F Add(F a, F b) { return _mm256_add_ps(a, b); }
+	static F Sub(F a, F b) { return _mm256_sub_ps(a, b); }
+	static F Mul(F a, F b) { return _mm256_mul_ps(a, b); }
+	static F Div(F a, F b) { return _mm256_div_ps(a, b); }
+	static F Sqrt(F a) { return _mm256_sqrt_ps(a); }
+	static F Min(F a, F b) { return _mm256_min_ps(a, b); }
+	static F Max(F a, F b) { return _mm256_max_ps(a, b); }
+	static M Less(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OS); }
+	static M LessEqual(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OS); }
+	static M Greater(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OS); }
+	static M GreaterEqual(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GE_OS); }
+	static M And(M a, M b) { return _mm256_and_ps(a, b); }
+	static F Select(M mask, F a, F b) { return _mm256_blendv_ps(b, a, mask); }
+	static unsigned int Bits(M mask) { return _mm256_movemask_ps(mask); }
+	static F Round(F a) { return _mm256_cvtepi32_ps(_mm256_cvtps_epi32(a)); }
+	static F Exponent(F a)
+	{
+		__m256i e = _mm256_and_si256(_mm256_srli_epi32(_mm256_castps_si256(a), 23), _mm256_set1_epi32(0xFF));
+		return _mm256_cvtepi32_ps(_mm256_sub_epi32(e, _mm256_set1_epi32(127)));
+	}
+	static F Mantissa(F a)
+	{
+		__m256i m = _mm256_and_si256(_mm256_castps_si256(a), _mm256_set1_epi32(0x007FFFFF));
+		return _mm256_castsi256_ps(_mm256_or_si256(m, _mm256_set1_epi32(0x3F800000)));
+	}
+	static F Scale2(F a, F k)
+	{
+		__m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23);
+		return _mm256_mul_ps(a, _mm256_castsi256_ps(e));
+	}
+};
+#elif defined(KERNEL_AVX512)
+class Lanes
+{
+public:
+	typedef __m512 F;
+	typedef __mmask16 M;
+	static const int WIDTH = 16;
+	static void Leave() { _mm256_zeroupper(); }
+	static F Set(float a) { return _mm512_set1_ps(a); }
+	static F Load(const float* p) { return _mm512_loadu_ps(p); }
+	static void Store(float* p, F a) { _mm512_storeu_ps(p, a); }
+	static F Add(F a, F b) { return _mm512_add_ps(a, b); }
+	static F Sub(F a, F b) { return _mm512_sub_ps(a, b); }
+	static F Mul(F a, F b) { return _mm512_mul_ps(a, b); }
+	static F Div(F a, F b) { return _mm512_div_ps(a, b); }
+	static F Sqrt(F a) { return _mm512_sqrt_ps(a); }
+	static F Min(F a, F b) { return _mm512_min_ps(a, b); }
+	static F Max(F a, F b) { return _mm512_max_ps(a, b); }
+	static M Less(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OS); }
+	static M LessEqual(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OS); }
+	static M Greater(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OS); }
+	static M GreaterEqual(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OS); }
+	static M And(M a, M b) { return a & b; }
+	static F Select(M mask, F a, F b) { return _mm512_mask_blend_ps(mask, b, a); }
+	static unsigned int Bits(M mask) { return mask; }
+	static F Round(F a) { return _mm512_cvtepi32_ps(_mm512_cvtps_epi32(a)); }
+	static F Exponent(F a)
+	{
+		__m512i e = _mm512_and_si512(_mm512_srli_epi32(_mm512_castps_si512(a), 23), _mm512_set1_epi32(0xFF));
+		return _mm512_cvtepi32_ps(_mm512_sub_epi32(e, _mm512_set1_epi32(127)));
+	}
+	static F Mantissa(F a)
+	{
+		__m512i m = _mm512_and_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x007FFFFF));
+		return _mm512_castsi512_ps(_mm512_or_si512(m, _mm512_set1_epi32(0x3F800000)));
+	}
+	static F Scale2(F a, F k)
+	{
+		__m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(k), _mm512_set1_epi32(127)), 23);
+		return _mm512_mul_ps(a, _mm512_castsi512_ps(e));
+	}
+};
+#endif
+
+typedef Lanes::F F;
+typedef Lanes::M M;
+const unsigned int LANE_MASK = (1u << Lanes::WIDTH) - 1;
+
+// Same steps as SphereHit, for all rays of the packet
+static unsigned int SphereOccludesPacket(const Sphere& sphere, const glm::vec3& rayOrg, const ShadowPacket& packet, unsigned int mask)
+{
+	float ocx = sphere.center.x - rayOrg.x;
+	float ocy = sphere.center.y - rayOrg.y;
+	float ocz = sphere.center.z - rayOrg.z;
+	F cx = Lanes::Set(ocx);
+	F cy = Lanes::Set(ocy);
+	F cz = Lanes::Set(ocz);
+	F oc2 = Lanes::Set(Dot(ocx, ocy, ocz, ocx, ocy, ocz));
+	F r2 = Lanes::Set(sphere.radius * sphere.radius);
+	F zero = Lanes::Set(0.0f);
+	F eps = Lanes::Set(EPSILON);
+	unsigned int res = 0;
+	for (int i = 0; i < packet.count; i += Lanes::WIDTH)
+	{
+		if (!((mask >> i) & LANE_MASK))
+			continue;
+		F op = Lanes::Add(Lanes::Add(
+			Lanes::Mul(Lanes::Load(packet.dirX + i), cx),
+			Lanes::Mul(Lanes::Load(packet.dirY + i), cy)),
+			Lanes::Mul(Lanes::Load(packet.dirZ + i), cz));
+		F d2 = Lanes::Sub(oc2, Lanes::Mul(op, op));
+		M hit = Lanes::And(Lanes::GreaterEqual(op, zero), Lanes::LessEqual(d2, r2));
+		F discriminant = Lanes::Sub(r2, d2);
+		F root = Lanes::Sqrt(Lanes::Max(discriminant, zero));
+		F nearDepth = Lanes::Sub(op, root);
+		F farDepth = Lanes::Add(op, root);
+		F depth = Lanes::Select(Lanes::Less(nearDepth, zero), farDepth, nearDepth);
+		depth = Lanes::Select(Lanes::Less(discriminant, eps), op, depth);
+		hit = Lanes::And(hit, Lanes::Less(depth, Lanes::Load(packet.maxDist + i)));
+		res |= Lanes::Bits(hit) << i;
+	}
+	Lanes::Leave();
+	return res & mask;
+}
+
+static unsigned int BoxHitPacket(const AABB& box, const glm::vec3& rayOrg, const ShadowPacket& packet, unsigned int mask)
+{
+	F minX = Lanes::Set(box.bmin.x - rayOrg.x);
+	F minY = Lanes::Set(box.bmin.y - rayOrg.y);
+	F minZ = Lanes::Set(box.bmin.z - rayOrg.z);
+	F maxX = Lanes::Set(box.bmax.x - rayOrg.x);
+	F maxY = Lanes::Set(box.bmax.y - rayOrg.y);
+	F maxZ = Lanes::Set(box.bmax.z - rayOrg.z);
+	F zero = Lanes::Set(0.0f);
+	unsigned int res = 0;
+	for (int i = 0; i < packet.count; i += Lanes::WIDTH)
+	{
+		if (!((mask >> i) & LANE_MASK))
+			continue;
+		F ix = Lanes::Load(packet.invX + i);
+		F iy = Lanes::Load(packet.invY + i);
+		F iz = Lanes::Load(packet.invZ + i);
+		F t0x = Lanes::Mul(minX, ix);
+		F t1x = Lanes::Mul(maxX, ix);
+		F t0y = Lanes::Mul(minY, iy);
+		F t1y = Lanes::Mul(maxY, iy);
+		F t0z = Lanes::Mul(minZ, iz);
+		F t1z = Lanes::Mul(maxZ, iz);
+		F tNear = Lanes::Max(Lanes::Max(Lanes::Min(t0x, t1x), Lanes::Min(t0y, t1y)), Lanes::Max(Lanes::Min(t0z, t1z), zero));
+		F tFar = Lanes::Min(Lanes::Min(Lanes::Max(t0x, t1x), Lanes::Max(t0y, t1y)), Lanes::Min(Lanes::Max(t0z, t1z), Lanes::Load(packet.maxDist + i)));
+		res |= Lanes::Bits(Lanes::LessEqual(tNear, tFar)) << i;
+	}
+	Lanes::Leave();
+	return res & mask;
+}
+
+// x^y for x in [0, 1] and y >= 0 through exp2(y * log2(x)), on all lanes.
+// The relative error is below 2e-5 for y up to 1000, about the rounding of
+// y * log2(x).
+static F PowLanes(F x, F y)
+{
+	F one = Lanes::Set(1.0f);
+	F e = Lanes::Exponent(x);
+	F m = Lanes::Mantissa(x);
+	M big = Lanes::Greater(m, Lanes::Set(SQRT2));
+	m = Lanes::Select(big, Lanes::Mul(m, Lanes::Set(0.5f)), m);
+	e = Lanes::Select(big, Lanes::Add(e, one), e);
+	F t = Lanes::Div(Lanes::Sub(m, one), Lanes::Add(m, one));
+	F t2 = Lanes::Mul(t, t);
+	F poly = Lanes::Add(Lanes::Set(LOG2_C7), Lanes::Mul(t2, Lanes::Set(LOG2_C9)));
+	poly = Lanes::Add(Lanes::Set(LOG2_C5), Lanes::Mul(t2, poly));
+	poly = Lanes::Add(Lanes::Set(LOG2_C3), Lanes::Mul(t2, poly));
+	poly = Lanes::Add(Lanes::Set(LOG2_C1), Lanes::Mul(t2, poly));
+	F lg = Lanes::Add(e, Lanes::Mul(t, poly));
+
+	F z = Lanes::Max(Lanes::Mul(y, lg), Lanes::Set(-126.0f));
+	F k = Lanes::Round(z);
+	F f = Lanes::Sub(z, k);
+	F p = Lanes::Add(Lanes::Set(EXP2_C5), Lanes::Mul(f, Lanes::Set(EXP2_C6)));
+	p = Lanes::Add(Lanes::Set(EXP2_C4), Lanes::Mul(f, p));
+	p = Lanes::Add(Lanes::Set(EXP2_C3), Lanes::Mul(f, p));
+	p = Lanes::Add(Lanes::Set(EXP2_C2), Lanes::Mul(f, p));
+	p = Lanes::Add(Lanes::Set(EXP2_C1), Lanes::Mul(f, p));
+	p = Lanes::Add(one, Lanes::Mul(f, p));
+	F res = Lanes::Scale2(p, k);
+
+	F zero = Lanes::Set(0.0f);
+	return Lanes::Select(Lanes::Greater(x, zero), res, Lanes::Select(Lanes::Greater(y, zero), zero, one));
+}
+
+static void ShadeBatch(ShadingBatch& b, float* color)
+{
+	if (b.count == 0)
+	{
+		color[0] = color[1] = color[2] = 0.0f;
+		return;
+	}
+	b.Pad(Lanes::WIDTH);
+	F zero = Lanes::Set(0.0f);
+	F one = Lanes::Set(1.0f);
+	F two = Lanes::Set(2.0f);
+	float red[PACKET_SIZE], green[PACKET_SIZE], blue[PACKET_SIZE];
+	for (int i = 0; i < b.count; i += Lanes::WIDTH)
+	{
+		F dx = Lanes::Sub(Lanes::Load(b.lx + i), Lanes::Load(b.px + i));
+		F dy = Lanes::Sub(Lanes::Load(b.ly + i), Lanes::Load(b.py + i));
+		F dz = Lanes::Sub(Lanes::Load(b.lz + i), Lanes::Load(b.pz + i));
+		F dist2 = Lanes::Add(Lanes::Add(Lanes::Mul(dx, dx), Lanes::Mul(dy, dy)), Lanes::Mul(dz, dz));
+		F inv = Lanes::Div(one, Lanes::Sqrt(dist2));
+		F lx = Lanes::Mul(dx, inv);
+		F ly = Lanes::Mul(dy, inv);
+		F lz = Lanes::Mul(dz, inv);
+		F nx = Lanes::Load(b.nx + i);
+		F ny = Lanes::Load(b.ny + i);
+		F nz = Lanes::Load(b.nz + i);
+		F nl = Lanes::Add(Lanes::Add(Lanes::Mul(nx, lx), Lanes::Mul(ny, ly)), Lanes::Mul(nz, lz));
+		F sDot = Lanes::Max(nl, zero);
+
+		// r = normalize(reflect(-l, n))
+		F nl2 = Lanes::Mul(two, nl);
+		F rx = Lanes::Sub(Lanes::Mul(nl2, nx), lx);
+		F ry = Lanes::Sub(Lanes::Mul(nl2, ny), ly);
+		F rz = Lanes::Sub(Lanes::Mul(nl2, nz), lz);
+		F rLen = Lanes::Sqrt(Lanes::Add(Lanes::Add(Lanes::Mul(rx, rx), Lanes::Mul(ry, ry)), Lanes::Mul(rz, rz)));
+		F rv = Lanes::Add(Lanes::Add(Lanes::Mul(rx, Lanes::Load(b.vx + i)), Lanes::Mul(ry, Lanes::Load(b.vy + i))), Lanes::Mul(rz, Lanes::Load(b.vz + i)));
+		rv = Lanes::Max(Lanes::Div(rv, rLen), zero);
+		F spec = PowLanes(rv, Lanes::Load(b.shininess + i));
+		spec = Lanes::Select(Lanes::Greater(sDot, zero), spec, zero);
+
+		F f2 = Lanes::Load(b.falloff2 + i);
+		F atten = Lanes::Select(Lanes::Greater(f2, zero), Lanes::Div(f2, Lanes::Add(f2, dist2)), one);
+		F w = Lanes::Mul(Lanes::Load(b.weight + i), atten);
+		F diff = Lanes::Mul(w, sDot);
+		F sp = Lanes::Mul(w, spec);
+		Lanes::Store(red + i, Lanes::Add(Lanes::Mul(diff, Lanes::Mul(Lanes::Load(b.lightDiffR + i), Lanes::Load(b.diffR + i))), Lanes::Mul(sp, Lanes::Mul(Lanes::Load(b.lightSpecR + i), Lanes::Load(b.specR + i)))));
+		Lanes::Store(green + i, Lanes::Add(Lanes::Mul(diff, Lanes::Mul(Lanes::Load(b.lightDiffG + i), Lanes::Load(b.diffG + i))), Lanes::Mul(sp, Lanes::Mul(Lanes::Load(b.lightSpecG + i), Lanes::Load(b.specG + i)))));
+		Lanes::Store(blue + i, Lanes::Add(Lanes::Mul(diff, Lanes::Mul(Lanes::Load(b.lightDiffB + i), Lanes::Load(b.diffB + i))), Lanes::Mul(sp, Lanes::Mul(Lanes::Load(b.lightSpecB + i), Lanes::Load(b.specB + i)))));
+	}
+	Lanes::Leave();
+	color[0] = SumRecords(red, b.count);
+	color[1] = SumRecords(green, b.count);
+	color[2] = SumRecords(blue, b.count);
+}
+
+}
+
+const SimdKernels KERNEL_TABLE =
+{
+	KERNEL_LEVEL,
+	&KERNEL_NAMESPACE::SphereHit,
+	&KERNEL_NAMESPACE::SphereOccludesPacket,
+	&KERNEL_NAMESPACE::QuadHit,
+	&KERNEL_NAMESPACE::BoxHitPacket,
+	&KERNEL_NAMESPACE::ShadeBatch,
+	&KERNEL_NAMESPACE::DownScaleRow,
+	&KERNEL_NAMESPACE::ChildBoxHit<4>,
+	&KERNEL_NAMESPACE::ChildBoxHit<8>,
+};
+
+#if (defined(KERNEL_AVX2) || defined(KERNEL_AVX512)) && defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#undef KERNEL_NAMESPACE
+#undef KERNEL_TABLE
+#undef KERNEL_LEVEL
@@ -0,0 +1,7 @@
+// Built for AVX2 processors, only called when the processor has it
+#include "simd.h"
+
+#ifdef RT_X86
+#define KERNEL_AVX2
+#include "kernels.inl"
+#endif
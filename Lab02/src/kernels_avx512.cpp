@@ -0,0 +1,7 @@
+// Built for AVX-512 processors, only called when the processor has it
+#include "simd.h"
+
+#ifdef RT_X86
+#define KERNEL_AVX512
+#include "kernels.inl"
+#endif
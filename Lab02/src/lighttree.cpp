@@ -0,0 +1,237 @@
+#include <math.h>
+#include <algorithm>
+
+#include "lighttree.h"
+
+const int LIGHTTREE_STACK_SIZE = 64;
+// Lower bound of the cosine term used for importance, so that lights in
+// front of the surface never get a zero probability
+const float LIGHTTREE_MIN_COS = 0.1f;
+
+// Small hash based generator, deterministic for a given seed
+static float Random(unsigned int& state)
+{
+	state = state * 747796405u + 2891336453u;
+	unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	word = (word >> 22u) ^ word;
+	return (word >> 8) * (1.0f / 16777216.0f);
+}
+
+float LightTree::Power(Light* light)
+{
+	glm::vec3 c = light->surface->diff_color + light->surface->spec_color;
+	return glm::max(glm::max(c.r, c.g), c.b);
+}
+
+float LightTree::Attenuation(float falloff, float dist2)
+{
+	if (falloff <= 0.0f)
+		return 1.0f;
+	return falloff * falloff / (falloff * falloff + dist2);
+}
+
+void LightTree::Build(const std::vector<Light*>& lightList)
+{
+	lights = lightList;
+	nodes.clear();
+	if (lights.empty())
+		return;
+	std::vector<int> order;
+	for (int i = 0; i < (int)lights.size(); i++)
+		order.push_back(i);
+	nodes.reserve(lights.size() * 2);
+	nodes.push_back(LightNode());
+	Subdivide(0, order, 0, (int)lights.size());
+	Refit();
+}
+
+void LightTree::Subdivide(int node, std::vector<int>& order, int first, int count)
+{
+	nodes[node].left = 0;
+	nodes[node].light = -1;
+	if (count == 1)
+	{
+		nodes[node].light = order[first];
+		return;
+	}
+
+	// Median split along the largest axis
+	AABB centers;
+	for (int i = first; i < first + count; i++)
+		centers.Expand(lights[order[i]]->center);
+	glm::vec3 extent = centers.bmax - centers.bmin;
+	int axis = 0;
+	if (extent.y > extent[axis])
+		axis = 1;
+	if (extent.z > extent[axis])
+		axis = 2;
+	int half = count / 2;
+	std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+		[&](int a, int b) { return lights[a]->center[axis] < lights[b]->center[axis]; });
+
+	int left = (int)nodes.size();
+	nodes[node].left = left;
+	nodes.push_back(LightNode());
+	nodes.push_back(LightNode());
+	Subdivide(left, order, first, half);
+	Subdivide(left + 1, order, first + half, count - half);
+}
+
+void LightTree::Refit()
+{
+	// Children are always stored after their parent
+	for (int i = (int)nodes.size() - 1; i >= 0; i--)
+	{
+		LightNode& node = nodes[i];
+		node.box = AABB();
+		if (node.light >= 0)
+		{
+			Light* l = lights[node.light];
+			node.box.Expand(l->center);
+			node.power = Power(l);
+			node.energy = node.power;
+			node.falloff = l->falloff;
+			continue;
+		}
+		const LightNode& a = nodes[node.left];
+		const LightNode& b = nodes[node.left + 1];
+		node.box.Expand(a.box);
+		node.box.Expand(b.box);
+		node.power = glm::max(a.power, b.power);
+		node.energy = a.energy + b.energy;
+		if (a.falloff <= 0.0f || b.falloff <= 0.0f)
+			node.falloff = 0.0f;
+		else
+			node.falloff = glm::max(a.falloff, b.falloff);
+	}
+}
+
+// Upper bound of the contribution of any single light of the node,
+// negative if all of them are behind the surface
+float LightTree::Bound(const LightNode& node, glm::vec3 p, glm::vec3 n)
+{
+	if (node.light >= 0)
+	{
+		// Same test as the diffuse term of Phong, so culling is exact
+		if (glm::dot(glm::normalize(lights[node.light]->center - p), n) <= 0.0f)
+			return -1.0f;
+	}
+	else
+	{
+		float facing = -INFINITY;
+		for (int i = 0; i < 8; i++)
+		{
+			glm::vec3 corner = glm::vec3(
+				(i & 1) ? node.box.bmax.x : node.box.bmin.x,
+				(i & 2) ? node.box.bmax.y : node.box.bmin.y,
+				(i & 4) ? node.box.bmax.z : node.box.bmin.z);
+			facing = glm::max(facing, glm::dot(corner - p, n));
+		}
+		if (facing < -EPSILON)
+			return -1.0f;
+	}
+	glm::vec3 d = glm::max(node.box.bmin - p, glm::max(glm::vec3(0.0f), p - node.box.bmax));
+	return node.power * Attenuation(node.falloff, glm::dot(d, d));
+}
+
+float LightTree::Importance(const LightNode& node, glm::vec3 p, glm::vec3 n)
+{
+	glm::vec3 toCenter = node.box.Center() - p;
+	float dist2 = glm::dot(toCenter, toCenter);
+	float cosine = LIGHTTREE_MIN_COS;
+	if (dist2 > 0.0f)
+		cosine = glm::max(glm::dot(toCenter, n) / sqrt(dist2), LIGHTTREE_MIN_COS);
+	return node.energy * Attenuation(node.falloff, dist2) * cosine;
+}
+
+void LightTree::Select(glm::vec3 p, glm::vec3 n, float threshold, std::vector<int>& selected)
+{
+	selected.clear();
+	if (nodes.empty())
+		return;
+	int stack[LIGHTTREE_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const LightNode& node = nodes[stack[--top]];
+		float bound = Bound(node, p, n);
+		if (bound < 0.0f || bound < threshold)
+			continue;
+		if (node.light >= 0)
+		{
+			selected.push_back(node.light);
+			continue;
+		}
+		stack[top++] = node.left + 1;
+		stack[top++] = node.left;
+	}
+	std::sort(selected.begin(), selected.end());
+}
+
+void LightTree::Sample(glm::vec3 p, glm::vec3 n, float threshold, int count, unsigned int seed, std::vector<int>& selected, std::vector<float>& weights)
+{
+	selected.clear();
+	weights.clear();
+	if (nodes.empty() || count <= 0)
+		return;
+	float rootBound = Bound(nodes[0], p, n);
+	if (rootBound < 0.0f || rootBound < threshold)
+		return;
+
+	unsigned int state = seed;
+	for (int s = 0; s < count; s++)
+	{
+		// Walk down choosing children by importance
+		int node = 0;
+		float pdf = 1.0f;
+		while (node >= 0 && nodes[node].light < 0)
+		{
+			int left = nodes[node].left;
+			float importance[2];
+			for (int c = 0; c < 2; c++)
+			{
+				float bound = Bound(nodes[left + c], p, n);
+				if (bound < 0.0f || bound < threshold)
+					importance[c] = 0.0f;
+				else
+					importance[c] = Importance(nodes[left + c], p, n);
+			}
+			float sum = importance[0] + importance[1];
+			if (sum <= 0.0f)
+			{
+				node = -1;
+				break;
+			}
+			if (Random(state) * sum < importance[0])
+			{
+				node = left;
+				pdf *= importance[0] / sum;
+			}
+			else
+			{
+				node = left + 1;
+				pdf *= importance[1] / sum;
+			}
+		}
+		if (node < 0 || pdf <= 0.0f)
+			continue;
+
+		int light = nodes[node].light;
+		float weight = 1.0f / (count * pdf);
+		bool found = false;
+		for (int i = 0; i < (int)selected.size(); i++)
+		{
+			if (selected[i] == light)
+			{
+				weights[i] += weight;
+				found = true;
+			}
+		}
+		if (!found)
+		{
+			selected.push_back(light);
+			weights.push_back(weight);
+		}
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef __LIGHTTREE_H__
+#define __LIGHTTREE_H__
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "shapes.h"
+
+class LightNode
+{
+public:
+	AABB box;		// Bounds of the light positions
+	float power;	// Largest power of a single light
+	float energy;	// Sum of the powers
+	float falloff;	// Largest falloff radius, 0 if any light has none
+	int left;		// Index of the first child, the second one is left + 1
+	int light;		// Light of a leaf, -1 for inner nodes
+};
+
+// Bounding volume hierarchy over point lights, used to skip lights that
+// cannot contribute at a shading point and to sample lights by importance
+class LightTree
+{
+public:
+	std::vector<LightNode> nodes;
+	std::vector<Light*> lights;
+
+	void Build(const std::vector<Light*>& lightList);
+	// Lights can move, update the bounds and keep the tree
+	void Refit();
+	// All lights in front of the surface at p whose contribution may be
+	// above threshold, in input order
+	void Select(glm::vec3 p, glm::vec3 n, float threshold, std::vector<int>& selected);
+	// Picks count lights with probability proportional to their estimated
+	// contribution. Weights are 1 / (count * probability), a light picked
+	// more than once is returned once with the weights summed.
+	void Sample(glm::vec3 p, glm::vec3 n, float threshold, int count, unsigned int seed, std::vector<int>& selected, std::vector<float>& weights);
+
+	static float Power(Light* light);
+	static float Attenuation(float falloff, float dist2);
+
+private:
+	void Subdivide(int node, std::vector<int>& order, int first, int count);
+	float Bound(const LightNode& node, glm::vec3 p, glm::vec3 n);
+	float Importance(const LightNode& node, glm::vec3 p, glm::vec3 n);
+};
+
+#endif
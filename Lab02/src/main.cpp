@@ -13,6 +13,11 @@
 #include "omp.h"
 #include "shaders.h"
 #include "raytracer.h"
+#include "batch.h"
+#include "distributed.h"
+#include "bench.h"
+#include "regress.h"
+#include "timeline.h"
 
 #pragma warning(disable : 4996)
 #pragma comment(lib, "glew32.lib")
@@ -32,10 +37,43 @@ GLuint frameTex = -1;
 GLubyte* texData = 0;
 
 RayTracer raytracer;
-const std::string sceneFile = "cornell.txt";
+std::string sceneFile = "cornell.txt";
+// Scene tags given on the command line, e.g. "ACCEL BVH8"
+std::string sceneOptions;
+// Frame range for batch rendering, no window is opened when it is set
+int firstFrame = -1;
+int lastFrame = -1;
+std::string framePattern = "frame%04d.ppm";
+// Encoder threads, queue length, PNG strips and fsync batch of batch rendering
+EncodeSettings encodeSettings;
+// Frames per pixel order for the pixel order benchmark, 0 to render normally
+int benchOrderFrames = 0;
+// Frames per pattern for the sparse tracing benchmark
+int benchSparseFrames = 0;
+// Tests per kernel for the kernel benchmark, the share of them that hit and
+// the file of times it is compared with
+int benchKernelTests = 0;
+float benchHitRatio = 0.5f;
+std::string benchBaseline;
+// Golden images and frame times of the regression run, and the channel
+// difference a pixel may have
+std::string regressDir;
+int regressTolerance = 0;
+// Chrome trace-event file the timeline of the run is written to at exit
+std::string timelineFile;
+// Files the values of HEATMAP frames are written to, every batch frame or
+// the frame shown when 'h' is pressed
+std::string heatDumpPattern = "heat%04d.txt";
+bool dumpEveryHeatmap = false;
+// Distributed rendering, tiles go to worker processes when any is set
+int spawnWorkers = 0;
+int listenPort = -1;
+std::string workerAddress;
+Coordinator* coordinator = 0;
 
 bool shouldRedisplay = false;
 bool shouldExit = false;
+bool shouldDumpHeatmap = false;
 
 /*********************************
 Some OpenGL-related functions
@@ -55,6 +93,7 @@ void Idle(void)
 {
 	if (shouldRedisplay)
 	{
+		TimelineScope scope("Upload");
 		//cout << "new frame" << endl;
 		glBindTexture(GL_TEXTURE_2D, frameTex);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, wWindow, hWindow, 0, GL_RGB, GL_UNSIGNED_BYTE, texData);
@@ -89,6 +128,9 @@ void Kbd(unsigned char a, int x, int y)
 	  {
 		  break;
 	  }
+	  case 'h':
+		  shouldDumpHeatmap = true;
+		  break;
 	}
 	glutPostRedisplay();
 }
@@ -199,8 +241,15 @@ void InitializeGL(int argc, char** argv)
 
 void InitializeRayTracer()
 {
-	raytracer.LoadScene(sceneFile);
-	glm::ivec2 res = raytracer.GetResolution();
+	glm::ivec2 res;
+	if (coordinator)
+		res = coordinator->GetResolution();
+	else
+	{
+		raytracer.LoadScene(sceneFile, sceneOptions);
+		raytracer.ReportMemoryUsage();
+		res = raytracer.GetResolution();
+	}
 	wWindow = res.x;
 	hWindow = res.y;
 }
@@ -224,25 +273,168 @@ void InitializeFrame()
 
 void RTRenderLoop()
 {
+	TimelineNameThread("render loop");
+	int frame = 0;
 	while (!shouldExit)
 	{
-		raytracer.RenderFrame();
+		frame++;
+		if (coordinator)
+			coordinator->RenderFrame(frame, texData);
+		else
+		{
+			raytracer.RenderFrame();
+			if (shouldDumpHeatmap)
+			{
+				shouldDumpHeatmap = false;
+				char name[1024];
+				snprintf(name, sizeof(name), heatDumpPattern.c_str(), frame);
+				if (raytracer.WriteHeatmap(name))
+					cout << "Heatmap written to " << name << endl;
+			}
+			if (frame % 100 == 0)
+			{
+				raytracer.GetRayStats().Report();
+				raytracer.ReportRenderResolution();
+			}
+		}
 		//_sleep(1 * 1000);
 		shouldRedisplay = true;
 	}
 }
 
+void WriteTimeline()
+{
+	TimelineStop();
+}
+
+// Usage: Lab02 [scene file] [-frames first last] [-out pattern] [-heatdump pattern] [-encoders n] [-queue n] [-strips n] [-fsync n] [-spawn n] [-listen port] [-benchorder frames] [-benchsparse frames] [TAG value ...]
+//        Lab02 -benchkernels tests [-hitratio r] [-baseline file]
+//        Lab02 [scene file] -regress dir [-tolerance n] [-frames first last] [TAG value ...]
+//        Lab02 -worker host:port
+//        Any of these also takes -timeline file.json
+void ParseArguments(int argc, char** argv)
+{
+	int i = 1;
+	if (argc > 1 && std::string(argv[1]).find('.') != std::string::npos)
+		sceneFile = argv[i++];
+	for (; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "-frames" && i + 2 < argc)
+		{
+			firstFrame = atoi(argv[++i]);
+			lastFrame = atoi(argv[++i]);
+		}
+		else if (arg == "-out" && i + 1 < argc)
+			framePattern = argv[++i];
+		else if (arg == "-heatdump" && i + 1 < argc)
+		{
+			heatDumpPattern = argv[++i];
+			dumpEveryHeatmap = true;
+		}
+		else if (arg == "-encoders" && i + 1 < argc)
+			encodeSettings.encoders = atoi(argv[++i]);
+		else if (arg == "-queue" && i + 1 < argc)
+			encodeSettings.queueSize = atoi(argv[++i]);
+		else if (arg == "-strips" && i + 1 < argc)
+			encodeSettings.strips = atoi(argv[++i]);
+		else if (arg == "-fsync" && i + 1 < argc)
+			encodeSettings.syncEvery = atoi(argv[++i]);
+		else if (arg == "-benchorder" && i + 1 < argc)
+			benchOrderFrames = atoi(argv[++i]);
+		else if (arg == "-benchsparse" && i + 1 < argc)
+			benchSparseFrames = atoi(argv[++i]);
+		else if (arg == "-benchkernels" && i + 1 < argc)
+			benchKernelTests = atoi(argv[++i]);
+		else if (arg == "-hitratio" && i + 1 < argc)
+			benchHitRatio = (float)atof(argv[++i]);
+		else if (arg == "-baseline" && i + 1 < argc)
+			benchBaseline = argv[++i];
+		else if (arg == "-regress" && i + 1 < argc)
+			regressDir = argv[++i];
+		else if (arg == "-tolerance" && i + 1 < argc)
+			regressTolerance = atoi(argv[++i]);
+		else if (arg == "-spawn" && i + 1 < argc)
+			spawnWorkers = atoi(argv[++i]);
+		else if (arg == "-listen" && i + 1 < argc)
+			listenPort = atoi(argv[++i]);
+		else if (arg == "-timeline" && i + 1 < argc)
+			timelineFile = argv[++i];
+		else if (arg == "-worker" && i + 1 < argc)
+			workerAddress = argv[++i];
+		else
+		{
+			sceneOptions += arg;
+			sceneOptions += " ";
+		}
+	}
+}
+
 int main(int argc, char** argv)
 {
+	ParseArguments(argc, argv);
+	if (!timelineFile.empty() && TimelineStart(timelineFile))
+	{
+		// Written however the program ends, the window only closes through exit
+		TimelineNameThread("main");
+		atexit(WriteTimeline);
+	}
+	if (benchOrderFrames > 0)
+		return BenchmarkPixelOrders(sceneFile, sceneOptions, benchOrderFrames) ? 0 : 1;
+	if (benchSparseFrames > 0)
+		return BenchmarkSparseTrace(sceneFile, sceneOptions, benchSparseFrames) ? 0 : 1;
+	if (benchKernelTests > 0)
+		return BenchmarkKernels(benchKernelTests, benchHitRatio, benchBaseline) ? 0 : 1;
+	if (!regressDir.empty())
+	{
+		if (firstFrame < 0)
+		{
+			firstFrame = 0;
+			lastFrame = REGRESS_FRAMES - 1;
+		}
+		return RunRegression(regressDir, sceneFile, sceneOptions, firstFrame, lastFrame, regressTolerance) ? 0 : 1;
+	}
+	if (!workerAddress.empty())
+	{
+		size_t colon = workerAddress.rfind(':');
+		if (colon == std::string::npos)
+		{
+			cout << "Worker address must be host:port" << endl;
+			return 1;
+		}
+		return RunWorker(workerAddress.substr(0, colon), atoi(workerAddress.substr(colon + 1).c_str())) ? 0 : 1;
+	}
+	if (spawnWorkers > 0 || listenPort >= 0)
+	{
+		coordinator = new Coordinator();
+		if (!coordinator->Start(sceneFile, sceneOptions, listenPort < 0 ? 0 : listenPort, spawnWorkers))
+			return 1;
+	}
+	if (firstFrame >= 0)
+	{
+		bool ok;
+		if (coordinator)
+		{
+			ok = BatchRender(*coordinator, firstFrame, lastFrame, framePattern, encodeSettings);
+			delete coordinator;
+		}
+		else
+			ok = BatchRender(sceneFile, sceneOptions, firstFrame, lastFrame, framePattern, encodeSettings, dumpEveryHeatmap ? heatDumpPattern : "");
+		return ok ? 0 : 1;
+	}
 	InitializeRayTracer();
-	InitializeGL(argc, argv);
+	// Command line arguments are scene tags, do not pass them to GLUT
+	InitializeGL(1, argv);
 	InitializeFrame();
 
 	omp_set_nested(1);
 	#pragma omp parallel sections num_threads(2)
 	{
 		#pragma omp section
-		glutMainLoop();
+		{
+			TimelineNameThread("display");
+			glutMainLoop();
+		}
 		#pragma omp section
 		RTRenderLoop();
 	}
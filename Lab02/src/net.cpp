@@ -0,0 +1,177 @@
+#ifdef _WIN32
+#define FD_SETSIZE 1024
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+#include <string.h>
+#include <stdio.h>
+
+#include "net.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+bool NetInit()
+{
+#ifdef _WIN32
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+	return true;
+#endif
+}
+
+Socket NetListen(int port)
+{
+	Socket s = (Socket)socket(AF_INET, SOCK_STREAM, 0);
+	if (s == INVALID_SOCK)
+		return s;
+	int on = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)port);
+	if (bind(s, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 64) != 0)
+	{
+		NetClose(s);
+		return INVALID_SOCK;
+	}
+	return s;
+}
+
+int NetLocalPort(Socket s)
+{
+	sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(s, (sockaddr*)&addr, &len) != 0)
+		return -1;
+	return ntohs(addr.sin_port);
+}
+
+static void SetNoDelay(Socket s)
+{
+	int on = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+}
+
+Socket NetAccept(Socket s)
+{
+	Socket c = (Socket)accept(s, 0, 0);
+	if (c != INVALID_SOCK)
+		SetNoDelay(c);
+	return c;
+}
+
+Socket NetConnect(std::string host, int port)
+{
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* info = 0;
+	char service[16];
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host.c_str(), service, &hints, &info) != 0)
+		return INVALID_SOCK;
+	Socket s = INVALID_SOCK;
+	for (addrinfo* a = info; a; a = a->ai_next)
+	{
+		s = (Socket)socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (s == INVALID_SOCK)
+			continue;
+		if (connect(s, a->ai_addr, (int)a->ai_addrlen) == 0)
+			break;
+		NetClose(s);
+		s = INVALID_SOCK;
+	}
+	freeaddrinfo(info);
+	if (s != INVALID_SOCK)
+		SetNoDelay(s);
+	return s;
+}
+
+void NetClose(Socket s)
+{
+#ifdef _WIN32
+	closesocket(s);
+#else
+	close(s);
+#endif
+}
+
+bool NetSend(Socket s, const void* data, size_t size)
+{
+	const char* p = (const char*)data;
+	while (size > 0)
+	{
+		int n = send(s, p, (int)size, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool NetRecv(Socket s, void* data, size_t size)
+{
+	char* p = (char*)data;
+	while (size > 0)
+	{
+		int n = recv(s, p, (int)size, 0);
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+void NetSetTimeout(Socket s, int timeoutMs)
+{
+#ifdef _WIN32
+	DWORD ms = timeoutMs;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&ms, sizeof(ms));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&ms, sizeof(ms));
+#else
+	timeval tv;
+	tv.tv_sec = timeoutMs / 1000;
+	tv.tv_usec = (timeoutMs % 1000) * 1000;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
+#endif
+}
+
+bool NetWait(const std::vector<Socket>& sockets, int timeoutMs, std::vector<bool>& ready)
+{
+	fd_set set;
+	FD_ZERO(&set);
+	Socket maxSocket = 0;
+	for (Socket s : sockets)
+	{
+		FD_SET(s, &set);
+		if (s > maxSocket)
+			maxSocket = s;
+	}
+	timeval tv;
+	tv.tv_sec = timeoutMs / 1000;
+	tv.tv_usec = (timeoutMs % 1000) * 1000;
+	int n = select((int)maxSocket + 1, &set, 0, 0, timeoutMs < 0 ? 0 : &tv);
+	ready.assign(sockets.size(), false);
+	if (n <= 0)
+		return false;
+	for (int i = 0; i < (int)sockets.size(); i++)
+		ready[i] = FD_ISSET(sockets[i], &set) != 0;
+	return true;
+}
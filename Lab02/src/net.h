@@ -0,0 +1,31 @@
+#ifndef __NET_H__
+#define __NET_H__
+
+#include <string>
+#include <vector>
+
+// Thin wrapper over Winsock and BSD sockets, blocking TCP only
+#ifdef _WIN32
+typedef unsigned long long Socket;
+#else
+typedef int Socket;
+#endif
+const Socket INVALID_SOCK = (Socket)-1;
+
+bool NetInit();
+// Listens on all interfaces, port 0 picks a free one
+Socket NetListen(int port);
+int NetLocalPort(Socket s);
+Socket NetAccept(Socket s);
+Socket NetConnect(std::string host, int port);
+void NetClose(Socket s);
+// Send or receive exactly size bytes, false if the connection is lost
+bool NetSend(Socket s, const void* data, size_t size);
+bool NetRecv(Socket s, void* data, size_t size);
+// Sends and receives on s fail once they wait longer than timeoutMs
+void NetSetTimeout(Socket s, int timeoutMs);
+// Waits until some of the sockets can be read, or timeoutMs passes
+// (-1 waits forever). ready[i] is set for each readable socket.
+bool NetWait(const std::vector<Socket>& sockets, int timeoutMs, std::vector<bool>& ready);
+
+#endif
@@ -0,0 +1,199 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include <stdio.h>
+#include <string>
+#include <fstream>
+
+#include "numa.h"
+
+#ifndef _WIN32
+// Parses a sysfs processor list such as "0-3,8-11"
+static std::vector<int> ParseCpuList(std::string list)
+{
+	std::vector<int> res;
+	size_t pos = 0;
+	while (pos < list.size())
+	{
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+		std::string range = list.substr(pos, end - pos);
+		int first, last;
+		if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2)
+		{
+			for (int c = first; c <= last; c++)
+				res.push_back(c);
+		}
+		else if (sscanf(range.c_str(), "%d", &first) == 1)
+			res.push_back(first);
+		pos = end + 1;
+	}
+	return res;
+}
+#endif
+
+void NumaTopology::Detect()
+{
+	nodeCpus.clear();
+#ifdef _WIN32
+	ULONG highest = 0;
+	GetNumaHighestNodeNumber(&highest);
+	DWORD_PTR processMask, systemMask;
+	GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+	for (ULONG n = 0; n <= highest; n++)
+	{
+		ULONGLONG mask = 0;
+		if (!GetNumaNodeProcessorMask((UCHAR)n, &mask))
+			continue;
+		std::vector<int> list;
+		for (int c = 0; c < 64; c++)
+		{
+			if ((mask & processMask) & (1ull << c))
+				list.push_back(c);
+		}
+		if (!list.empty())
+			nodeCpus.push_back(list);
+	}
+#else
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	for (int n = 0; ; n++)
+	{
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+		std::ifstream fin(path);
+		if (!fin.is_open())
+			break;
+		std::string line;
+		std::getline(fin, line);
+		std::vector<int> list;
+		for (int c : ParseCpuList(line))
+		{
+			if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+				list.push_back(c);
+		}
+		if (!list.empty())
+			nodeCpus.push_back(list);
+	}
+	if (nodeCpus.empty())
+	{
+		std::vector<int> list;
+		for (int c = 0; c < CPU_SETSIZE; c++)
+		{
+			if (CPU_ISSET(c, &allowed))
+				list.push_back(c);
+		}
+		nodeCpus.push_back(list);
+	}
+#endif
+	cpus.clear();
+	cpuNode.clear();
+	for (int n = 0; n < (int)nodeCpus.size(); n++)
+	{
+		for (int c : nodeCpus[n])
+		{
+			cpus.push_back(c);
+			cpuNode.push_back(n);
+		}
+	}
+}
+
+int NumaTopology::NodeCount() const
+{
+	return (int)nodeCpus.size();
+}
+
+int NumaTopology::ThreadCpu(int t, int count) const
+{
+	if (cpus.empty() || count <= 0)
+		return 0;
+	return (int)((long long)t * (long long)cpus.size() / count) % (int)cpus.size();
+}
+
+bool PinThread(int cpu)
+{
+#ifdef _WIN32
+	if (cpu >= 64)
+		return false;
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+size_t PageSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+void* AllocPages(size_t size, bool hugePages)
+{
+#ifdef _WIN32
+	if (hugePages)
+	{
+		// Needs the "Lock pages in memory" privilege, fall back without it
+		size_t large = GetLargePageMinimum();
+		if (large > 0)
+		{
+			void* p = VirtualAlloc(0, (size + large - 1) / large * large, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (p)
+				return p;
+		}
+	}
+	return VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return 0;
+#ifdef MADV_HUGEPAGE
+	// Transparent huge pages, no reserved pool needed
+	if (hugePages)
+		madvise(p, size, MADV_HUGEPAGE);
+#endif
+	return p;
+#endif
+}
+
+void FreePages(void* p, size_t size)
+{
+	if (!p)
+		return;
+#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+#else
+	munmap(p, size);
+#endif
+}
+
+int PageNode(const void* p)
+{
+#if !defined(_WIN32) && defined(SYS_move_pages)
+	// With no target nodes move_pages only reports where pages are
+	void* page = (void*)((size_t)p & ~(PageSize() - 1));
+	int status = -1;
+	if (syscall(SYS_move_pages, 0, 1, &page, 0, &status, 0) != 0 || status < 0)
+		return -1;
+	return status;
+#else
+	return -1;
+#endif
+}
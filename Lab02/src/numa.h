@@ -0,0 +1,34 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <vector>
+#include <stddef.h>
+
+// Processors of the machine grouped by NUMA node, only the ones this
+// process may run on. Machines without NUMA have a single node.
+class NumaTopology
+{
+public:
+	std::vector<std::vector<int>> nodeCpus;
+	std::vector<int> cpus;		// All processors, node by node
+	std::vector<int> cpuNode;	// Node of each entry of cpus
+
+	void Detect();
+	int NodeCount() const;
+	// Spreads count threads evenly over the processors, neighbouring
+	// threads share a node. Returns the index into cpus of thread t.
+	int ThreadCpu(int t, int count) const;
+};
+
+// Pins the calling thread to one processor
+bool PinThread(int cpu);
+// Memory from the OS page allocator, not touched yet so pages are placed on
+// the node of the first thread writing them. With hugePages, 2MB pages are
+// requested where the OS allows it.
+void* AllocPages(size_t size, bool hugePages);
+void FreePages(void* p, size_t size);
+// Node the page holding p is on, -1 if unknown or not supported by the OS
+int PageNode(const void* p);
+size_t PageSize();
+
+#endif
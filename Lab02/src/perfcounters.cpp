@@ -0,0 +1,83 @@
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <string.h>
+
+#include "perfcounters.h"
+
+#ifdef __linux__
+static int OpenCounter(unsigned long long config)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;	// Also count threads created later
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+PerfCounters::PerfCounters()
+{
+	cacheReferences = 0;
+	cacheMisses = 0;
+	refFd = -1;
+	missFd = -1;
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+	if (refFd >= 0)
+		close(refFd);
+	if (missFd >= 0)
+		close(missFd);
+#endif
+}
+
+bool PerfCounters::Open()
+{
+#ifdef __linux__
+	refFd = OpenCounter(PERF_COUNT_HW_CACHE_REFERENCES);
+	missFd = OpenCounter(PERF_COUNT_HW_CACHE_MISSES);
+#endif
+	return Available();
+}
+
+bool PerfCounters::Available()
+{
+	return refFd >= 0 && missFd >= 0;
+}
+
+void PerfCounters::Start()
+{
+	if (!Available())
+		return;
+#ifdef __linux__
+	ioctl(refFd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(missFd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(refFd, PERF_EVENT_IOC_ENABLE, 0);
+	ioctl(missFd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+void PerfCounters::Stop()
+{
+	if (!Available())
+		return;
+#ifdef __linux__
+	ioctl(refFd, PERF_EVENT_IOC_DISABLE, 0);
+	ioctl(missFd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(refFd, &cacheReferences, sizeof(cacheReferences)) != sizeof(cacheReferences))
+		cacheReferences = 0;
+	if (read(missFd, &cacheMisses, sizeof(cacheMisses)) != sizeof(cacheMisses))
+		cacheMisses = 0;
+#endif
+}
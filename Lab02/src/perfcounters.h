@@ -0,0 +1,25 @@
+#ifndef __PERFCOUNTERS_H__
+#define __PERFCOUNTERS_H__
+
+// Hardware cache counters of the process, for all threads started after
+// Open. Only available on Linux when perf events are allowed.
+class PerfCounters
+{
+public:
+	long long cacheReferences;
+	long long cacheMisses;
+
+	PerfCounters();
+	~PerfCounters();
+	bool Open();
+	bool Available();
+	void Start();
+	// Counts since Start are left in cacheReferences and cacheMisses
+	void Stop();
+
+private:
+	int refFd;
+	int missFd;
+};
+
+#endif
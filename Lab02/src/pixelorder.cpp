@@ -0,0 +1,103 @@
+#include <algorithm>
+
+#include "pixelorder.h"
+
+bool ParsePixelOrder(std::string name, PixelOrder& order)
+{
+	if (name == "SCANLINE")
+		order = PixelOrder::SCANLINE;
+	else if (name == "TILED")
+		order = PixelOrder::TILED;
+	else if (name == "MORTON")
+		order = PixelOrder::MORTON;
+	else if (name == "HILBERT")
+		order = PixelOrder::HILBERT;
+	else
+		return false;
+	return true;
+}
+
+std::string PixelOrderName(PixelOrder order)
+{
+	if (order == PixelOrder::TILED)
+		return "TILED";
+	else if (order == PixelOrder::MORTON)
+		return "MORTON";
+	else if (order == PixelOrder::HILBERT)
+		return "HILBERT";
+	return "SCANLINE";
+}
+
+// Moves the lower 16 bits of v to the even bits
+static unsigned int SpreadBits(unsigned int v)
+{
+	v &= 0xFFFF;
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+unsigned int MortonCode(unsigned int x, unsigned int y)
+{
+	return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+unsigned int HilbertCode(unsigned int n, unsigned int x, unsigned int y)
+{
+	unsigned int d = 0;
+	for (unsigned int s = n / 2; s > 0; s /= 2)
+	{
+		unsigned int rx = (x & s) > 0;
+		unsigned int ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant so the curve continues
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+// Code of (x, y) for curve orders, row major index otherwise
+static unsigned int OrderCode(PixelOrder order, unsigned int n, unsigned int width, unsigned int x, unsigned int y)
+{
+	if (order == PixelOrder::MORTON)
+		return MortonCode(x, y);
+	else if (order == PixelOrder::HILBERT)
+		return HilbertCode(n, x, y);
+	return y * width + x;
+}
+
+static void CurveOrder(PixelOrder order, int width, int height, std::vector<glm::ivec2>& cells)
+{
+	unsigned int n = 1;
+	while ((int)n < width || (int)n < height)
+		n *= 2;
+	std::vector<std::pair<unsigned int, glm::ivec2>> codes;
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			codes.push_back(std::make_pair(OrderCode(order, n, width, x, y), glm::ivec2(x, y)));
+	std::sort(codes.begin(), codes.end(),
+		[](const std::pair<unsigned int, glm::ivec2>& a, const std::pair<unsigned int, glm::ivec2>& b) { return a.first < b.first; });
+	cells.clear();
+	for (auto& c : codes)
+		cells.push_back(c.second);
+}
+
+void TileOrder(PixelOrder order, int tilesX, int tilesY, std::vector<glm::ivec2>& tiles)
+{
+	CurveOrder(order, tilesX, tilesY, tiles);
+}
+
+void TilePixelOrder(PixelOrder order, int size, std::vector<glm::ivec2>& pixels)
+{
+	CurveOrder(order, size, size, pixels);
+}
@@ -0,0 +1,30 @@
+#ifndef __PIXELORDER_H__
+#define __PIXELORDER_H__
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Order in which the pixels of a frame are traced
+enum class PixelOrder
+{
+	SCANLINE,	// Row after row over the whole image
+	TILED,		// Tiles row after row, rows inside a tile
+	MORTON,		// Tiles and the pixels inside them along a Z curve
+	HILBERT,	// Tiles and the pixels inside them along a Hilbert curve
+};
+
+bool ParsePixelOrder(std::string name, PixelOrder& order);
+std::string PixelOrderName(PixelOrder order);
+
+// Interleaves the bits of x and y, x in the even bits
+unsigned int MortonCode(unsigned int x, unsigned int y);
+// Position of (x, y) along the Hilbert curve over an n x n grid, n a power of 2
+unsigned int HilbertCode(unsigned int n, unsigned int x, unsigned int y);
+
+// Tiles of a tilesX x tilesY grid in the order they are traced
+void TileOrder(PixelOrder order, int tilesX, int tilesY, std::vector<glm::ivec2>& tiles);
+// Pixels of a size x size tile in the order they are traced
+void TilePixelOrder(PixelOrder order, int size, std::vector<glm::ivec2>& pixels);
+
+#endif
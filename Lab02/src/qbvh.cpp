@@ -0,0 +1,341 @@
+#include <math.h>
+#include <algorithm>
+
+#include "qbvh.h"
+#include "bvh.h"
+#include "heatmap.h"
+
+const unsigned int QBVH_LEAF = 0x80000000;
+const unsigned int QBVH_EMPTY = 0xFFFFFFFF;
+const int QBVH_COUNT_SHIFT = 27;
+const unsigned int QBVH_FIRST_MASK = (1 << QBVH_COUNT_SHIFT) - 1;
+const int QBVH_STACK_SIZE = 64;
+// Quantized coordinates are q / 2^16 for the low and (q + 1) / 2^16 for the
+// high side, both exact in float, so 0 and 65535 decode to the frame itself
+const float QBVH_SCALE = 65536.0f;
+const float QBVH_INV_SCALE = 1.0f / 65536.0f;
+
+static float Decode(float lo, float hi, float f)
+{
+	return lo * (1.0f - f) + hi * f;
+}
+
+static bool SlabTest(const AABB& box, glm::vec3 rayOrg, glm::vec3 invDir, float tMax, float& tEnter)
+{
+	glm::vec3 t0 = (box.bmin - rayOrg) * invDir;
+	glm::vec3 t1 = (box.bmax - rayOrg) * invDir;
+	glm::vec3 tNear = glm::min(t0, t1);
+	glm::vec3 tFar = glm::max(t0, t1);
+	tEnter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+	float tExit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, tMax));
+	return tEnter <= tExit;
+}
+
+QBVH::QBVH()
+{
+	shapes = 0;
+}
+
+void QBVH::Build(const std::vector<Shape*>& shapeList)
+{
+	shapes = &shapeList;
+	nodes.clear();
+	prims.clear();
+	rootBox = AABB();
+	if (shapeList.empty())
+		return;
+
+	// Build a binary BVH and keep its topology only
+	BVH bvh;
+	bvh.Build(shapeList);
+	prims.assign(bvh.primIndex.begin(), bvh.primIndex.end());
+	if (bvh.nodes[0].count > 0)
+	{
+		QBVHNode root;
+		root.child[0] = Convert(bvh, 0);
+		root.child[1] = QBVH_EMPTY;
+		nodes.push_back(root);
+	}
+	else
+	{
+		nodes.reserve(bvh.nodes.size() / 2);
+		Convert(bvh, 0);
+	}
+	nodes.shrink_to_fit();
+	Refit();
+}
+
+unsigned int QBVH::Convert(const BVH& bvh, int node)
+{
+	const BVHNode& n = bvh.nodes[node];
+	if (n.count > 0)
+		return QBVH_LEAF | (n.count << QBVH_COUNT_SHIFT) | n.first;
+	// Nodes are stored in pre-order, children always after their parent
+	unsigned int index = (unsigned int)nodes.size();
+	nodes.push_back(QBVHNode());
+	unsigned int left = Convert(bvh, n.left);
+	unsigned int right = Convert(bvh, n.left + 1);
+	nodes[index].child[0] = left;
+	nodes[index].child[1] = right;
+	return index;
+}
+
+AABB QBVH::ChildBounds(const AABB& frame, int node, int c)
+{
+	const QBVHNode& n = nodes[node];
+	AABB box;
+	for (int a = 0; a < 3; a++)
+	{
+		box.bmin[a] = Decode(frame.bmin[a], frame.bmax[a], n.lo[c][a] * QBVH_INV_SCALE);
+		box.bmax[a] = Decode(frame.bmin[a], frame.bmax[a], (n.hi[c][a] + 1) * QBVH_INV_SCALE);
+	}
+	return box;
+}
+
+void QBVH::Quantize(const AABB& frame, int node, int c, const AABB& box)
+{
+	QBVHNode& n = nodes[node];
+	for (int a = 0; a < 3; a++)
+	{
+		float lo = frame.bmin[a];
+		float hi = frame.bmax[a];
+		float scale = hi > lo ? QBVH_SCALE / (hi - lo) : 0.0f;
+		// Round outwards, then fix up float rounding so the decoded box
+		// always contains the exact one
+		int qlo = std::min(std::max((int)floor((box.bmin[a] - lo) * scale), 0), 65535);
+		while (qlo > 0 && Decode(lo, hi, qlo * QBVH_INV_SCALE) > box.bmin[a])
+			qlo--;
+		int qhi = std::min(std::max((int)ceil((box.bmax[a] - lo) * scale) - 1, 0), 65535);
+		while (qhi < 65535 && Decode(lo, hi, (qhi + 1) * QBVH_INV_SCALE) < box.bmax[a])
+			qhi++;
+		n.lo[c][a] = (unsigned short)qlo;
+		n.hi[c][a] = (unsigned short)qhi;
+	}
+}
+
+void QBVH::Refit()
+{
+	if (nodes.empty())
+		return;
+
+	// Exact child boxes, bottom-up
+	std::vector<AABB> exact(nodes.size() * 2);
+	for (int i = (int)nodes.size() - 1; i >= 0; i--)
+	{
+		for (int c = 0; c < 2; c++)
+		{
+			unsigned int ref = nodes[i].child[c];
+			AABB box;
+			if (ref == QBVH_EMPTY)
+			{
+			}
+			else if (ref & QBVH_LEAF)
+			{
+				unsigned int first = ref & QBVH_FIRST_MASK;
+				unsigned int count = (ref & ~QBVH_LEAF) >> QBVH_COUNT_SHIFT;
+				for (unsigned int j = first; j < first + count; j++)
+					box.Expand((*shapes)[prims[j]]->GetBounds());
+			}
+			else
+			{
+				box.Expand(exact[ref * 2]);
+				box.Expand(exact[ref * 2 + 1]);
+			}
+			exact[i * 2 + c] = box;
+		}
+	}
+	rootBox = AABB();
+	rootBox.Expand(exact[0]);
+	rootBox.Expand(exact[1]);
+
+	// Quantize top-down, each node relative to the decoded box of its parent
+	std::vector<AABB> frames(nodes.size());
+	frames[0] = rootBox;
+	for (int i = 0; i < (int)nodes.size(); i++)
+	{
+		for (int c = 0; c < 2; c++)
+		{
+			unsigned int ref = nodes[i].child[c];
+			if (ref == QBVH_EMPTY)
+			{
+				nodes[i].lo[c][0] = nodes[i].lo[c][1] = nodes[i].lo[c][2] = 0;
+				nodes[i].hi[c][0] = nodes[i].hi[c][1] = nodes[i].hi[c][2] = 0;
+				continue;
+			}
+			Quantize(frames[i], i, c, exact[i * 2 + c]);
+			if (!(ref & QBVH_LEAF))
+				frames[ref] = ChildBounds(frames[i], i, c);
+		}
+	}
+}
+
+AABB QBVH::GetBounds()
+{
+	return rootBox;
+}
+
+template <bool CountTests>
+bool QBVH::ClosestHit(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim)
+{
+	if (nodes.empty())
+		return false;
+	glm::vec3 invDir = 1.0f / rayDir;
+	float currDepth = INFINITY;
+	int currIndex = -1;
+
+	unsigned int stack[QBVH_STACK_SIZE];
+	AABB frames[QBVH_STACK_SIZE];
+	float enters[QBVH_STACK_SIZE];
+	int top = 0;
+	stack[top] = 0;
+	frames[top] = rootBox;
+	enters[top] = 0.0f;
+	top++;
+	while (top > 0)
+	{
+		top--;
+		if (enters[top] > currDepth)
+			continue;
+		unsigned int node = stack[top];
+		AABB frame = frames[top];
+		AABB childBoxes[2];
+		float childEnters[2];
+		bool childHits[2];
+		for (int c = 0; c < 2; c++)
+		{
+			childHits[c] = false;
+			if (nodes[node].child[c] == QBVH_EMPTY)
+				continue;
+			childBoxes[c] = ChildBounds(frame, node, c);
+			childHits[c] = SlabTest(childBoxes[c], rayOrg, invDir, currDepth, childEnters[c]);
+		}
+		// Visit the nearer child first
+		int order[2] = { 0, 1 };
+		if (childHits[0] && childHits[1] && childEnters[1] < childEnters[0])
+		{
+			order[0] = 1;
+			order[1] = 0;
+		}
+		for (int k = 1; k >= 0; k--)
+		{
+			int c = order[k];
+			if (!childHits[c])
+				continue;
+			unsigned int ref = nodes[node].child[c];
+			if (!(ref & QBVH_LEAF))
+			{
+				stack[top] = ref;
+				frames[top] = childBoxes[c];
+				enters[top] = childEnters[c];
+				top++;
+				continue;
+			}
+			unsigned int first = ref & QBVH_FIRST_MASK;
+			unsigned int count = (ref & ~QBVH_LEAF) >> QBVH_COUNT_SHIFT;
+			if (CountTests)
+				heatCounters.tests += count;
+			for (unsigned int j = first; j < first + count; j++)
+			{
+				Shape* s = (*shapes)[prims[j]];
+				float depth = 0.0f;
+				Shape* prim = 0;
+				if (s->Intersect(rayOrg, rayDir, s == self ? skip : 0, depth, prim))
+				{
+					if (depth < currDepth || (depth == currDepth && (int)prims[j] < currIndex))
+					{
+						currDepth = depth;
+						currIndex = prims[j];
+						hitObj = s;
+						hitPrim = prim;
+					}
+				}
+			}
+		}
+	}
+	if (currIndex < 0)
+		return false;
+	hitDepth = currDepth;
+	return true;
+}
+
+bool QBVH::Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim)
+{
+	if (countTests)
+		return ClosestHit<true>(rayOrg, rayDir, self, skip, hitDepth, hitObj, hitPrim);
+	return ClosestHit<false>(rayOrg, rayDir, self, skip, hitDepth, hitObj, hitPrim);
+}
+
+template <bool CountTests>
+bool QBVH::AnyHit(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip)
+{
+	if (nodes.empty())
+		return false;
+	glm::vec3 invDir = 1.0f / rayDir;
+
+	unsigned int stack[QBVH_STACK_SIZE];
+	AABB frames[QBVH_STACK_SIZE];
+	int top = 0;
+	stack[top] = 0;
+	frames[top] = rootBox;
+	top++;
+	while (top > 0)
+	{
+		top--;
+		unsigned int node = stack[top];
+		AABB frame = frames[top];
+		for (int c = 0; c < 2; c++)
+		{
+			unsigned int ref = nodes[node].child[c];
+			if (ref == QBVH_EMPTY)
+				continue;
+			AABB box = ChildBounds(frame, node, c);
+			float enter = 0.0f;
+			if (!SlabTest(box, rayOrg, invDir, maxDist, enter))
+				continue;
+			if (!(ref & QBVH_LEAF))
+			{
+				stack[top] = ref;
+				frames[top] = box;
+				top++;
+				continue;
+			}
+			unsigned int first = ref & QBVH_FIRST_MASK;
+			unsigned int count = (ref & ~QBVH_LEAF) >> QBVH_COUNT_SHIFT;
+			if (CountTests)
+				heatCounters.tests += count;
+			for (unsigned int j = first; j < first + count; j++)
+			{
+				Shape* s = (*shapes)[prims[j]];
+				float depth = 0.0f;
+				Shape* prim = 0;
+				if (s->Intersect(rayOrg, rayDir, s == self ? skip : 0, depth, prim))
+				{
+					if (depth < maxDist)
+						return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+bool QBVH::Occluded(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip)
+{
+	if (countTests)
+		return AnyHit<true>(rayOrg, rayDir, maxDist, self, skip);
+	return AnyHit<false>(rayOrg, rayDir, maxDist, self, skip);
+}
+
+size_t QBVH::MemoryUsage()
+{
+	return nodes.size() * sizeof(QBVHNode) + prims.size() * sizeof(unsigned int);
+}
+
+size_t QBVH::UncompressedMemoryUsage()
+{
+	// Every QBVH node is an inner node of the binary tree
+	size_t binaryNodes = nodes.size() * 2 + 1;
+	if (!nodes.empty() && nodes[0].child[1] == QBVH_EMPTY)
+		binaryNodes = 1;
+	return binaryNodes * sizeof(BVHNode) + prims.size() * (sizeof(Shape*) + sizeof(int));
+}
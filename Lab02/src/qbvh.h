@@ -0,0 +1,55 @@
+#ifndef __QBVH_H__
+#define __QBVH_H__
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "shapes.h"
+#include "accel.h"
+
+class BVH;
+
+// 32 byte node holding the boxes of both children, quantized to 16 bits
+// inside the (decoded) box of the node itself
+class QBVHNode
+{
+public:
+	unsigned short lo[2][3];
+	unsigned short hi[2][3];
+	unsigned int child[2];	// Node index, or QBVH_LEAF | count << 27 | first
+};
+
+// Binary BVH with quantized boxes. Primitives are referenced by their index
+// in the shape list given to Build, which must outlive the QBVH.
+class QBVH : public Accelerator
+{
+public:
+	std::vector<QBVHNode> nodes;
+	std::vector<unsigned int> prims;
+	AABB rootBox;
+
+	QBVH();
+	void Build(const std::vector<Shape*>& shapes);
+	void Refit();
+	AABB GetBounds();
+
+	bool Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim);
+	bool Occluded(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip);
+
+	size_t MemoryUsage();
+	size_t UncompressedMemoryUsage();
+
+private:
+	// Traversals of the queries above, CountTests adds the primitives tested
+	// to heatCounters
+	template <bool CountTests>
+	bool ClosestHit(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim);
+	template <bool CountTests>
+	bool AnyHit(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip);
+	const std::vector<Shape*>* shapes;
+	unsigned int Convert(const BVH& bvh, int node);
+	AABB ChildBounds(const AABB& frame, int node, int c);
+	void Quantize(const AABB& frame, int node, int c, const AABB& box);
+};
+
+#endif
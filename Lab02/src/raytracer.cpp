@@ -1,14 +1,90 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
 #include "raytracer.h"
+#include "kernels.h"
 #include "omp.h"
+#include "timeline.h"
+
+RayStats::RayStats()
+{
+	traced = 0;
+	culled = 0;
+	roulette = 0;
+	overBudget = 0;
+}
+
+void RayStats::Add(const RayStats& other)
+{
+	traced += other.traced;
+	culled += other.culled;
+	roulette += other.roulette;
+	overBudget += other.overBudget;
+}
+
+void RayStats::Report()
+{
+	long long total = traced + culled + roulette + overBudget;
+	if (total == 0)
+		return;
+	std::cout << "Reflection rays: " << traced << " traced, " << culled << " below threshold, "
+		<< roulette << " lost roulette, " << overBudget << " over budget ("
+		<< 100.0 * (total - traced) / total << "% culled)" << std::endl;
+}
+
+RayCounters::RayCounters()
+{
+	Reset();
+}
+
+void RayCounters::Reset()
+{
+	traced = 0;
+	culled = 0;
+	roulette = 0;
+	overBudget = 0;
+	budgetLeft = 0;
+	budgetFrame = -1;
+}
 
 RayTracer::RayTracer()
 {
 	nativeResolution = glm::ivec2(0);
+	renderResolution = glm::ivec2(0);
+	renderAA = 0;
+	dynamicResolution = false;
+	sparseTrace = false;
+	sparseFrame = false;
+	primaryCache = false;
+	primaryCacheFrame = false;
+	for (int k = 0; k < 4; k++)
+		cachedView[k] = glm::vec3(0.0f);
+	cachedResolution = glm::ivec2(0);
+	heatmap = false;
+	heatmapFrame = false;
+	heatResolution = glm::ivec2(0);
 	nativeImg = 0;
 	outImg = 0;
+	accel = 0;
+	staticAccel = 0;
+	dynamicAccel = 0;
+	hasDynamicObjects = false;
+	isReplica = false;
+	imagePages = false;
+	imageSize = 0;
+	tilesX = 0;
+	tilesY = 0;
+	tracesLeft = 0;
+	updatedAhead = false;
+	traceKernel = &RayTracer::Trace;
+	traceFeatures = 0;
+	cullRays = false;
+	rays = &rayCounters;
 
 	camPos = glm::vec3(0.0f, 0.0f, -250.0f);
 	camDir = glm::vec3(0.0f, 0.0f, 1.0f);
@@ -19,11 +95,23 @@ RayTracer::RayTracer()
 
 RayTracer::~RayTracer()
 {
-	if (nativeImg)
+	FinishUpdate();
+	for (size_t n = 1; n < replicas.size(); n++)
+		delete replicas[n];
+	if (nativeImg && !isReplica)
 	{
-		delete nativeImg;
+		if (imagePages)
+			FreePages(nativeImg, imageSize);
+		else
+			delete[] nativeImg;
 		nativeImg = 0;
 	}
+	if (accel)
+	{
+		delete accel;
+		accel = 0;
+	}
+	ClearShadowCaches();
 }
 
 void RayTracer::SetOutImage(GLubyte* out)
@@ -36,16 +124,69 @@ glm::ivec2 RayTracer::GetResolution()
 	return scene.resolution;
 }
 
-bool RayTracer::LoadScene(std::string file)
+glm::ivec2 RayTracer::GetNativeResolution()
 {
+	return nativeResolution;
+}
+
+bool RayTracer::LoadScene(std::string file, std::string options)
+{
+	std::string text;
+	if (!Scene::ReadSceneFile(file, options, text))
+		return false;
+	if (!LoadSceneText(text))
+		return false;
+	if (scene.hotReload && !isReplica)
+		reloader.Start(file, options);
+	else
+		reloader.Stop();
+	return true;
+}
+
+bool RayTracer::LoadSceneText(std::string text)
+{
+	FinishUpdate();
 	objects.swap(std::vector<Shape*>());
 	lights.swap(std::vector<Light*>());
-	bool res = scene.LoadScene(file);
+	bool res = scene.LoadSceneText(text);
 	if (!res)
 		return res;
-	nativeResolution.x = scene.resolution.x * scene.antialiasLevel;
-	nativeResolution.y = scene.resolution.y * scene.antialiasLevel;
-	nativeImg = new GLubyte[nativeResolution.x * nativeResolution.y * 3];
+	renderAA = 0;
+	SetRenderResolution(scene.resolution, scene.antialiasLevel);
+	TilePixelOrder(scene.pixelOrder, TILE_SIZE, tilePixels);
+	if (scene.numa)
+		topology.Detect();
+	if (!isReplica)
+		AllocateImage();
+	dynamicResolution = scene.frameTime > 0.0f && !scene.pipeline && !scene.numa;
+	if (scene.frameTime > 0.0f && !dynamicResolution)
+		std::cout << "FRAMETIME is ignored with PIPELINE and NUMA" << std::endl;
+	frameTimer.Setup(scene.frameTime, scene.minScale, scene.minAntialias, scene.antialiasLevel);
+	if (dynamicResolution)
+		scaledImg.resize((size_t)scene.resolution.x * scene.resolution.y * 3);
+	else
+		std::vector<GLubyte>().swap(scaledImg);
+	sparseTrace = scene.sparseTrace != SparsePattern::NONE && !scene.pipeline && !scene.numa;
+	if (scene.sparseTrace != SparsePattern::NONE && !sparseTrace)
+		std::cout << "SPARSETRACE is ignored with PIPELINE and NUMA" << std::endl;
+	primaryCache = scene.primaryCache && !scene.numa;
+	if (scene.primaryCache && !primaryCache)
+		std::cout << "PRIMARYCACHE is ignored with NUMA" << std::endl;
+	heatmap = scene.heatmap != HeatmapMode::NONE && !scene.pipeline && !scene.numa;
+	if (scene.heatmap != HeatmapMode::NONE && !heatmap)
+		std::cout << "HEATMAP is ignored with PIPELINE and NUMA" << std::endl;
+	if (heatmap)
+		heatValues.assign((size_t)nativeResolution.x * nativeResolution.y, 0.0);
+	else
+		std::vector<double>().swap(heatValues);
+	heatOutput.clear();
+	heatResolution = glm::ivec2(0);
+	// Samples of an earlier scene point to its shapes, none may stay valid
+	if (sparseTrace || primaryCache)
+		gbuffer.assign((size_t)nativeResolution.x * nativeResolution.y, GBufferSample());
+	else
+		std::vector<GBufferSample>().swap(gbuffer);
+	objectBounds.clear();
 	for (auto s : scene.shapes)
 	{
 		if (s->type == ShapeType::LIGHT)
@@ -53,9 +194,238 @@ bool RayTracer::LoadScene(std::string file)
 		else
 			objects.push_back(s);
 	}
+	if (accel)
+		delete accel;
+	accel = CreateAccelerator(scene.accelType);
+	accel->Build(objects);
+	BuildShadowCaches();
+	lightTree.Build(lights);
+	shadingLights.Update(lights);
+	SelectTraceKernel();
+	CountPrimitiveTests();
+	cullRays = scene.rayThreshold > 0.0f || scene.rayBudget > 0;
+	rayCounters.Reset();
+	if (scene.numa && !isReplica)
+		CreateReplicas(text);
 	return res;
 }
 
+void RayTracer::AllocateImage()
+{
+	if (nativeImg)
+	{
+		if (imagePages)
+			FreePages(nativeImg, imageSize);
+		else
+			delete[] nativeImg;
+		nativeImg = 0;
+	}
+	imageSize = nativeResolution.x * nativeResolution.y * 3;
+	// Tiled layouts store whole tiles at the borders
+	if (scene.pixelOrder != PixelOrder::SCANLINE)
+		imageSize = (size_t)tilesX * tilesY * TILE_SIZE * TILE_SIZE * 3;
+	imagePages = scene.numa || scene.hugePages;
+	if (imagePages)
+		nativeImg = (GLubyte*)AllocPages(imageSize, scene.hugePages);
+	if (!nativeImg)
+	{
+		imagePages = false;
+		nativeImg = new GLubyte[imageSize];
+	}
+	if (!scene.numa)
+		return;
+
+	// First touch: every row is written first by the thread that renders it,
+	// which puts its pages on the node of that thread. Pixels are touched
+	// where TracePixel writes them, rows are not linear in tiled layouts.
+	rowNode.assign(nativeResolution.y, 0);
+	#pragma omp parallel num_threads(RenderThreads())
+	{
+		int node = PinRenderThread(omp_get_thread_num(), omp_get_num_threads());
+		#pragma omp for schedule(static)
+		for (int i = 0; i < nativeResolution.y; i++)
+		{
+			for (int j = 0; j < nativeResolution.x; j++)
+				memset(&nativeImg[NativeIndex(i, j)], 0, 3);
+			rowNode[i] = node;
+		}
+	}
+}
+
+void RayTracer::CreateReplicas(std::string text)
+{
+	for (size_t n = 1; n < replicas.size(); n++)
+		delete replicas[n];
+	replicas.clear();
+	if (topology.NodeCount() < 2)
+		return;
+	replicas.push_back(this);
+	for (int n = 1; n < topology.NodeCount(); n++)
+	{
+		RayTracer* replica = new RayTracer();
+		replica->isReplica = true;
+		// Loaded by a thread on node n, so shapes and acceleration
+		// structures are allocated there
+		std::thread loader([&]()
+		{
+			PinThread(topology.nodeCpus[n][0]);
+			replica->LoadSceneText(text);
+		});
+		loader.join();
+		replica->nativeImg = nativeImg;
+		replica->rays = rays;
+		replicas.push_back(replica);
+	}
+}
+
+void RayTracer::UpdateReplica(RayTracer* replica)
+{
+	if (replica->scene.frame != scene.frame)
+	{
+		replica->scene.EvaluateAt(scene.frame);
+		replica->RefitScene();
+	}
+	replica->camPos = camPos;
+	replica->camDir = camDir;
+	replica->camUp = camUp;
+	replica->camFocal = camFocal;
+	replica->camFovy = camFovy;
+	replica->SetupImagePlane();
+}
+
+int RayTracer::RenderThreads()
+{
+	// One processor is left to the window, as in the pixel loop
+	int numThreads = omp_get_max_threads();
+	if (numThreads > 1)
+		numThreads--;
+	return numThreads;
+}
+
+// Pins thread t of count to its processor and returns its node
+int RayTracer::PinRenderThread(int t, int count)
+{
+	if (topology.cpus.empty())
+		return 0;
+	int cpu = topology.ThreadCpu(t, count);
+	PinThread(topology.cpus[cpu]);
+	return topology.cpuNode[cpu];
+}
+
+void RayTracer::ReportMemoryUsage()
+{
+	size_t used = accel->MemoryUsage();
+	size_t uncompressed = accel->UncompressedMemoryUsage();
+	for (auto g : scene.geometries)
+	{
+		used += g->accel->MemoryUsage();
+		uncompressed += g->accel->UncompressedMemoryUsage();
+	}
+	size_t prims = objects.size();
+	for (auto g : scene.geometries)
+		prims += g->shapes.size();
+	std::cout << "Acceleration structure: " << AccelTypeName(scene.accelType) << ", "
+		<< prims << " primitives, " << used << " bytes";
+	if (uncompressed != used)
+		std::cout << " (binary BVH: " << uncompressed << " bytes)";
+	if (prims > 0)
+		std::cout << ", " << (float)used / prims << " bytes per primitive";
+	std::cout << std::endl;
+	size_t shapeCount, shapeBytes, materialBytes;
+	scene.StorageUsage(shapeCount, shapeBytes, materialBytes);
+	std::cout << "Scene storage: " << shapeCount << " shapes, " << shapeBytes << " bytes of geometry, "
+		<< materialBytes << " bytes of surfaces and motion";
+	if (shapeCount > 0)
+		std::cout << ", " << (float)shapeBytes / shapeCount << " + " << (float)materialBytes / shapeCount << " bytes per shape";
+	std::cout << std::endl;
+	std::cout << "Kernels: " << SimdLevelName(simdKernels->level) << ", best supported " << SimdLevelName(DetectSimdLevel()) << std::endl;
+	if (!shadowCaches.empty())
+	{
+		int cached = 0;
+		size_t bytes = 0;
+		for (auto c : shadowCaches)
+		{
+			if (!c)
+				continue;
+			cached++;
+			bytes += c->MemoryUsage();
+		}
+		std::cout << "Shadow cache: " << cached << " of " << lights.size() << " lights, "
+			<< bytes << " bytes, " << (hasDynamicObjects ? "" : "no ") << "moving objects traced" << std::endl;
+	}
+	if (scene.numa)
+		ReportNumaUsage();
+}
+
+void RayTracer::ReportRenderResolution()
+{
+	if (!dynamicResolution)
+		return;
+	std::cout << "Render resolution: " << renderResolution.x << "x" << renderResolution.y
+		<< ", antialias " << renderAA << ", " << frameTimer.lastMs << " ms per frame" << std::endl;
+}
+
+RayStats RayTracer::GetRayStats()
+{
+	RayStats stats;
+	stats.traced = rays->traced;
+	stats.culled = rays->culled;
+	stats.roulette = rays->roulette;
+	stats.overBudget = rays->overBudget;
+	return stats;
+}
+
+void RayTracer::ReportNumaUsage()
+{
+	std::cout << "NUMA: " << topology.NodeCount() << " nodes, " << topology.cpus.size() << " processors, "
+		<< RenderThreads() << " pinned render threads";
+	if (imagePages && scene.hugePages)
+		std::cout << ", huge pages requested";
+	std::cout << std::endl;
+
+	// Framebuffer pages on the node of the thread rendering them
+	int local = 0;
+	int remote = 0;
+	size_t page = PageSize();
+	for (size_t offset = 0; offset < imageSize && nativeResolution.x > 0; offset += page)
+	{
+		int node = PageNode(nativeImg + offset);
+		// Pages of border tiles may start in rows past the image
+		int row = NativeRow(offset);
+		if (node < 0 || row < 0 || row >= nativeResolution.y)
+			continue;
+		if (node == rowNode[row])
+			local++;
+		else
+			remote++;
+	}
+	// Shapes of every copy of the scene on the node of that copy
+	int localShapes = 0;
+	int remoteShapes = 0;
+	for (int n = 0; n < (int)replicas.size(); n++)
+	{
+		for (auto s : replicas[n]->scene.shapes)
+		{
+			int node = PageNode(s);
+			if (node < 0)
+				continue;
+			if (node == n)
+				localShapes++;
+			else
+				remoteShapes++;
+		}
+	}
+	if (local + remote == 0)
+	{
+		std::cout << "NUMA: page placement is not reported by the OS" << std::endl;
+		return;
+	}
+	std::cout << "NUMA: framebuffer pages local " << local << ", remote " << remote;
+	if (replicas.size() > 1)
+		std::cout << "; scene copies " << replicas.size() << ", shapes local " << localShapes << ", remote " << remoteShapes;
+	std::cout << std::endl;
+}
+
 void RayTracer::SetCamera(glm::vec3 pos, glm::vec3 dir, glm::vec3 up)
 {
 	camPos = pos;
@@ -75,111 +445,630 @@ void RayTracer::SetProjection(float f, float fovy)
 		camFovy = 179.5;
 }
 
-float RayTracer::IntersectionDistance(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape*& hitObj)
+float RayTracer::IntersectionDistance(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* selfPrim, Shape*& hitObj, Shape*& hitPrim)
 {
 	float currDepth = INF;
-	int hitIndex = -1;
-	int currIndex = -1;
-	for (auto s : objects)
+	float hitDepth = 0.0f;
+	if (accel->Intersect(rayOrg, rayDir, self, selfPrim, hitDepth, hitObj, hitPrim) && hitDepth < currDepth)
+		currDepth = hitDepth;
+	return currDepth;
+}
+
+// Seed for stochastic light selection, depends only on the shading point
+static unsigned int HashPoint(glm::vec3 p, int depth)
+{
+	unsigned int h = 2166136261u ^ depth;
+	for (int i = 0; i < 3; i++)
 	{
-		currIndex++;
-		if (s == self)
-			continue;
-		float hitDepth = 0.0f;
-		if (s->Hit(rayOrg, rayDir, hitDepth))
-		{
-			if (hitDepth < currDepth)
-			{
-				currDepth = hitDepth;
-				hitIndex = currIndex;
-			}
-		}
+		unsigned int bits;
+		memcpy(&bits, &p[i], sizeof(bits));
+		h = (h ^ bits) * 16777619u;
+		h ^= h >> 15;
 	}
-	if (hitIndex != -1)
-		hitObj = objects[hitIndex];
-	return currDepth;
+	return h;
 }
 
-std::vector<Light*> RayTracer::ShadowRays(glm::vec3 p, Shape* self)
+void RayTracer::SelectLights(glm::vec3 p, glm::vec3 n, int depth, std::vector<int>& selected, std::vector<float>& weights)
 {
-	std::vector<Light*> res;
-	for (auto l : lights)
+	if (scene.lightSamples > 0)
 	{
-		glm::vec3 ray = glm::normalize(l->center - p);
-		float lightDist = glm::distance(p, l->center);
+		lightTree.Sample(p, n, scene.lightCullThreshold, scene.lightSamples, HashPoint(p, depth), selected, weights);
+		return;
+	}
+	lightTree.Select(p, n, scene.lightCullThreshold, selected);
+	weights.assign(selected.size(), 1.0f);
+}
 
-		float currDepth = lightDist;
-		bool isHit = false;
-		for (auto s : objects)
+void RayTracer::ShadowRays(glm::vec3 p, Shape* self, Shape* selfPrim, std::vector<int>& selected, std::vector<float>& weights)
+{
+	// Keep the lights that are not occluded. Rays to all lights are traced
+	// together, PACKET_SIZE lights at a time.
+	int count = 0;
+	for (int first = 0; first < (int)selected.size(); first += PACKET_SIZE)
+	{
+		int last = std::min(first + PACKET_SIZE, (int)selected.size());
+		ShadowPacket packet;
+		for (int i = first; i < last; i++)
 		{
-			if (s == self)
-				continue;
-			float hitDepth = 0.0f;
-			if (s->Hit(p, ray, hitDepth))
+			Light* l = lights[selected[i]];
+			packet.Add(glm::normalize(l->center - p), glm::distance(p, l->center));
+		}
+		OccludedLights(p, packet, &selected[first], self, selfPrim);
+		for (int i = first; i < last; i++)
+		{
+			if (packet.active & (1 << (i - first)))
 			{
-				if (hitDepth < currDepth)
-				{
-					isHit = true;
-					break;
-				}
+				selected[count] = selected[i];
+				weights[count] = weights[i];
+				count++;
 			}
 		}
-		if (!isHit)
-			res.push_back(l);
 	}
-	return res;
+	selected.resize(count);
+	weights.resize(count);
 }
 
-glm::vec3 RayTracer::Phong(glm::vec3 n, glm::vec3 v, glm::vec3 p, Light light, Shape object)
+glm::vec3 RayTracer::Phong(glm::vec3 n, glm::vec3 v, glm::vec3 p, const Light& light, const Shape& object)
 {
 	glm::vec3 l = glm::normalize(glm::vec3(light.center - p));
 	glm::vec3 r = glm::normalize(glm::reflect(-l, n));
 	float sDot = glm::max(glm::dot(l, n), 0.0f);
-	glm::vec3 diffuse = light.diff_color * object.diff_color * sDot;
+	glm::vec3 diffuse = light.surface->diff_color * object.surface->diff_color * sDot;
 	glm::vec3 specular = glm::vec3(0.0f);
 	if (sDot > 0.0f)
-		specular = light.spec_color * object.spec_color * glm::pow(glm::max(glm::dot(r, v), 0.0f), object.shininess);
+		specular = light.surface->spec_color * object.surface->spec_color * glm::pow(glm::max(glm::dot(r, v), 0.0f), object.surface->shininess);
+	if (light.falloff > 0.0f)
+	{
+		glm::vec3 d = light.center - p;
+		return (diffuse + specular) * LightTree::Attenuation(light.falloff, glm::dot(d, d));
+	}
 	return diffuse + specular;
 }
 
-glm::vec3 RayTracer::Trace(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, int depth)
+// Sum of the weighted Phong terms of the selected lights, shaded in batches
+glm::vec3 RayTracer::ShadeLights(glm::vec3 n, glm::vec3 v, glm::vec3 p, const int* selected, const float* weights, int count, const Shape& material)
+{
+	glm::vec3 color = glm::vec3(0.0f);
+	ShadingBatch batch;
+	for (int i = 0; i < count; i++)
+	{
+		batch.Add(p, n, v, material, shadingLights, selected[i], weights[i]);
+		if (batch.count == PACKET_SIZE)
+		{
+			color += ShadeBatch(batch);
+			batch.count = 0;
+		}
+	}
+	return color + ShadeBatch(batch);
+}
+
+void RayTracer::RefitLights()
+{
+	lightTree.Refit();
+	shadingLights.Update(lights);
+}
+
+// Follows the animation step the scene was moved to
+void RayTracer::RefitScene()
+{
+	TimelineScope scope("RefitScene");
+	// Only the top level has to follow moving objects and instances
+	accel->Refit();
+	if (dynamicAccel)
+		dynamicAccel->Refit();
+	RefitLights();
+}
+
+// Takes in the last version of the scene file the reloader parsed. Edits
+// of shapes are copied into the scene and keep the caches of the shapes
+// they do not touch, anything else loads the scene again.
+void RayTracer::ApplyReload()
+{
+	SceneReload* reload = reloader.Take();
+	if (!reload)
+		return;
+	TimelineScope scope("ApplyReload");
+	FinishUpdate();
+	auto start = std::chrono::steady_clock::now();
+	SceneEdits edits;
+	if (!scene.numa && scene.ApplyEdits(reload->scene, edits))
+	{
+		for (auto g : edits.geometries)
+		{
+			g->Build(scene.accelType);
+			// Instance bounds may stay the same while their hits change
+			for (size_t k = 0; k < objects.size() && k < objectBounds.size(); k++)
+			{
+				if (objects[k]->type == ShapeType::INSTANCE && ((Instance*)objects[k])->geometry == g)
+					InvalidatePrimaryHits(objectBounds[k]);
+			}
+		}
+		if (edits.moved && !shadowCaches.empty())
+			BuildShadowCaches();
+		RefitScene();
+		SelectTraceKernel();
+		CountPrimitiveTests();
+		std::cout << "Scene edited, " << edits.shapes << " shapes changed";
+	}
+	else
+	{
+		// The window and outImg keep the size they were made with
+		if (reload->scene.resolution != scene.resolution)
+		{
+			std::cout << "RESOLUTION can't change while rendering, scene not reloaded" << std::endl;
+			delete reload;
+			return;
+		}
+		// Animations go on from where they were
+		int frame = scene.frame;
+		if (!LoadSceneText(reload->text))
+		{
+			delete reload;
+			return;
+		}
+		scene.EvaluateAt(frame);
+		RefitScene();
+		if (!scene.hotReload)
+			reloader.Stop();
+		std::cout << "Scene loaded again";
+	}
+	std::cout << " in " << std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+	delete reload;
+}
+
+// HEATMAP TESTS: every acceleration structure, those of geometries too,
+// traverses with the counting of primitive tests
+void RayTracer::CountPrimitiveTests()
+{
+	bool count = heatmap && scene.heatmap == HeatmapMode::TESTS;
+	accel->countTests = count;
+	if (staticAccel)
+		staticAccel->countTests = count;
+	if (dynamicAccel)
+		dynamicAccel->countTests = count;
+	for (auto g : scene.geometries)
+	{
+		if (g->accel)
+			g->accel->countTests = count;
+	}
+}
+
+// Splits the objects into static and moving ones and makes an empty cache
+// for every static light, filled as shadow rays reach it
+void RayTracer::BuildShadowCaches()
+{
+	ClearShadowCaches();
+	if (scene.shadowCacheResolution <= 0)
+		return;
+	std::vector<Shape*> staticObjects;
+	std::vector<Shape*> dynamicObjects;
+	for (auto s : objects)
+	{
+		if (s->Moves())
+			dynamicObjects.push_back(s);
+		else
+			staticObjects.push_back(s);
+	}
+	staticAccel = CreateAccelerator(scene.accelType);
+	staticAccel->Build(staticObjects);
+	dynamicAccel = CreateAccelerator(scene.accelType);
+	dynamicAccel->Build(dynamicObjects);
+	hasDynamicObjects = !dynamicObjects.empty();
+	for (auto l : lights)
+	{
+		if (l->Moves())
+			shadowCaches.push_back(0);
+		else
+			shadowCaches.push_back(new LightVisibilityCache(l->center, scene.shadowCacheResolution, scene.shadowCacheError, staticAccel));
+	}
+}
+
+void RayTracer::ClearShadowCaches()
+{
+	for (auto c : shadowCaches)
+		delete c;
+	shadowCaches.clear();
+	if (staticAccel)
+	{
+		delete staticAccel;
+		staticAccel = 0;
+	}
+	if (dynamicAccel)
+	{
+		delete dynamicAccel;
+		dynamicAccel = 0;
+	}
+	hasDynamicObjects = false;
+}
+
+void RayTracer::OccludedLights(glm::vec3 p, ShadowPacket& packet, const int* lightIndices, Shape* self, Shape* selfPrim)
+{
+	if (shadowCaches.empty())
+	{
+		accel->OccludedPacket(p, packet, self, selfPrim);
+		return;
+	}
+	// Rays the caches answer for skip the static objects
+	unsigned int traceStatic = 0;
+	for (int i = 0; i < packet.count; i++)
+	{
+		LightVisibilityCache* cache = shadowCaches[lightIndices[i]];
+		ShadowState state = cache ? cache->Lookup(p) : ShadowState::UNKNOWN;
+		if (state == ShadowState::OCCLUDED)
+			packet.active &= ~(1u << i);
+		else if (state == ShadowState::UNKNOWN)
+			traceStatic |= 1u << i;
+	}
+	if (packet.active & traceStatic)
+	{
+		unsigned int answered = packet.active & ~traceStatic;
+		packet.active &= traceStatic;
+		staticAccel->OccludedPacket(p, packet, self, selfPrim);
+		packet.active |= answered;
+	}
+	if (packet.active && hasDynamicObjects)
+		dynamicAccel->OccludedPacket(p, packet, self, selfPrim);
+}
+
+// Factor of the reflected color at p on a path of the given throughput, 0
+// when the reflection is culled. Below the threshold a path survives
+// Russian roulette with probability throughput * reflectivity / threshold
+// and is reweighted by its inverse, so the expected color is unchanged.
+float RayTracer::ReflectionWeight(glm::vec3 p, int depth, float throughput, float reflectivity)
+{
+	float weight = reflectivity;
+	float contribution = throughput * reflectivity;
+	if (contribution < scene.rayThreshold)
+	{
+		if (!scene.russianRoulette)
+		{
+			rays->culled.fetch_add(1, std::memory_order_relaxed);
+			return 0.0f;
+		}
+		// Same seed as the light selection of the hit, with other bits
+		float survival = contribution / scene.rayThreshold;
+		float u = (HashPoint(p, ~depth) >> 8) * (1.0f / 16777216.0f);
+		if (u >= survival)
+		{
+			rays->roulette.fetch_add(1, std::memory_order_relaxed);
+			return 0.0f;
+		}
+		weight = reflectivity / survival;
+	}
+	if (scene.rayBudget > 0 && rays->budgetLeft.fetch_sub(1, std::memory_order_relaxed) <= 0)
+	{
+		rays->overBudget.fetch_add(1, std::memory_order_relaxed);
+		return 0.0f;
+	}
+	rays->traced.fetch_add(1, std::memory_order_relaxed);
+	return weight;
+}
+
+// Starts the reflection ray budget of a frame
+void RayTracer::ResetRayBudget(int frame)
+{
+	rays->budgetLeft = scene.rayBudget;
+	rays->budgetFrame = frame;
+}
+
+static void WriteGBuffer(GBufferSample* sample, float t, glm::vec3 n, Shape* hitObj, Shape* hitPrim)
+{
+	if (!sample)
+		return;
+	sample->depth = t;
+	sample->normal = n;
+	sample->object = hitObj;
+	sample->prim = hitPrim;
+	sample->valid = true;
+}
+
+glm::vec3 RayTracer::Trace(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* selfPrim, int depth, float throughput, GBufferSample* sample)
 {
 	glm::vec3 color = glm::vec3(0.0f);
 	
 	Shape* hitObj = 0;
-	float t = IntersectionDistance(rayOrg, rayDir, self, hitObj);
+	Shape* hitPrim = 0;
+	float t;
+	if (sample && sample->valid)
+	{
+		t = sample->depth;
+		hitObj = sample->object;
+		hitPrim = sample->prim;
+	}
+	else
+		t = IntersectionDistance(rayOrg, rayDir, self, selfPrim, hitObj, hitPrim);
 	if (t == INF)
+	{
+		WriteGBuffer(sample, INF, glm::vec3(0.0f), 0, 0);
 		return scene.backgroundColor;
+	}
 
 	glm::vec3 p = rayOrg + rayDir * t;
 	glm::vec3 v = glm::normalize(rayOrg - p);
 	glm::vec3 n = glm::vec3(0.0f);
-	if (hitObj->type == ShapeType::SPHERE)
-		n = glm::normalize(p - hitObj->center);
-	else if (hitObj->type == ShapeType::QUAD)
+	Shape* material = hitObj;
+	if (hitObj->type == ShapeType::INSTANCE)
 	{
-		n = ((Quad*)hitObj)->normal;
-		if (glm::dot(n, v) < 0.0f)
-			n = -n;
+		Instance* instance = (Instance*)hitObj;
+		n = instance->Normal(p, hitPrim);
+		material = instance->Material(hitPrim);
+	}
+	else
+		n = hitObj->Normal(p);
+	if (hitPrim->type == ShapeType::QUAD && glm::dot(n, v) < 0.0f)
+		n = -n;
+	WriteGBuffer(sample, t, n, hitObj, hitPrim);
+	std::vector<int> contributedLights;
+	std::vector<float> weights;
+	SelectLights(p, n, depth, contributedLights, weights);
+	if (heatmapFrame)
+		heatCounters.shadowRays += contributedLights.size();
+	ShadowRays(p, hitObj, hitPrim, contributedLights, weights);
+	if (scene.batchShading)
+		color = ShadeLights(n, v, p, contributedLights.data(), weights.data(), (int)contributedLights.size(), *material);
+	else
+	{
+		for (int i = 0; i < (int)contributedLights.size(); i++)
+			color += weights[i] * Phong(n, v, p, *lights[contributedLights[i]], *material);
 	}
-	std::vector<Light*> contributedLights = ShadowRays(p, hitObj);
-	for (auto l : contributedLights)
-		color += Phong(n, v, p, *l, *hitObj);
 
-	float reflectivity = hitObj->reflectivity;
+	float reflectivity = material->surface->reflectivity;
 	if (depth <= 0 || reflectivity == 0.0f)
 		return color;
+	float weight = reflectivity;
+	if (cullRays)
+	{
+		weight = ReflectionWeight(p, depth, throughput, reflectivity);
+		if (weight == 0.0f)
+			return (1.0f - reflectivity) * color;
+	}
 
+	// Deepest reflection of the pixel, for HEATMAP DEPTH
+	if (heatmapFrame)
+		heatCounters.depth = glm::max(heatCounters.depth, scene.traceDepth - depth + 1);
 	glm::vec3 reflected = glm::normalize(glm::reflect(rayDir, n));
-	glm::vec3 refColor = Trace(p, reflected, hitObj, depth - 1);
-	color = (1.0f - reflectivity) * color + reflectivity * refColor;
+	glm::vec3 refColor = Trace(p, reflected, hitObj, hitPrim, depth - 1, throughput * weight, 0);
+	color = (1.0f - reflectivity) * color + weight * refColor;
 
 	return color;
 }
 
+// Lights of a scene with TRACE_FEW_LIGHTS, selected like LightTree::Select
+// with no threshold does and traced as a single packet
+template <int Features>
+glm::vec3 RayTracer::ShadeFewLights(glm::vec3 n, glm::vec3 v, glm::vec3 p, Shape* self, Shape* selfPrim, const Shape& material)
+{
+	int selected[PACKET_SIZE];
+	ShadowPacket packet;
+	for (int i = 0; i < (int)lights.size(); i++)
+	{
+		glm::vec3 l = glm::normalize(lights[i]->center - p);
+		if (glm::dot(l, n) <= 0.0f)
+			continue;
+		selected[packet.count] = i;
+		packet.Add(l, glm::distance(p, lights[i]->center));
+	}
+	if (packet.count == 0)
+		return glm::vec3(0.0f);
+	OccludedLights(p, packet, selected, self, selfPrim);
+	int count = 0;
+	for (int i = 0; i < packet.count; i++)
+	{
+		if (packet.active & (1 << i))
+			selected[count++] = selected[i];
+	}
+
+	if (Features & TRACE_BATCH_SHADING)
+	{
+		static const float weights[PACKET_SIZE] = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
+		return ShadeLights(n, v, p, selected, weights, count, material);
+	}
+	glm::vec3 color = glm::vec3(0.0f);
+	for (int i = 0; i < count; i++)
+		color += Phong(n, v, p, *lights[selected[i]], material);
+	return color;
+}
+
+template <int Features, int Depth>
+glm::vec3 RayTracer::TraceKernel(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* selfPrim, int depth, float throughput, GBufferSample* sample)
+{
+	Shape* hitObj = 0;
+	Shape* hitPrim = 0;
+	float t;
+	if (sample && sample->valid)
+	{
+		t = sample->depth;
+		hitObj = sample->object;
+		hitPrim = sample->prim;
+	}
+	else
+		t = IntersectionDistance(rayOrg, rayDir, self, selfPrim, hitObj, hitPrim);
+	if (t == INF)
+	{
+		WriteGBuffer(sample, INF, glm::vec3(0.0f), 0, 0);
+		return scene.backgroundColor;
+	}
+
+	glm::vec3 p = rayOrg + rayDir * t;
+	glm::vec3 v = glm::normalize(rayOrg - p);
+	glm::vec3 n;
+	Shape* material = hitObj;
+	if ((Features & TRACE_INSTANCES) && hitObj->type == ShapeType::INSTANCE)
+	{
+		Instance* instance = (Instance*)hitObj;
+		n = instance->Normal(p, hitPrim);
+		material = instance->Material(hitPrim);
+	}
+	else
+		n = hitObj->Normal(p);
+	if ((Features & TRACE_QUADS) && hitPrim->type == ShapeType::QUAD && glm::dot(n, v) < 0.0f)
+		n = -n;
+	WriteGBuffer(sample, t, n, hitObj, hitPrim);
+
+	glm::vec3 color = glm::vec3(0.0f);
+	if (Features & TRACE_FEW_LIGHTS)
+		color = ShadeFewLights<Features>(n, v, p, hitObj, hitPrim, *material);
+	else if (!(Features & TRACE_NO_LIGHTS))
+	{
+		std::vector<int> contributedLights;
+		std::vector<float> weights;
+		SelectLights(p, n, depth, contributedLights, weights);
+		ShadowRays(p, hitObj, hitPrim, contributedLights, weights);
+		if (Features & TRACE_BATCH_SHADING)
+			color = ShadeLights(n, v, p, contributedLights.data(), weights.data(), (int)contributedLights.size(), *material);
+		else
+		{
+			for (int i = 0; i < (int)contributedLights.size(); i++)
+				color += weights[i] * Phong(n, v, p, *lights[contributedLights[i]], *material);
+		}
+	}
+
+	if (!(Features & TRACE_REFLECTIONS) || Depth <= 0)
+		return color;
+	float reflectivity = material->surface->reflectivity;
+	if (reflectivity == 0.0f)
+		return color;
+	float weight = reflectivity;
+	if (cullRays)
+	{
+		weight = ReflectionWeight(p, depth, throughput, reflectivity);
+		if (weight == 0.0f)
+			return (1.0f - reflectivity) * color;
+	}
+
+	glm::vec3 reflected = glm::normalize(glm::reflect(rayDir, n));
+	glm::vec3 refColor = TraceKernel<Features, (Depth > 0 ? Depth - 1 : 0)>(p, reflected, hitObj, hitPrim, depth - 1, throughput * weight, 0);
+	return (1.0f - reflectivity) * color + weight * refColor;
+}
+
+// Kernels for every feature set and depth, I = features * TRACE_KERNEL_DEPTHS + depth
+template <int I>
+void RayTracer::FillTraceKernels(TraceFunc* kernels, std::integral_constant<int, I>)
+{
+	kernels[I] = &RayTracer::TraceKernel<I / TRACE_KERNEL_DEPTHS, I % TRACE_KERNEL_DEPTHS>;
+	FillTraceKernels(kernels, std::integral_constant<int, I - 1>());
+}
+
+void RayTracer::FillTraceKernels(TraceFunc*, std::integral_constant<int, -1>)
+{
+}
+
+static bool IsReflective(Shape* s)
+{
+	return s->surface->reflectivity != 0.0f;
+}
+
+int RayTracer::FindTraceFeatures()
+{
+	int features = 0;
+	for (auto s : objects)
+	{
+		if (s->type == ShapeType::QUAD)
+			features |= TRACE_QUADS;
+		else if (s->type == ShapeType::INSTANCE)
+		{
+			Instance* instance = (Instance*)s;
+			features |= TRACE_INSTANCES;
+			for (auto prim : instance->geometry->shapes)
+			{
+				if (prim->type == ShapeType::QUAD)
+					features |= TRACE_QUADS;
+				if (IsReflective(instance->Material(prim)))
+					features |= TRACE_REFLECTIONS;
+			}
+		}
+		if (IsReflective(s))
+			features |= TRACE_REFLECTIONS;
+	}
+	if (scene.batchShading)
+		features |= TRACE_BATCH_SHADING;
+	if (lights.empty())
+		features |= TRACE_NO_LIGHTS;
+	else if ((int)lights.size() <= PACKET_SIZE && scene.lightSamples <= 0 && scene.lightCullThreshold <= 0.0f)
+	{
+		// Select skips lights with a negative power bound even with no threshold
+		bool positive = true;
+		for (auto l : lights)
+			positive = positive && LightTree::Power(l) >= 0.0f;
+		if (positive)
+			features |= TRACE_FEW_LIGHTS;
+	}
+	return features;
+}
+
+void RayTracer::SelectTraceKernel()
+{
+	static const std::vector<TraceFunc> kernels = []()
+	{
+		std::vector<TraceFunc> table(TRACE_FEATURE_SETS * TRACE_KERNEL_DEPTHS);
+		FillTraceKernels(table.data(), std::integral_constant<int, TRACE_FEATURE_SETS * TRACE_KERNEL_DEPTHS - 1>());
+		return table;
+	}();
+	traceFeatures = FindTraceFeatures();
+	int depth = 0;
+	if (traceFeatures & TRACE_REFLECTIONS)
+		depth = scene.traceDepth;
+	// Shadow rays and reflections of heatmaps are only counted by Trace
+	bool counted = heatmap && (scene.heatmap == HeatmapMode::SHADOWS || scene.heatmap == HeatmapMode::DEPTH);
+	if (!scene.specializedTrace || counted || depth < 0 || depth >= TRACE_KERNEL_DEPTHS)
+		traceKernel = &RayTracer::Trace;
+	else
+		traceKernel = kernels[traceFeatures * TRACE_KERNEL_DEPTHS + depth];
+}
+
+// Average of the native pixels of output pixel (i, j), i counted from the top
+void RayTracer::DownScalePixel(int i, int j, GLubyte* dst)
+{
+	int colorR = 0;
+	int colorG = 0;
+	int colorB = 0;
+	for (int k = 0; k < renderAA; k++)
+	{
+		const GLubyte* src = &nativeImg[NativeIndex(i * renderAA + k, j * renderAA + k)];
+		colorR += src[0];
+		colorG += src[1];
+		colorB += src[2];
+	}
+	colorR /= renderAA;
+	colorG /= renderAA;
+	colorB /= renderAA;
+	dst[0] = colorR;
+	dst[1] = colorG;
+	dst[2] = colorB;
+}
+
+// Offset in nativeImg of native pixel (i, j), i counted from the top. Rows
+// are stored bottom up for OpenGL, or with a pixel order other than
+// SCANLINE, tile after tile with the pixels of a tile along a Z curve.
+size_t RayTracer::NativeIndex(int i, int j)
+{
+	if (scene.pixelOrder == PixelOrder::SCANLINE)
+		return ((size_t)(nativeResolution.y - 1 - i) * nativeResolution.x + j) * 3;
+	int tile = (i / TILE_SIZE) * tilesX + j / TILE_SIZE;
+	return ((size_t)tile * TILE_SIZE * TILE_SIZE + MortonCode(j % TILE_SIZE, i % TILE_SIZE)) * 3;
+}
+
+// Native row of the byte at offset in nativeImg, the inverse of NativeIndex.
+// Rows of the padding of border tiles are past the image.
+int RayTracer::NativeRow(size_t offset)
+{
+	size_t pixel = offset / 3;
+	if (scene.pixelOrder == PixelOrder::SCANLINE)
+		return nativeResolution.y - 1 - (int)(pixel / nativeResolution.x);
+	int tile = (int)(pixel / (TILE_SIZE * TILE_SIZE));
+	unsigned int code = (unsigned int)(pixel % (TILE_SIZE * TILE_SIZE));
+	// The row inside the tile is in the odd bits of its Morton code
+	int y = 0;
+	for (int b = 0; (code >> (2 * b + 1)) != 0; b++)
+		y |= ((code >> (2 * b + 1)) & 1) << b;
+	return (tile / tilesX) * TILE_SIZE + y;
+}
+
 void RayTracer::SSAADownScale()
 {
-	glm::ivec2 res = scene.resolution;
+	TimelineScope scope("SSAADownScale");
+	glm::ivec2 res = renderResolution;
+	GLubyte* out = res == scene.resolution ? outImg : scaledImg.data();
 	int numThreads = omp_get_max_threads();
 	if (numThreads > 0)
 		numThreads--;
@@ -187,80 +1076,645 @@ void RayTracer::SSAADownScale()
 		numThreads -= 2;
 	else if (numThreads > 2)
 		numThreads -= 3;
+	int aa = renderAA;
 	#pragma omp parallel for num_threads(numThreads)
 	for (int i = 0; i < res.y; i++)
 	{
+		GLubyte* dst = &out[(res.y - 1 - i) * res.x * 3];
+		if (scene.pixelOrder == PixelOrder::SCANLINE)
+		{
+			// Native rows are stored bottom up
+			simdKernels->downScaleRow(&nativeImg[NativeIndex(i * aa, 0)], -(ptrdiff_t)nativeResolution.x * 3, aa, res.x, dst);
+			continue;
+		}
 		for (int j = 0; j < res.x; j++)
 		{
-			int colorR = 0;
-			int colorG = 0;
-			int colorB = 0;
-			for (int k = 0; k < scene.antialiasLevel; k++)
-			{
-				colorR += nativeImg[((nativeResolution.y - 1 - i * scene.antialiasLevel - k) * nativeResolution.x + j * scene.antialiasLevel + k) * 3];
-				colorG += nativeImg[((nativeResolution.y - 1 - i * scene.antialiasLevel - k) * nativeResolution.x + j * scene.antialiasLevel + k) * 3 + 1];
-				colorB += nativeImg[((nativeResolution.y - 1 - i * scene.antialiasLevel - k) * nativeResolution.x + j * scene.antialiasLevel + k) * 3 + 2];
-			}
-			colorR /= scene.antialiasLevel;
-			colorG /= scene.antialiasLevel;
-			colorB /= scene.antialiasLevel;
-
 			// Draw
-			outImg[((res.y - 1 - i) * res.x + j) * 3] = colorR;
-			outImg[((res.y - 1 - i) * res.x + j) * 3 + 1] = colorG;
-			outImg[((res.y - 1 - i) * res.x + j) * 3 + 2] = colorB;
+			DownScalePixel(i, j, &dst[j * 3]);
 		}
 	}
 }
 
-void RayTracer::RenderFrame()
+// Renders res output pixels with aa x aa native pixels each from the next
+// frame on. Both are at most the scene settings, nativeImg is not resized.
+void RayTracer::SetRenderResolution(glm::ivec2 res, int aa)
 {
-	// Update scene for animations
-	scene.UpdateScene();
+	if (res == renderResolution && aa == renderAA)
+		return;
+	renderResolution = res;
+	renderAA = aa;
+	nativeResolution = res * aa;
+	tilesX = (nativeResolution.x + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (nativeResolution.y + TILE_SIZE - 1) / TILE_SIZE;
+	TileOrder(scene.pixelOrder, tilesX, tilesY, tileOrder);
+}
 
+// Bilinear upscale of scaledImg at renderResolution to outImg
+void RayTracer::UpscaleImage()
+{
+	TimelineScope scope("UpscaleImage");
+	glm::ivec2 src = renderResolution;
+	glm::ivec2 res = scene.resolution;
+	float stepX = (float)src.x / res.x;
+	float stepY = (float)src.y / res.y;
+	int numThreads = omp_get_max_threads();
+	if (numThreads > 0)
+		numThreads--;
+	#pragma omp parallel for num_threads(numThreads)
+	for (int i = 0; i < res.y; i++)
+	{
+		float y = glm::clamp((i + 0.5f) * stepY - 0.5f, 0.0f, (float)(src.y - 1));
+		int y0 = (int)y;
+		int y1 = glm::min(y0 + 1, src.y - 1);
+		float fy = y - y0;
+		// Rows are stored bottom up
+		const GLubyte* row0 = &scaledImg[(size_t)(src.y - 1 - y0) * src.x * 3];
+		const GLubyte* row1 = &scaledImg[(size_t)(src.y - 1 - y1) * src.x * 3];
+		GLubyte* dst = &outImg[(size_t)(res.y - 1 - i) * res.x * 3];
+		for (int j = 0; j < res.x; j++)
+		{
+			float x = glm::clamp((j + 0.5f) * stepX - 0.5f, 0.0f, (float)(src.x - 1));
+			int x0 = (int)x;
+			int x1 = glm::min(x0 + 1, src.x - 1);
+			float fx = x - x0;
+			for (int c = 0; c < 3; c++)
+			{
+				float top = row0[x0 * 3 + c] + fx * (row0[x1 * 3 + c] - row0[x0 * 3 + c]);
+				float bottom = row1[x0 * 3 + c] + fx * (row1[x1 * 3 + c] - row1[x0 * 3 + c]);
+				dst[j * 3 + c] = (GLubyte)(top + fy * (bottom - top) + 0.5f);
+			}
+		}
+	}
+}
+
+void RayTracer::SetupImagePlane()
+{
 	// Position world space image plane
 	glm::vec3 imgCenter = camPos + camDir * camFocal;
 	float imgHeight = 2.0f * camFocal * tan((camFovy / 2.0f) * M_PI / 180.0f);
 	float aspect = (float)nativeResolution.x / (float)nativeResolution.y;
 	float imgWidth = imgHeight * aspect;
-	float deltaX = imgWidth / (float)nativeResolution.x;
-	float deltaY = imgHeight / (float)nativeResolution.y;
-	glm::vec3 camRight = glm::normalize(glm::cross(camUp, camDir));
+	deltaX = imgWidth / (float)nativeResolution.x;
+	deltaY = imgHeight / (float)nativeResolution.y;
+	camRight = glm::normalize(glm::cross(camUp, camDir));
 
 	// Starting at top left
-	glm::vec3 topLeft = imgCenter - camRight * (imgWidth * 0.5f);
+	topLeft = imgCenter - camRight * (imgWidth * 0.5f);
 	topLeft += camUp * (imgHeight * 0.5f);
-	// Loop through each pixel
+}
+
+// Traces a native pixel, for a heatmap frame keeps what it cost
+void RayTracer::TracePixel(int i, int j, glm::vec3 pixel)
+{
+	if (!heatmapFrame)
+	{
+		TracePixelColor(i, j, pixel);
+		return;
+	}
+	HeatCounters before = heatCounters;
+	heatCounters.depth = 0;
+	unsigned long long start = HeatClock();
+	TracePixelColor(i, j, pixel);
+	unsigned long long ticks = HeatClock() - start;
+	double value = 0.0;
+	if (scene.heatmap == HeatmapMode::TESTS)
+		value = (double)(heatCounters.tests - before.tests);
+	else if (scene.heatmap == HeatmapMode::SHADOWS)
+		value = (double)(heatCounters.shadowRays - before.shadowRays);
+	else if (scene.heatmap == HeatmapMode::DEPTH)
+		value = heatCounters.depth;
+	else if (scene.heatmap == HeatmapMode::CYCLES)
+		value = (double)ticks;
+	heatValues[(size_t)i * nativeResolution.x + j] = value;
+}
+
+// Traces native pixel (i, j) through the image plane position pixel
+void RayTracer::TracePixelColor(int i, int j, glm::vec3 pixel)
+{
+	glm::vec3 rayDir = glm::normalize(pixel - camPos);
+	GBufferSample* sample = 0;
+	if (sparseFrame || primaryCacheFrame)
+	{
+		sample = &gbuffer[(size_t)i * nativeResolution.x + j];
+		if (!primaryCacheFrame)
+			sample->valid = false;
+		if (sparseFrame && !IsTracedPixel(scene.sparseTrace, i, j))
+		{
+			TraceGBuffer(rayDir, *sample);
+			return;
+		}
+	}
+	// Trace
+	glm::vec3 color = (this->*traceKernel)(camPos, rayDir, 0, 0, scene.traceDepth, 1.0f, sample);
+	if (color.r > 1.0f)
+		color.r = 1.0f;
+	if (color.g > 1.0f)
+		color.g = 1.0f;
+	if (color.b > 1.0f)
+		color.b = 1.0f;
+	// Draw
+	GLubyte* dst = &nativeImg[NativeIndex(i, j)];
+	dst[0] = color.r * 255;
+	dst[1] = color.g * 255;
+	dst[2] = color.b * 255;
+}
+
+// Primary hit of a pixel SPARSETRACE leaves out, without shading
+void RayTracer::TraceGBuffer(glm::vec3 rayDir, GBufferSample& sample)
+{
+	if (sample.valid)
+		return;
+	Shape* hitObj = 0;
+	Shape* hitPrim = 0;
+	float t = IntersectionDistance(camPos, rayDir, 0, 0, hitObj, hitPrim);
+	if (t == INF)
+	{
+		WriteGBuffer(&sample, INF, glm::vec3(0.0f), 0, 0);
+		return;
+	}
+	glm::vec3 p = camPos + rayDir * t;
+	glm::vec3 n;
+	if (hitObj->type == ShapeType::INSTANCE)
+		n = ((Instance*)hitObj)->Normal(p, hitPrim);
+	else
+		n = hitObj->Normal(p);
+	if (hitPrim->type == ShapeType::QUAD && glm::dot(n, rayDir) > 0.0f)
+		n = -n;
+	WriteGBuffer(&sample, t, n, hitObj, hitPrim);
+}
+
+// Fills the native pixels SPARSETRACE left out with the colors of the
+// traced pixels around them, weighted by how close their G-buffer samples
+// are, so colors do not bleed across edges
+void RayTracer::ReconstructSparse()
+{
+	TimelineScope scope("ReconstructSparse");
+	glm::ivec2 res = nativeResolution;
 	int numThreads = omp_get_max_threads();
 	if (numThreads > 0)
 		numThreads--;
-	else if (numThreads > 1)
-		numThreads -= 2;
-	else if (numThreads > 2)
-		numThreads -= 3;
 	#pragma omp parallel for num_threads(numThreads)
+	for (int i = 0; i < res.y; i++)
+	{
+		for (int j = 0; j < res.x; j++)
+		{
+			if (IsTracedPixel(scene.sparseTrace, i, j))
+				continue;
+			const GBufferSample& pixel = gbuffer[(size_t)i * res.x + j];
+			glm::vec3 color = glm::vec3(0.0f);
+			float total = 0.0f;
+			for (int di = -1; di <= 1; di++)
+			{
+				for (int dj = -1; dj <= 1; dj++)
+				{
+					int y = i + di;
+					int x = j + dj;
+					if (y < 0 || y >= res.y || x < 0 || x >= res.x || !IsTracedPixel(scene.sparseTrace, y, x))
+						continue;
+					float w = GBufferWeight(pixel, gbuffer[(size_t)y * res.x + x], di, dj);
+					const GLubyte* src = &nativeImg[NativeIndex(y, x)];
+					color += w * glm::vec3(src[0], src[1], src[2]);
+					total += w;
+				}
+			}
+			GLubyte* dst = &nativeImg[NativeIndex(i, j)];
+			if (total > 0.0f)
+				color /= total;
+			dst[0] = (GLubyte)(color.r + 0.5f);
+			dst[1] = (GLubyte)(color.g + 0.5f);
+			dst[2] = (GLubyte)(color.b + 0.5f);
+		}
+	}
+}
+
+// Draws the costs of the traced native pixels in false colors. Output
+// pixels take the sum of their native pixels, or the deepest for DEPTH.
+// Sums are scaled so HEATMAP_PERCENTILE of them are below red, depths by
+// MAXDEPTH so their colors mean the same in every frame.
+void RayTracer::ResolveHeatmap()
+{
+	TimelineScope scope("ResolveHeatmap");
+	glm::ivec2 res = renderResolution;
+	int aa = renderAA;
+	bool deepest = scene.heatmap == HeatmapMode::DEPTH;
+	heatResolution = res;
+	heatOutput.assign((size_t)res.x * res.y, 0.0);
+	for (int i = 0; i < res.y; i++)
+	{
+		for (int j = 0; j < res.x; j++)
+		{
+			double value = 0.0;
+			for (int k = 0; k < aa; k++)
+			{
+				const double* src = &heatValues[(size_t)(i * aa + k) * nativeResolution.x + j * aa];
+				for (int l = 0; l < aa; l++)
+					value = deepest ? glm::max(value, src[l]) : value + src[l];
+			}
+			heatOutput[(size_t)i * res.x + j] = value;
+		}
+	}
+	double scale = scene.traceDepth;
+	if (!deepest && !heatOutput.empty())
+	{
+		std::vector<double> sorted = heatOutput;
+		size_t k = (size_t)((sorted.size() - 1) * HEATMAP_PERCENTILE);
+		std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+		scale = sorted[k];
+	}
+	GLubyte* out = res == scene.resolution ? outImg : scaledImg.data();
+	for (int i = 0; i < res.y; i++)
+	{
+		// Rows are stored bottom up
+		GLubyte* dst = &out[(size_t)(res.y - 1 - i) * res.x * 3];
+		for (int j = 0; j < res.x; j++)
+		{
+			double value = heatOutput[(size_t)i * res.x + j];
+			glm::vec3 color = HeatColor(scale > 0.0 ? (float)(value / scale) : 0.0f);
+			dst[j * 3 + 0] = color.r * 255;
+			dst[j * 3 + 1] = color.g * 255;
+			dst[j * 3 + 2] = color.b * 255;
+		}
+	}
+}
+
+bool RayTracer::RendersHeatmap()
+{
+	return heatmap;
+}
+
+bool RayTracer::WriteHeatmap(std::string file)
+{
+	if (heatOutput.empty())
+	{
+		std::cout << "No heatmap to write, HEATMAP is not set" << std::endl;
+		return false;
+	}
+	return WriteHeatCounts(file, scene.heatmap, heatResolution, heatOutput);
+}
+
+// Invalidates the cached primary hits that changes since the last frame
+// could affect: all of them when the image plane moved, otherwise those of
+// the pixels covered by the old or new bounds of an object that moved
+void RayTracer::UpdatePrimaryCache()
+{
+	TimelineScope scope("UpdatePrimaryCache");
+	glm::vec3 view[4] = { camPos, topLeft, camRight * deltaX, camUp * deltaY };
+	bool moved = objectBounds.size() != objects.size() || nativeResolution != cachedResolution;
+	for (int k = 0; k < 4; k++)
+		moved = moved || view[k] != cachedView[k];
+	if (moved)
+	{
+		for (GBufferSample& sample : gbuffer)
+			sample.valid = false;
+		objectBounds.resize(objects.size());
+		for (size_t k = 0; k < objects.size(); k++)
+			objectBounds[k] = objects[k]->GetBounds();
+		for (int k = 0; k < 4; k++)
+			cachedView[k] = view[k];
+		cachedResolution = nativeResolution;
+		return;
+	}
+	for (size_t k = 0; k < objects.size(); k++)
+	{
+		AABB bounds = objects[k]->GetBounds();
+		if (bounds.bmin == objectBounds[k].bmin && bounds.bmax == objectBounds[k].bmax)
+			continue;
+		AABB swept = objectBounds[k];
+		swept.Expand(bounds);
+		InvalidatePrimaryHits(swept);
+		objectBounds[k] = bounds;
+	}
+}
+
+// Invalidates the cached hits of the pixels whose primary rays could hit box
+void RayTracer::InvalidatePrimaryHits(const AABB& box)
+{
+	// Image plane normal, away from the camera
+	glm::vec3 normal = glm::normalize(glm::cross(camRight, camUp));
+	float planeDist = glm::dot(topLeft - camPos, normal);
+	if (planeDist < 0.0f)
+	{
+		normal = -normal;
+		planeDist = -planeDist;
+	}
+	glm::vec2 pmin = glm::vec2(INF);
+	glm::vec2 pmax = glm::vec2(-INF);
+	for (int c = 0; c < 8; c++)
+	{
+		glm::vec3 corner = glm::vec3(c & 1 ? box.bmax.x : box.bmin.x, c & 2 ? box.bmax.y : box.bmin.y, c & 4 ? box.bmax.z : box.bmin.z);
+		glm::vec3 d = corner - camPos;
+		float z = glm::dot(d, normal);
+		if (z <= 1e-6f * planeDist)
+		{
+			// Behind the camera, the box can cover any pixel
+			pmin = glm::vec2(0.0f);
+			pmax = glm::vec2(nativeResolution);
+			break;
+		}
+		glm::vec3 q = camPos + d * (planeDist / z) - topLeft;
+		glm::vec2 pixel = glm::vec2(glm::dot(q, camRight) / deltaX, -glm::dot(q, camUp) / deltaY);
+		pmin = glm::min(pmin, pixel);
+		pmax = glm::max(pmax, pixel);
+	}
+	// A pixel of margin for the rounding of the row stepping in TraceRow
+	glm::vec2 limit = glm::vec2(nativeResolution);
+	pmin = glm::clamp(pmin, glm::vec2(0.0f), limit);
+	pmax = glm::clamp(pmax, glm::vec2(0.0f), limit);
+	int x0 = glm::max((int)floorf(pmin.x) - 1, 0);
+	int y0 = glm::max((int)floorf(pmin.y) - 1, 0);
+	int x1 = glm::min((int)ceilf(pmax.x) + 1, nativeResolution.x - 1);
+	int y1 = glm::min((int)ceilf(pmax.y) + 1, nativeResolution.y - 1);
+	for (int i = y0; i <= y1; i++)
+		for (int j = x0; j <= x1; j++)
+			gbuffer[(size_t)i * nativeResolution.x + j].valid = false;
+}
+
+// Traces native pixels first to last - 1 of row i, counted from the top
+void RayTracer::TraceRow(int i, int first, int last)
+{
+	glm::vec3 pixel = topLeft - camUp * ((float)i * deltaY);
+	// Step like a full row does, so tiles get exactly the same rays
+	for (int j = 0; j < first; j++)
+		pixel += camRight * deltaX;
+	for (int j = first; j < last; j++)
+	{
+		TracePixel(i, j, pixel);
+		pixel += camRight * deltaX;
+	}
+}
+
+// Image plane position of the first pixel of every tile row, found by
+// stepping along the rows like TraceRow
+void RayTracer::FindTileRowStarts()
+{
+	tileRowStart.resize((size_t)nativeResolution.y * tilesX);
+	#pragma omp parallel for num_threads(RenderThreads())
 	for (int i = 0; i < nativeResolution.y; i++)
 	{
 		glm::vec3 pixel = topLeft - camUp * ((float)i * deltaY);
 		for (int j = 0; j < nativeResolution.x; j++)
 		{
-			glm::vec3 rayDir = glm::normalize(pixel - camPos);
-			// Trace
-			glm::vec3 color = Trace(camPos, rayDir, 0, scene.traceDepth);
-			if (color.r > 1.0f)
-				color.r = 1.0f;
-			if (color.g > 1.0f)
-				color.g = 1.0f;
-			if (color.b > 1.0f)
-				color.b = 1.0f;
-			// Draw
-			nativeImg[((nativeResolution.y - 1 - i) * nativeResolution.x + j) * 3] = color.r * 255;
-			nativeImg[((nativeResolution.y - 1 - i) * nativeResolution.x + j) * 3 + 1] = color.g * 255;
-			nativeImg[((nativeResolution.y - 1 - i) * nativeResolution.x + j) * 3 + 2] = color.b * 255;
+			if (j % TILE_SIZE == 0)
+				tileRowStart[(size_t)i * tilesX + j / TILE_SIZE] = pixel;
+			pixel += camRight * deltaX;
+		}
+	}
+}
 
+// Traces a native tile, visiting its pixels in the scene pixel order
+void RayTracer::TraceTileOrdered(glm::ivec2 tile)
+{
+	glm::vec3 pixels[TILE_SIZE * TILE_SIZE];
+	glm::ivec2 base = tile * TILE_SIZE;
+	int rows = glm::min(TILE_SIZE, nativeResolution.y - base.y);
+	int cols = glm::min(TILE_SIZE, nativeResolution.x - base.x);
+	for (int r = 0; r < rows; r++)
+	{
+		glm::vec3 pixel = tileRowStart[(size_t)(base.y + r) * tilesX + tile.x];
+		for (int c = 0; c < cols; c++)
+		{
+			pixels[r * TILE_SIZE + c] = pixel;
 			pixel += camRight * deltaX;
 		}
 	}
+	for (auto p : tilePixels)
+	{
+		if (p.x < cols && p.y < rows)
+			TracePixel(base.y + p.y, base.x + p.x, pixels[p.y * TILE_SIZE + p.x]);
+	}
+}
+
+void RayTracer::RenderFrame()
+{
+	TimelineScope scope("Frame");
+	ApplyReload();
+	if (scene.pipeline)
+	{
+		RenderPipelined();
+		return;
+	}
+	if (!dynamicResolution)
+	{
+		// Update scene for animations
+		scene.UpdateScene();
+		Render();
+		return;
+	}
+	auto start = std::chrono::steady_clock::now();
+	SetRenderResolution(frameTimer.Resolution(scene.resolution), frameTimer.antialias);
+	scene.UpdateScene();
+	Render();
+	frameTimer.Update(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
 
-	SSAADownScale();
+void RayTracer::RenderFrame(int frame)
+{
+	TimelineScope scope("Frame", frame);
+	FinishUpdate();
+	SetRenderResolution(scene.resolution, scene.antialiasLevel);
+	scene.EvaluateAt(frame);
+	Render();
+}
+
+void RayTracer::Render()
+{
+	RefitScene();
+	SetupImagePlane();
+	ResetRayBudget(scene.frame);
+	sparseFrame = sparseTrace;
+	primaryCacheFrame = primaryCache;
+	heatmapFrame = heatmap;
+	if (primaryCacheFrame)
+		UpdatePrimaryCache();
+
+	// Loop through each pixel
+	int numThreads = omp_get_max_threads();
+	if (numThreads > 0)
+		numThreads--;
+	else if (numThreads > 1)
+		numThreads -= 2;
+	else if (numThreads > 2)
+		numThreads -= 3;
+	TraceFrame(numThreads);
+
+	if (heatmapFrame)
+		ResolveHeatmap();
+	else
+	{
+		if (sparseFrame)
+			ReconstructSparse();
+		SSAADownScale();
+	}
+	heatmapFrame = false;
+	if (renderResolution != scene.resolution)
+		UpscaleImage();
+}
+
+// Traces every native pixel of the frame. Threads that run out of work
+// wait at the barrier, which the timeline shows.
+void RayTracer::TraceFrame(int numThreads)
+{
+	TimelineScope trace("Trace");
+	if (scene.numa)
+	{
+		// Threads keep to their processor and render the rows they touched
+		// first, with the copy of the scene on their node
+		for (size_t n = 1; n < replicas.size(); n++)
+			UpdateReplica(replicas[n]);
+		#pragma omp parallel num_threads(RenderThreads())
+		{
+			int node = PinRenderThread(omp_get_thread_num(), omp_get_num_threads());
+			RayTracer* rt = node < (int)replicas.size() ? replicas[node] : this;
+			#pragma omp for schedule(static) nowait
+			for (int i = 0; i < nativeResolution.y; i++)
+			{
+				TimelineScope scope("Row", i);
+				rt->TraceRow(i, 0, nativeResolution.x);
+			}
+			TimelineScope wait("Barrier");
+			#pragma omp barrier
+		}
+	}
+	else if (scene.pixelOrder != PixelOrder::SCANLINE)
+	{
+		FindTileRowStarts();
+		#pragma omp parallel num_threads(numThreads)
+		{
+			#pragma omp for schedule(dynamic, 1) nowait
+			for (int t = 0; t < (int)tileOrder.size(); t++)
+			{
+				TimelineScope scope("Tile", t);
+				TraceTileOrdered(tileOrder[t]);
+			}
+			TimelineScope wait("Barrier");
+			#pragma omp barrier
+		}
+	}
+	else
+	{
+		#pragma omp parallel num_threads(numThreads)
+		{
+			#pragma omp for nowait
+			for (int i = 0; i < nativeResolution.y; i++)
+			{
+				TimelineScope scope("Row", i);
+				TraceRow(i, 0, nativeResolution.x);
+			}
+			TimelineScope wait("Barrier");
+			#pragma omp barrier
+		}
+	}
+}
+
+void RayTracer::RenderTile(int frame, glm::ivec2 tileMin, glm::ivec2 tileSize, GLubyte* tile)
+{
+	TimelineScope scope("RenderTile", frame);
+	FinishUpdate();
+	SetRenderResolution(scene.resolution, scene.antialiasLevel);
+	if (frame != scene.frame)
+	{
+		scene.EvaluateAt(frame);
+		RefitScene();
+	}
+	SetupImagePlane();
+	sparseFrame = false;
+	primaryCacheFrame = false;
+	// Tiles of a frame share its budget
+	if (rays->budgetFrame != frame)
+		ResetRayBudget(frame);
+
+	int aa = renderAA;
+	int numThreads = omp_get_max_threads();
+	if (numThreads > 0)
+		numThreads--;
+	else if (numThreads > 1)
+		numThreads -= 2;
+	else if (numThreads > 2)
+		numThreads -= 3;
+	#pragma omp parallel for num_threads(numThreads)
+	for (int i = tileMin.y * aa; i < (tileMin.y + tileSize.y) * aa; i++)
+		TraceRow(i, tileMin.x * aa, (tileMin.x + tileSize.x) * aa);
+
+	for (int i = 0; i < tileSize.y; i++)
+		for (int j = 0; j < tileSize.x; j++)
+			DownScalePixel(tileMin.y + i, tileMin.x + j, &tile[(i * tileSize.x + j) * 3]);
+}
+
+void RayTracer::TraceTile(glm::ivec2 tileMin, glm::ivec2 tileSize)
+{
+	TimelineScope scope("TraceTile");
+	int aa = renderAA;
+	for (int i = tileMin.y * aa; i < (tileMin.y + tileSize.y) * aa; i++)
+		TraceRow(i, tileMin.x * aa, (tileMin.x + tileSize.x) * aa);
+}
+
+void RayTracer::ResolveTile(glm::ivec2 tileMin, glm::ivec2 tileSize)
+{
+	TimelineScope scope("ResolveTile");
+	glm::ivec2 res = scene.resolution;
+	for (int i = tileMin.y; i < tileMin.y + tileSize.y; i++)
+		for (int j = tileMin.x; j < tileMin.x + tileSize.x; j++)
+			DownScalePixel(i, j, &outImg[((res.y - 1 - i) * res.x + j) * 3]);
+}
+
+// Moves the scene to the next animation step, on a pool thread
+void RayTracer::UpdateAhead()
+{
+	updatedAhead = true;
+	updateTasks.Add(1);
+	pool.Submit([this]()
+	{
+		scene.UpdateScene();
+		RefitScene();
+		updateTasks.Done();
+	});
+}
+
+// Waits for an update started by UpdateAhead, the scene is then one step
+// past the last rendered frame
+void RayTracer::FinishUpdate()
+{
+	updateTasks.Wait();
+}
+
+void RayTracer::RenderPipelined()
+{
+	pool.Start(RenderThreads());
+	if (updatedAhead)
+		FinishUpdate();
+	else
+	{
+		scene.UpdateScene();
+		RefitScene();
+	}
+	updatedAhead = false;
+	SetupImagePlane();
+	sparseFrame = false;
+	primaryCacheFrame = primaryCache;
+	if (primaryCacheFrame)
+		UpdatePrimaryCache();
+	ResetRayBudget(scene.frame);
+
+	// Each tile is resolved into outImg right after it is traced. Once the
+	// last tile is traced the scene is free, the next frame is updated
+	// while the remaining tiles are resolved.
+	glm::ivec2 res = scene.resolution;
+	std::vector<glm::ivec4> tiles;	// x, y, w, h
+	for (int y = 0; y < res.y; y += TILE_SIZE)
+		for (int x = 0; x < res.x; x += TILE_SIZE)
+			tiles.push_back(glm::ivec4(x, y, glm::min(TILE_SIZE, res.x - x), glm::min(TILE_SIZE, res.y - y)));
+	tracesLeft = (int)tiles.size();
+	frameTasks.Add((int)tiles.size());
+	for (auto t : tiles)
+	{
+		pool.Submit([this, t]()
+		{
+			TraceTile(glm::ivec2(t.x, t.y), glm::ivec2(t.z, t.w));
+			if (--tracesLeft == 0)
+				UpdateAhead();
+			ResolveTile(glm::ivec2(t.x, t.y), glm::ivec2(t.z, t.w));
+			frameTasks.Done();
+		});
+	}
+	frameTasks.Wait();
 }
@@ -3,12 +3,71 @@
 
 #include <iostream>
 #include <string>
+#include <atomic>
+#include <type_traits>
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 
 #include "scene.h"
+#include "accel.h"
+#include "lighttree.h"
+#include "numa.h"
+#include "threadpool.h"
+#include "shading.h"
+#include "frametime.h"
+#include "shadowcache.h"
+#include "reload.h"
 
 const float INF = 0XFFFF;
+// Size in output pixels of the tiles frames are split into
+const int TILE_SIZE = 32;
+
+// Scene features trace kernels are compiled for. A kernel without a feature
+// skips its checks, a scene is traced with the kernel of the features it has.
+enum TraceFeature
+{
+	TRACE_QUADS = 1,			// Quads, whose normals are turned to the viewer
+	TRACE_INSTANCES = 2,
+	TRACE_REFLECTIONS = 4,
+	TRACE_BATCH_SHADING = 8,
+	TRACE_FEW_LIGHTS = 16,		// Up to PACKET_SIZE lights, tested without the light tree
+	TRACE_NO_LIGHTS = 32,
+};
+const int TRACE_FEATURE_SETS = 48;
+// Kernels of reflective scenes are also compiled for MAXDEPTH below this,
+// deeper scenes use the generic Trace
+const int TRACE_KERNEL_DEPTHS = 4;
+
+// Reflection rays since the scene was loaded, counted when RAYTHRESHOLD or
+// RAYBUDGET is set
+class RayStats
+{
+public:
+	long long traced;
+	long long culled;		// Contribution below RAYTHRESHOLD
+	long long roulette;		// Lost the Russian roulette
+	long long overBudget;	// Past RAYBUDGET
+
+	RayStats();
+	void Add(const RayStats& other);
+	void Report();
+};
+
+// Counters of RayStats updated while rendering, with the rays left in the
+// budget of the frame
+class RayCounters
+{
+public:
+	std::atomic<long long> traced;
+	std::atomic<long long> culled;
+	std::atomic<long long> roulette;
+	std::atomic<long long> overBudget;
+	std::atomic<long long> budgetLeft;
+	int budgetFrame;	// Frame budgetLeft belongs to, for RenderTile
+
+	RayCounters();
+	void Reset();
+};
 
 class RayTracer
 {
@@ -17,34 +76,193 @@ private:
 	glm::ivec2 nativeResolution;
 	GLubyte* nativeImg;
 	GLubyte* outImg;
+	// Output pixels and antialiasing of the frame being rendered. FRAMETIME
+	// lowers them below the scene settings, nativeImg keeps the size of the
+	// scene settings and frames are upscaled from scaledImg to outImg.
+	glm::ivec2 renderResolution;
+	int renderAA;
+	bool dynamicResolution;
+	FrameTimeController frameTimer;
+	std::vector<GLubyte> scaledImg;
+
+	// SPARSETRACE: pixels left out of the pattern only get their primary hit
+	// in gbuffer, row after row, and are reconstructed after tracing
+	bool sparseTrace;
+	bool sparseFrame;	// Set while Render traces the pattern
+	std::vector<GBufferSample> gbuffer;
+
+	// PRIMARYCACHE: primary hits stay in gbuffer while the image plane does
+	// not move, only pixels moved objects could cover are intersected again
+	bool primaryCache;
+	bool primaryCacheFrame;	// Set while a frame uses the cache
+	std::vector<AABB> objectBounds;	// Bounds of objects as of the cached hits
+	glm::vec3 cachedView[4];	// camPos, topLeft and the pixel steps of the cached hits
+	glm::ivec2 cachedResolution;
+
+	// HEATMAP: the cost of every native pixel is kept in heatValues while a
+	// frame is traced and drawn in false colors instead of the image.
+	// heatOutput has the sums per output pixel of the last heatmap frame.
+	bool heatmap;
+	bool heatmapFrame;	// Set while Render traces a heatmap
+	std::vector<double> heatValues;
+	std::vector<double> heatOutput;
+	glm::ivec2 heatResolution;
 
 	glm::vec3 camPos;
 	glm::vec3 camDir;
 	glm::vec3 camUp;
 	float camFocal;
 	float camFovy;
+	// Image plane of the frame being rendered
+	glm::vec3 topLeft;
+	glm::vec3 camRight;
+	float deltaX;
+	float deltaY;
 
 	std::vector<Shape*> objects;
 	std::vector<Light*> lights;
+	// Top level acceleration structure over objects and instances
+	Accelerator* accel;
+	LightTree lightTree;
+	ShadingLights shadingLights;
+	// SHADOWCACHE: static occluders of static lights are looked up in their
+	// visibility caches, only moving objects are traced for every shadow ray
+	Accelerator* staticAccel;
+	Accelerator* dynamicAccel;
+	bool hasDynamicObjects;
+	std::vector<LightVisibilityCache*> shadowCaches;	// Per light, 0 for lights that move
+
+	// NUMA mode: copies of the scene made on the other nodes, one per node
+	// with this one first. Replicas render into the image of this one.
+	NumaTopology topology;
+	std::vector<RayTracer*> replicas;
+	bool isReplica;
+	bool imagePages;	// nativeImg comes from AllocPages
+	size_t imageSize;
+	std::vector<int> rowNode;	// Node rendering each row of nativeImg
+
+	// Pixel orders other than SCANLINE trace native tiles in tileOrder, the
+	// pixels of each tile in tilePixels order
+	int tilesX;
+	int tilesY;
+	std::vector<glm::ivec2> tileOrder;
+	std::vector<glm::ivec2> tilePixels;
+	std::vector<glm::vec3> tileRowStart;
+
+	// PIPELINE mode: the next animation step is computed while the last
+	// tiles of a frame are resolved
+	ThreadPool pool;
+	TaskGroup frameTasks;
+	TaskGroup updateTasks;
+	std::atomic<int> tracesLeft;
+	bool updatedAhead;
+
+	// Trace, or the kernel selected for the scene after loading
+	typedef glm::vec3 (RayTracer::*TraceFunc)(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* selfPrim, int depth, float throughput, GBufferSample* sample);
+	TraceFunc traceKernel;
+	int traceFeatures;
+
+	// Reflection culling, on when RAYTHRESHOLD or RAYBUDGET is set. Replicas
+	// count into the counters of the main renderer.
+	bool cullRays;
+	RayCounters rayCounters;
+	RayCounters* rays;
+
+	// HOTRELOAD: new versions of the scene file, applied as edits of the
+	// scene when only shapes changed
+	SceneReloader reloader;
 
 public:
 	RayTracer();
 	~RayTracer();
 
 private:
-	float IntersectionDistance(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape*& hitObj);
-	std::vector<Light*> ShadowRays(glm::vec3 p, Shape* self);
-	glm::vec3 Phong(glm::vec3 n, glm::vec3 v, glm::vec3 p, Light light, Shape object);
+	float IntersectionDistance(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* selfPrim, Shape*& hitObj, Shape*& hitPrim);
+	void SelectLights(glm::vec3 p, glm::vec3 n, int depth, std::vector<int>& selected, std::vector<float>& weights);
+	void ShadowRays(glm::vec3 p, Shape* self, Shape* selfPrim, std::vector<int>& selected, std::vector<float>& weights);
+	// Occlusion of a packet of rays to the given lights, through the
+	// visibility caches when there are any
+	void OccludedLights(glm::vec3 p, ShadowPacket& packet, const int* lightIndices, Shape* self, Shape* selfPrim);
+	void BuildShadowCaches();
+	void ClearShadowCaches();
+	glm::vec3 Phong(glm::vec3 n, glm::vec3 v, glm::vec3 p, const Light& light, const Shape& object);
+	glm::vec3 ShadeLights(glm::vec3 n, glm::vec3 v, glm::vec3 p, const int* selected, const float* weights, int count, const Shape& material);
+	template <int Features>
+	glm::vec3 ShadeFewLights(glm::vec3 n, glm::vec3 v, glm::vec3 p, Shape* self, Shape* selfPrim, const Shape& material);
+	void RefitLights();
+	void RefitScene();
+	void ApplyReload();
+	void DownScalePixel(int i, int j, GLubyte* dst);
 	void SSAADownScale();
-	glm::vec3 Trace(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, int depth);
+	void SetRenderResolution(glm::ivec2 res, int aa);
+	void UpscaleImage();
+	void SetupImagePlane();
+	size_t NativeIndex(int i, int j);
+	int NativeRow(size_t offset);
+	void TracePixel(int i, int j, glm::vec3 pixel);
+	void TracePixelColor(int i, int j, glm::vec3 pixel);
+	void TraceGBuffer(glm::vec3 rayDir, GBufferSample& sample);
+	void ReconstructSparse();
+	void ResolveHeatmap();
+	void UpdatePrimaryCache();
+	void InvalidatePrimaryHits(const AABB& box);
+	void TraceRow(int i, int first, int last);
+	void FindTileRowStarts();
+	void TraceTileOrdered(glm::ivec2 tile);
+	void Render();
+	void TraceFrame(int numThreads);
+	void RenderPipelined();
+	void UpdateAhead();
+	void FinishUpdate();
+	void TraceTile(glm::ivec2 tileMin, glm::ivec2 tileSize);
+	void ResolveTile(glm::ivec2 tileMin, glm::ivec2 tileSize);
+	int RenderThreads();
+	int PinRenderThread(int t, int count);
+	void AllocateImage();
+	void CreateReplicas(std::string text);
+	void UpdateReplica(RayTracer* replica);
+	void ReportNumaUsage();
+	// Color seen along a ray, throughput is the weight of the color in the
+	// pixel. The hit of primary rays goes to sample when it is given.
+	glm::vec3 Trace(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* selfPrim, int depth, float throughput, GBufferSample* sample);
+	// Trace for scenes with only the given features. Depth is the value of
+	// depth for reflective scenes, so their recursion is unrolled.
+	template <int Features, int Depth>
+	glm::vec3 TraceKernel(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* selfPrim, int depth, float throughput, GBufferSample* sample);
+	float ReflectionWeight(glm::vec3 p, int depth, float throughput, float reflectivity);
+	void ResetRayBudget(int frame);
+	template <int I>
+	static void FillTraceKernels(TraceFunc* kernels, std::integral_constant<int, I>);
+	static void FillTraceKernels(TraceFunc* kernels, std::integral_constant<int, -1>);
+	int FindTraceFeatures();
+	void SelectTraceKernel();
+	void CountPrimitiveTests();
 
 public:
 	void SetOutImage(GLubyte* out);
 	glm::ivec2 GetResolution();
-	bool LoadScene(std::string file);
+	glm::ivec2 GetNativeResolution();
+	bool LoadScene(std::string file, std::string options = "");
+	bool LoadSceneText(std::string text);
 	void SetCamera(glm::vec3 pos, glm::vec3 dir, glm::vec3 up);
 	void SetProjection(float f, float fovy);
+	void ReportMemoryUsage();
+	RayStats GetRayStats();
+	void ReportRenderResolution();
+	// Renders the next animation step
 	void RenderFrame();
+	// Renders the given animation step, the same image RenderFrame gives
+	// when called that many times
+	void RenderFrame(int frame);
+	// Renders output pixels tileMin to tileMin + tileSize of the given frame,
+	// rows counted from the top, into tile as top down RGB rows
+	void RenderTile(int frame, glm::ivec2 tileMin, glm::ivec2 tileSize, GLubyte* tile);
+	// Whether frames show the cost of their pixels, HEATMAP is set and not
+	// ignored
+	bool RendersHeatmap();
+	// Writes the values of the last HEATMAP frame, see WriteHeatCounts.
+	// False when no heatmap was rendered.
+	bool WriteHeatmap(std::string file);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,309 @@
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include "image.h"
+#include "raytracer.h"
+#include "regress.h"
+
+#pragma warning(disable : 4996)
+
+class RegressionScene
+{
+public:
+	std::string name;
+	std::string text;
+};
+
+// Walls of cornell.txt
+static void AddRoom(std::ostringstream& s)
+{
+	s << "QUAD POS -150 -150 70 POS 150 -150 70 POS -150 150 70 DIFF 0.75 0.75 0.75 SPEC 0.1 0.1 0.1 SHININESS 10 REFLECTIVITY 0.1\n";
+	s << "QUAD POS 150 -150 70 POS 150 -150 -70 POS 150 150 70 DIFF 0.02 0.4 0.02 SPEC 0.1 0.1 0.1 SHININESS 10 REFLECTIVITY 0.1\n";
+	s << "QUAD POS -150 -150 -70 POS -150 -150 70 POS -150 150 -70 DIFF 0.4 0.02 0.02 SPEC 0.1 0.1 0.1 SHININESS 10 REFLECTIVITY 0.1\n";
+	s << "QUAD POS -150 -150 70 POS 150 -150 70 POS -150 -150 -70 DIFF 0.75 0.75 0.75 SPEC 0.1 0.1 0.1 SHININESS 10 REFLECTIVITY 0.1\n";
+	s << "QUAD POS -150 150 70 POS 150 150 70 POS -150 150 -70 DIFF 0.9 0.9 0.9 SPEC 0 0 0 SHININESS 10\n";
+}
+
+// A grid of spheres, every other one a mirror and the diagonal moving,
+// traced three bounces deep
+static std::string SphereGridScene()
+{
+	std::ostringstream s;
+	s << "ANTIALIAS 2\nBACKGROUND 0 0 0\nMAXDEPTH 3\nRESOLUTION 256 256\n";
+	s << "LIGHT POS 0 120 -40 DIFF 0.6 0.6 0.6 SPEC 1 1 1\n";
+	s << "LIGHT POS -80 100 20 DIFF 0.4 0.3 0.2 SPEC 0.5 0.5 0.5\n";
+	AddRoom(s);
+	for (int i = 0; i < 6; i++)
+	{
+		for (int j = 0; j < 6; j++)
+		{
+			s << "SPHERE POS " << -100 + 40 * i << " " << -100 + 40 * j << " " << -20 + 10 * ((i + j) % 3) << " RADIUS 14";
+			s << " DIFF " << 0.2f + 0.1f * i << " " << 0.8f - 0.1f * j << " 0.4 SPEC 0.8 0.8 0.8 SHININESS 20";
+			s << " REFLECTIVITY " << ((i + j) % 2 ? 0.5f : 0.05f) << "\n";
+			if (i == j)
+				s << "MOVEDIR 1 0 0 MOVEDISTANCE 40 MOVESPEED 4\n";
+		}
+	}
+	return s.str();
+}
+
+// More lights than the few lights path takes, so the light tree is used,
+// one of them moving
+static std::string ManyLightsScene()
+{
+	std::ostringstream s;
+	s << "ANTIALIAS 1\nBACKGROUND 0 0 0\nMAXDEPTH 2\nRESOLUTION 256 256\n";
+	for (int k = 0; k < 24; k++)
+	{
+		s << "LIGHT POS " << -120 + 240 * (k % 6) / 5 << " " << -60 + 40 * (k / 6) << " -60";
+		s << " DIFF 0.3 0.24 0.2 SPEC 0.3 0.3 0.3 FALLOFF 60\n";
+		if (k == 0)
+			s << "MOVEDIR 0 1 0 MOVEDISTANCE 100 MOVESPEED 10\n";
+	}
+	AddRoom(s);
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			s << "SPHERE POS " << -90 + 90 * i << " " << -90 + 90 * j << " 20 RADIUS 25";
+			s << " DIFF 0.7 0.7 0.7 SPEC 0.5 0.5 0.5 SHININESS 30 REFLECTIVITY 0.2\n";
+		}
+	}
+	s << "QUAD POS -40 -150 -30 POS 40 -150 -30 POS -40 -70 -10 DIFF 0.3 0.3 0.8 SPEC 0.1 0.1 0.1 SHININESS 10\n";
+	return s.str();
+}
+
+// A group of a slab and two spheres placed nine times, rotated, scaled,
+// with other materials and one of them moving
+static std::string InstanceScene()
+{
+	std::ostringstream s;
+	s << "ANTIALIAS 2\nBACKGROUND 0 0 0\nMAXDEPTH 2\nRESOLUTION 256 256\n";
+	s << "LIGHT POS 0 120 -40 DIFF 0.6 0.6 0.6 SPEC 1 1 1\n";
+	s << "LIGHT POS 80 -100 -60 DIFF 0.3 0.3 0.4 SPEC 0.5 0.5 0.5\n";
+	AddRoom(s);
+	s << "DEFINE stack\n";
+	s << "QUAD POS -20 0 -20 POS 20 0 -20 POS -20 0 20 DIFF 0.6 0.5 0.3 SPEC 0.1 0.1 0.1 SHININESS 10\n";
+	s << "SPHERE POS 0 12 0 RADIUS 12 DIFF 0.3 0.6 0.8 SPEC 0.8 0.8 0.8 SHININESS 40 REFLECTIVITY 0.4\n";
+	s << "SPHERE POS 0 30 0 RADIUS 6 DIFF 0.8 0.3 0.3 SPEC 0.8 0.8 0.8 SHININESS 40\n";
+	s << "END\n";
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			s << "INSTANCE stack POS " << -90 + 90 * i << " " << -120 + 80 * j << " " << 10 * (i - j);
+			s << " ROTATE " << 10 * j << " " << 30 * i + 15 * j << " 0 SCALE " << 0.8f + 0.2f * i << " " << 0.8f + 0.2f * i << " " << 0.8f + 0.2f * i << "\n";
+			if ((i + j) % 4 == 1)
+				s << "DIFF 0.9 0.9 0.2\n";
+			if (i == 1 && j == 1)
+				s << "MOVEDIR 0 1 0 MOVEDISTANCE 30 MOVESPEED 3\n";
+		}
+	}
+	return s.str();
+}
+
+static bool MakeDirectory(std::string dir)
+{
+#ifdef _WIN32
+	_mkdir(dir.c_str());
+#else
+	mkdir(dir.c_str(), 0755);
+#endif
+	std::ofstream probe(dir + "/times.tmp");
+	bool ok = probe.is_open();
+	probe.close();
+	remove((dir + "/times.tmp").c_str());
+	return ok;
+}
+
+// Pixels with a channel off by more than tolerance, and the largest difference
+static int CountDifferentPixels(const std::vector<GLubyte>& img, const std::vector<GLubyte>& ref, int tolerance, int& maxDiff)
+{
+	int count = 0;
+	maxDiff = 0;
+	for (size_t p = 0; p < img.size(); p += 3)
+	{
+		int diff = 0;
+		for (int c = 0; c < 3; c++)
+			diff = std::max(diff, abs((int)img[p + c] - (int)ref[p + c]));
+		maxDiff = std::max(maxDiff, diff);
+		count += diff > tolerance ? 1 : 0;
+	}
+	return count;
+}
+
+// Mean time per frame of frames first to last, each the fastest of
+// REGRESS_RUNS renders
+static double TimeFrames(RayTracer& raytracer, int first, int last)
+{
+	double total = 0.0;
+	for (int frame = first; frame <= last; frame++)
+	{
+		double best = 0.0;
+		for (int run = 0; run < REGRESS_RUNS; run++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			raytracer.RenderFrame(frame);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			if (run == 0 || ms < best)
+				best = ms;
+		}
+		total += best;
+	}
+	return total / (last - first + 1);
+}
+
+bool RunRegression(std::string dir, std::string file, std::string options, int first, int last, int tolerance)
+{
+	if (last < first)
+	{
+		std::cout << "Empty frame range: " << first << " " << last << std::endl;
+		return false;
+	}
+	if (!MakeDirectory(dir))
+	{
+		std::cout << "Can't write to regression directory: " << dir << std::endl;
+		return false;
+	}
+
+	std::vector<RegressionScene> scenes(4);
+	size_t slash = file.find_last_of("/\\");
+	scenes[0].name = file.substr(slash == std::string::npos ? 0 : slash + 1);
+	scenes[0].name = scenes[0].name.substr(0, scenes[0].name.rfind('.'));
+	if (!Scene::ReadSceneFile(file, options, scenes[0].text))
+		return false;
+	scenes[1].name = "spheres";
+	scenes[1].text = SphereGridScene() + options + "\n";
+	scenes[2].name = "lights";
+	scenes[2].text = ManyLightsScene() + options + "\n";
+	scenes[3].name = "instances";
+	scenes[3].text = InstanceScene() + options + "\n";
+
+	// Times of an earlier run with the same frames
+	std::string timesFile = dir + "/times.txt";
+	std::map<std::string, double> recorded;
+	std::ifstream in(timesFile);
+	if (in)
+	{
+		std::string tag;
+		int recordedFirst = -1, recordedLast = -1;
+		in >> tag >> recordedFirst >> recordedLast;
+		if (tag != "FRAMES" || recordedFirst != first || recordedLast != last)
+		{
+			std::cout << timesFile << " was not recorded for frames " << first << " to " << last << std::endl;
+			return false;
+		}
+		std::string name;
+		double ms;
+		while (in >> name >> ms)
+			recorded[name] = ms;
+	}
+	in.close();
+
+	bool failed = false;
+	std::map<std::string, double> times;
+	printf("%-12s %6s %10s %10s %12s %10s\n", "scene", "frame", "ms", "max diff", "bad pixels", "PSNR dB");
+	for (RegressionScene& scene : scenes)
+	{
+		RayTracer raytracer;
+		if (!raytracer.LoadSceneText(scene.text))
+		{
+			std::cout << "Can't load regression scene " << scene.name << std::endl;
+			return false;
+		}
+		glm::ivec2 res = raytracer.GetResolution();
+		std::vector<GLubyte> img((size_t)res.x * res.y * 3);
+		raytracer.SetOutImage(&img[0]);
+		// Warm up threads and caches
+		raytracer.RenderFrame(first);
+
+		for (int frame = first; frame <= last; frame++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			raytracer.RenderFrame(frame);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			char name[64];
+			snprintf(name, sizeof(name), "_%04d", frame);
+			std::string golden = dir + "/" + scene.name + name + ".ppm";
+			std::vector<GLubyte> ref;
+			glm::ivec2 refRes;
+			if (!ReadImage(golden, ref, refRes))
+			{
+				if (!WriteImage(golden, &img[0], res))
+					return false;
+				printf("%-12s %6d %10.1f %10s %12s %10s\n", scene.name.c_str(), frame, ms, "-", "-", "recorded");
+				continue;
+			}
+			if (refRes != res)
+			{
+				printf("%-12s %6d %10.1f golden image is %dx%d, rendered %dx%d\n", scene.name.c_str(), frame, ms, refRes.x, refRes.y, res.x, res.y);
+				failed = true;
+				continue;
+			}
+			int maxDiff = 0;
+			int bad = CountDifferentPixels(img, ref, tolerance, maxDiff);
+			printf("%-12s %6d %10.1f %10d %12d %10.2f\n", scene.name.c_str(), frame, ms, maxDiff, bad, ImagePSNR(&img[0], &ref[0], res));
+			// The frame of a failed run is left only while it still differs
+			std::string rendered = dir + "/" + scene.name + name + "_new.ppm";
+			if (bad > 0)
+			{
+				WriteImage(rendered, &img[0], res);
+				failed = true;
+			}
+			else
+				remove(rendered.c_str());
+		}
+		// A scene that looks slower is timed again before it fails
+		double ms = TimeFrames(raytracer, first, last);
+		auto base = recorded.find(scene.name);
+		for (int retry = 0; retry < REGRESS_RETRIES && base != recorded.end() && ms / base->second - 1.0 > REGRESS_SLOWDOWN; retry++)
+			ms = std::min(ms, TimeFrames(raytracer, first, last));
+		times[scene.name] = ms;
+	}
+
+	printf("%-12s %10s %10s %10s\n", "scene", "ms/frame", "recorded", "change");
+	for (RegressionScene& scene : scenes)
+	{
+		double ms = times[scene.name];
+		auto base = recorded.find(scene.name);
+		if (base == recorded.end())
+		{
+			printf("%-12s %10.1f %10s %10s\n", scene.name.c_str(), ms, "-", "-");
+			continue;
+		}
+		double change = ms / base->second - 1.0;
+		printf("%-12s %10.1f %10.1f %+9.1f%%%s\n", scene.name.c_str(), ms, base->second, change * 100.0, change > REGRESS_SLOWDOWN ? " slower" : "");
+		if (change > REGRESS_SLOWDOWN)
+			failed = true;
+	}
+	if (recorded.empty())
+	{
+		std::ofstream out(timesFile);
+		out << "FRAMES " << first << " " << last << std::endl;
+		for (auto& t : times)
+			out << t.first << " " << t.second << std::endl;
+		if (!out)
+		{
+			std::cout << "Can't write " << timesFile << std::endl;
+			return false;
+		}
+		std::cout << "Frame times written to " << timesFile << std::endl;
+	}
+	if (failed)
+		std::cout << "Regression failed: frames differ from the golden images or scenes got more than "
+			<< REGRESS_SLOWDOWN * 100.0 << "% slower" << std::endl;
+	return !failed;
+}
@@ -0,0 +1,28 @@
+#ifndef __REGRESS_H__
+#define __REGRESS_H__
+
+#include <string>
+
+// Frames rendered of every scene when no range is given
+const int REGRESS_FRAMES = 4;
+// Times every frame is rendered to time it, the fastest counts so a frame
+// slowed down by the rest of the machine does not fail the run
+const int REGRESS_RUNS = 5;
+// Times a scene that got slower is timed again, the best time counts
+const int REGRESS_RETRIES = 2;
+// Increase of the time per frame over the recorded one that fails a scene
+const double REGRESS_SLOWDOWN = 0.25;
+
+// Renders the scene file and a few generated scenes (spheres with
+// reflections, many lights, instances) for frames first to last without a
+// window, all with options appended, and compares every frame with the
+// golden image dir/<scene>_<frame>.ppm. A pixel differs when a channel is
+// off by more than tolerance, a frame with such pixels is written as
+// dir/<scene>_<frame>_new.ppm. The time per frame of each scene, the mean of
+// the fastest of REGRESS_RUNS renders of each frame, is compared with
+// dir/times.txt, a slower scene is timed again up to REGRESS_RETRIES times.
+// Missing golden images and times are recorded. False if a frame differs
+// or a scene got more than REGRESS_SLOWDOWN slower.
+bool RunRegression(std::string dir, std::string file, std::string options, int first, int last, int tolerance);
+
+#endif
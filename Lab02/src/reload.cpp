@@ -0,0 +1,173 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+#include <string.h>
+#include <chrono>
+#include <iostream>
+
+#include "reload.h"
+
+#ifdef _WIN32
+// Last write time of the file, 0 if it can't be read
+static long long LastWriteTime(const std::string& path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+		return 0;
+	return ((long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+#endif
+
+FileWatcher::FileWatcher()
+{
+	fd = -1;
+	lastWrite = 0;
+}
+
+FileWatcher::~FileWatcher()
+{
+	Close();
+}
+
+bool FileWatcher::Watch(std::string file)
+{
+	Close();
+	path = file;
+	size_t slash = file.find_last_of("/\\");
+	name = slash == std::string::npos ? file : file.substr(slash + 1);
+#ifdef _WIN32
+	lastWrite = LastWriteTime(path);
+	return lastWrite != 0;
+#else
+	// The directory is watched, the file itself is replaced by some editors
+	std::string dir = slash == std::string::npos ? "." : file.substr(0, slash + 1);
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+	{
+		Close();
+		return false;
+	}
+	return true;
+#endif
+}
+
+void FileWatcher::Close()
+{
+#ifndef _WIN32
+	if (fd >= 0)
+		close(fd);
+#endif
+	fd = -1;
+	lastWrite = 0;
+}
+
+bool FileWatcher::WaitForChange(int timeoutMs)
+{
+#ifdef _WIN32
+	Sleep(timeoutMs);
+	long long t = LastWriteTime(path);
+	if (t == 0 || t == lastWrite)
+		return false;
+	lastWrite = t;
+	return true;
+#else
+	if (fd < 0)
+		return false;
+	pollfd p;
+	p.fd = fd;
+	p.events = POLLIN;
+	if (poll(&p, 1, timeoutMs) <= 0)
+		return false;
+	bool changed = false;
+	alignas(inotify_event) char buffer[4096];
+	while (1)
+	{
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+		for (ssize_t k = 0; k < n;)
+		{
+			const inotify_event* e = (const inotify_event*)(buffer + k);
+			if (e->len > 0 && name == e->name)
+				changed = true;
+			k += sizeof(inotify_event) + e->len;
+		}
+	}
+	return changed;
+#endif
+}
+
+SceneReloader::SceneReloader()
+{
+	stop = false;
+	pending = 0;
+}
+
+SceneReloader::~SceneReloader()
+{
+	Stop();
+}
+
+bool SceneReloader::Start(std::string file, std::string options)
+{
+	Stop();
+	if (!watcher.Watch(file))
+	{
+		std::cout << "Can't watch scene file: " << file << std::endl;
+		return false;
+	}
+	this->file = file;
+	this->options = options;
+	stop = false;
+	thread = std::thread(&SceneReloader::Run, this);
+	return true;
+}
+
+void SceneReloader::Stop()
+{
+	stop = true;
+	if (thread.joinable())
+		thread.join();
+	watcher.Close();
+	delete pending.exchange(0);
+}
+
+bool SceneReloader::Running()
+{
+	return thread.joinable();
+}
+
+SceneReload* SceneReloader::Take()
+{
+	if (!pending.load(std::memory_order_relaxed))
+		return 0;
+	return pending.exchange(0);
+}
+
+void SceneReloader::Run()
+{
+	while (!stop)
+	{
+		if (!watcher.WaitForChange(RELOAD_POLL_MS))
+			continue;
+		while (!stop && watcher.WaitForChange(RELOAD_SETTLE_MS))
+			;
+		auto start = std::chrono::steady_clock::now();
+		SceneReload* reload = new SceneReload;
+		if (!Scene::ReadSceneFile(file, options, reload->text) || !reload->scene.LoadSceneText(reload->text))
+		{
+			std::cout << "Scene file not reloaded: " << file << std::endl;
+			delete reload;
+			continue;
+		}
+		std::cout << "Scene file parsed in " << std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count()
+			<< " ms: " << file << std::endl;
+		delete pending.exchange(reload);
+	}
+}
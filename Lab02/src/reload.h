@@ -0,0 +1,69 @@
+#ifndef __RELOAD_H__
+#define __RELOAD_H__
+
+#include <string>
+#include <thread>
+#include <atomic>
+
+#include "scene.h"
+
+// Time a change must be followed by no other before the file is read, as
+// editors often save in several writes
+const int RELOAD_SETTLE_MS = 50;
+// How often the reloader checks whether it should stop
+const int RELOAD_POLL_MS = 200;
+
+// Tells when a file was written: with inotify on Linux, which also sees
+// editors that save to a new file and rename it over the old one, and by
+// polling its modification time elsewhere
+class FileWatcher
+{
+public:
+	FileWatcher();
+	~FileWatcher();
+	bool Watch(std::string file);
+	void Close();
+	// Waits up to timeoutMs for the file to change, true if it did
+	bool WaitForChange(int timeoutMs);
+
+private:
+	std::string path;
+	std::string name;	// File name without the directory
+	int fd;				// inotify instance, -1 when not watching
+	long long lastWrite;
+};
+
+// A scene file parsed again after it changed
+class SceneReload
+{
+public:
+	std::string text;
+	Scene scene;
+};
+
+// Parses the scene file on a thread of its own every time it is written,
+// so the render loop never waits for the parser. The render loop takes the
+// latest parse between frames, versions it did not get to are dropped.
+class SceneReloader
+{
+public:
+	SceneReloader();
+	~SceneReloader();
+	bool Start(std::string file, std::string options);
+	void Stop();
+	bool Running();
+	// The scene parsed since the last call, or 0. The caller deletes it.
+	SceneReload* Take();
+
+private:
+	std::string file;
+	std::string options;
+	FileWatcher watcher;
+	std::thread thread;
+	std::atomic<bool> stop;
+	std::atomic<SceneReload*> pending;
+
+	void Run();
+};
+
+#endif
@@ -7,6 +7,17 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "scene.h"
+#include "timeline.h"
+
+// Flags of Scene::CopyShape
+const int EDIT_SURFACE = 1;
+const int EDIT_GEOMETRY = 2;	// Geometry or motion
+
+SceneEdits::SceneEdits()
+{
+	shapes = 0;
+	moved = false;
+}
 
 Scene::Scene()
 {
@@ -14,31 +25,98 @@ Scene::Scene()
 	traceDepth = 1;
 	antialiasLevel = 0;
 	resolution = glm::ivec2(800, 800);
+	accelType = AccelType::BVH;
+	lightCullThreshold = 0.0f;
+	lightSamples = 0;
+	numa = false;
+	hugePages = false;
+	pipeline = false;
+	pixelOrder = PixelOrder::SCANLINE;
+	batchShading = false;
+	specializedTrace = true;
+	rayThreshold = 0.0f;
+	russianRoulette = false;
+	rayBudget = 0;
+	frameTime = 0.0f;
+	minScale = 0.25f;
+	minAntialias = 1;
+	sparseTrace = SparsePattern::NONE;
+	primaryCache = false;
+	shadowCacheResolution = 0;
+	shadowCacheError = 0.01f;
+	hotReload = false;
+	heatmap = HeatmapMode::NONE;
+	frame = 0;
 }
 
 Scene::~Scene()
 {
-	for (Shape* s : shapes)
-		delete s;
 	shapes.swap(std::vector<Shape*>());
+	for (Geometry* g : geometries)
+		delete g;
+	geometries.swap(std::vector<Geometry*>());
+	shapeArena.Clear();
+	materialArena.Clear();
 }
 
-bool Scene::LoadScene(std::string file)
+template <class T> T* Scene::NewShape()
 {
-	for (Shape* s : shapes)
-		delete s;
-	shapes.swap(std::vector<Shape*>());
+	T* s = shapeArena.New<T>();
+	s->surface = materialArena.New<Surface>();
+	return s;
+}
 
-	std::ifstream in;
-	in.open(file, std::ios::in);
-	if (!in.is_open())
+Motion* Scene::Animate(Shape* s)
+{
+	if (!s->motion)
+	{
+		s->motion = materialArena.New<Motion>();
+		s->SetOrigin();
+	}
+	return s->motion;
+}
+
+bool Scene::ReadSceneFile(std::string file, std::string options, std::string& text)
+{
+	std::ifstream fin;
+	fin.open(file, std::ios::in);
+	if (!fin.is_open())
 	{
 		std::cout << "Failed to open scene file: " << file << std::endl;
 		return false;
 	}
+	// Options are read as one more line of the file so they override it
+	std::stringstream in;
+	in << fin.rdbuf() << std::endl << options << std::endl;
+	text = in.str();
+	return true;
+}
+
+bool Scene::LoadScene(std::string file, std::string options)
+{
+	std::string text;
+	if (!ReadSceneFile(file, options, text))
+		return false;
+	return LoadSceneText(text);
+}
+
+bool Scene::LoadSceneText(std::string text)
+{
+	shapes.swap(std::vector<Shape*>());
+	for (Geometry* g : geometries)
+		delete g;
+	geometries.swap(std::vector<Geometry*>());
+	shapeArena.Clear();
+	materialArena.Clear();
+	frame = 0;
+
+	std::stringstream in(text);
 	std::string str;
 	ShapeType currentType = ShapeType::NONE;
 	int currentPosCount = 0;
+	// Shapes are added to the scene, or to a geometry between DEFINE and END
+	std::vector<Shape*>* target = &shapes;
+	Geometry* currentGeometry = 0;
 	float x, y, z;
 	int i, j;
 	while (std::getline(in, str))
@@ -57,42 +135,115 @@ bool Scene::LoadScene(std::string file)
 			
 			if (key == "LIGHT")
 			{
-				Shape* light = new Light;
-				shapes.push_back(light);
+				if (currentGeometry)
+				{
+					std::cout << "LIGHT is not allowed in DEFINE: " << currentGeometry->name << std::endl;
+					return false;
+				}
+				Shape* light = NewShape<Light>();
+				target->push_back(light);
 				currentType = ShapeType::LIGHT;
 				currentPosCount = 0;
 			}
 			else if (key == "SPHERE")
 			{
-				Shape* shpere = new Sphere;
-				shapes.push_back(shpere);
+				Shape* shpere = NewShape<Sphere>();
+				target->push_back(shpere);
 				currentType = ShapeType::SPHERE;
 				currentPosCount = 0;
 			}
 			else if (key == "QUAD")
 			{
-				Shape* quad = new Quad;
-				shapes.push_back(quad);
+				Shape* quad = NewShape<Quad>();
+				target->push_back(quad);
 				currentType = ShapeType::QUAD;
 				currentPosCount = 0;
 			}
+			else if (key == "DEFINE")
+			{
+				std::string name;
+				ss >> name;
+				if (ss.fail()) break;
+				if (currentGeometry)
+				{
+					std::cout << "DEFINE is not allowed in DEFINE: " << currentGeometry->name << std::endl;
+					return false;
+				}
+				currentGeometry = new Geometry;
+				currentGeometry->name = name;
+				geometries.push_back(currentGeometry);
+				target = &currentGeometry->shapes;
+				currentType = ShapeType::NONE;
+			}
+			else if (key == "END")
+			{
+				currentGeometry = 0;
+				target = &shapes;
+				currentType = ShapeType::NONE;
+			}
+			else if (key == "INSTANCE")
+			{
+				std::string name;
+				ss >> name;
+				if (ss.fail()) break;
+				if (currentGeometry)
+				{
+					std::cout << "INSTANCE is not allowed in DEFINE: " << currentGeometry->name << std::endl;
+					return false;
+				}
+				Geometry* geometry = 0;
+				for (auto g : geometries)
+				{
+					if (g->name == name)
+						geometry = g;
+				}
+				if (!geometry)
+				{
+					std::cout << "Undefined geometry in INSTANCE: " << name << std::endl;
+					return false;
+				}
+				Instance* instance = NewShape<Instance>();
+				instance->SetGeometry(geometry);
+				// Material tags replace single fields, the others keep the
+				// material of the group
+				if (!geometry->shapes.empty())
+					*instance->surface = *geometry->shapes[0]->surface;
+				target->push_back(instance);
+				currentType = ShapeType::INSTANCE;
+				currentPosCount = 0;
+			}
+			else if (key == "ROTATE")
+			{
+				float angle;
+				ss >> x >> y >> z >> angle;
+				if (ss.fail()) break;
+				if (currentType == ShapeType::INSTANCE)
+					((Instance*)target->back())->Rotate(glm::vec3(x, y, z), angle);
+			}
+			else if (key == "SCALE")
+			{
+				ss >> x >> y >> z;
+				if (ss.fail()) break;
+				if (currentType == ShapeType::INSTANCE)
+					((Instance*)target->back())->Scale(glm::vec3(x, y, z));
+			}
 			else if (key == "POS")
 			{
 				ss >> x >> y >> z;
 				if (ss.fail()) break;
 				if (currentType == ShapeType::LIGHT)
 				{
-					Light* l = (Light*)shapes.back();
+					Light* l = (Light*)target->back();
 					l->SetCenter(glm::vec3(x, y, z));
 				}
 				else if (currentType == ShapeType::SPHERE)
 				{
-					Sphere* s = (Sphere*)shapes.back();
+					Sphere* s = (Sphere*)target->back();
 					s->SetCenter(glm::vec3(x, y, z));
 				}
 				else if (currentType == ShapeType::QUAD)
 				{
-					Quad* q = (Quad*)shapes.back();
+					Quad* q = (Quad*)target->back();
 					if (currentPosCount == 0)
 						q->SetV1(glm::vec3(x, y, z));
 					else if (currentPosCount == 1)
@@ -100,6 +251,12 @@ bool Scene::LoadScene(std::string file)
 					else if (currentPosCount == 2)
 						q->SetV3(glm::vec3(x, y, z));
 				}
+				else if (currentType == ShapeType::INSTANCE)
+				{
+					Instance* inst = (Instance*)target->back();
+					inst->SetCenter(glm::vec3(x, y, z));
+					inst->UpdateTransform();
+				}
 				currentPosCount++;
 			}
 			else if (key == "RADIUS")
@@ -108,7 +265,7 @@ bool Scene::LoadScene(std::string file)
 				{
 					ss >> x;
 					if (ss.fail()) break;
-					Sphere* s = (Sphere*)shapes.back();
+					Sphere* s = (Sphere*)target->back();
 					s->SetRadius(x);
 				}
 			}
@@ -116,43 +273,61 @@ bool Scene::LoadScene(std::string file)
 			{
 				ss >> x >> y >> z;
 				if (ss.fail()) break;
-				shapes.back()->SetDiff(glm::vec3(x, y, z));
+				target->back()->SetDiff(glm::vec3(x, y, z));
+				if (currentType == ShapeType::INSTANCE)
+					((Instance*)target->back())->overrideMaterial = true;
 			}
 			else if (key == "SPEC")
 			{
 				ss >> x >> y >> z;
 				if (ss.fail()) break;
-				shapes.back()->SetSpec(glm::vec3(x, y, z));
+				target->back()->SetSpec(glm::vec3(x, y, z));
+				if (currentType == ShapeType::INSTANCE)
+					((Instance*)target->back())->overrideMaterial = true;
 			}
 			else if (key == "SHININESS")
 			{
 				ss >> x;
 				if (ss.fail()) break;
-				shapes.back()->SetShininess(x);
+				target->back()->SetShininess(x);
+				if (currentType == ShapeType::INSTANCE)
+					((Instance*)target->back())->overrideMaterial = true;
 			}
 			else if (key == "REFLECTIVITY")
 			{
 				ss >> x;
 				if (ss.fail()) break;
-				shapes.back()->SetReflectivity(x);
+				target->back()->SetReflectivity(x);
+				if (currentType == ShapeType::INSTANCE)
+					((Instance*)target->back())->overrideMaterial = true;
 			}
 			else if (key == "MOVEDIR")
 			{
 				ss >> x >> y >> z;
 				if (ss.fail()) break;
-				shapes.back()->SetMoveDirection(glm::normalize(glm::vec3(x, y, z)));
+				Animate(target->back());
+				target->back()->SetMoveDirection(glm::normalize(glm::vec3(x, y, z)));
 			}
 			else if (key == "MOVEDISTANCE")
 			{
 				ss >> x;
 				if (ss.fail()) break;
-				shapes.back()->SetMoveDistance(x);
+				Animate(target->back());
+				target->back()->SetMoveDistance(x);
 			}
 			else if (key == "MOVESPEED")
 			{
 				ss >> x;
 				if (ss.fail()) break;
-				shapes.back()->SetMoveSpeed(x);
+				Animate(target->back());
+				target->back()->SetMoveSpeed(x);
+			}
+			else if (key == "FALLOFF")
+			{
+				ss >> x;
+				if (ss.fail()) break;
+				if (currentType == ShapeType::LIGHT)
+					((Light*)target->back())->SetFalloff(x);
 			}
 			else if (key == "BACKGROUND")
 			{
@@ -180,13 +355,340 @@ bool Scene::LoadScene(std::string file)
 				if (antialiasLevel <= 0)
 					antialiasLevel = 1;
 			}
+			else if (key == "LIGHTCULL")
+			{
+				ss >> x;
+				if (ss.fail()) break;
+				lightCullThreshold = x;
+			}
+			else if (key == "LIGHTSAMPLES")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				lightSamples = i;
+			}
+			else if (key == "NUMA")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				numa = i != 0;
+			}
+			else if (key == "HUGEPAGES")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				hugePages = i != 0;
+			}
+			else if (key == "PIPELINE")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				pipeline = i != 0;
+			}
+			else if (key == "PIXELORDER")
+			{
+				std::string name;
+				ss >> name;
+				if (ss.fail()) break;
+				if (!ParsePixelOrder(name, pixelOrder))
+					std::cout << "Unknown pixel order: " << name << std::endl;
+			}
+			else if (key == "BATCHSHADING")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				batchShading = i != 0;
+			}
+			else if (key == "SPECIALIZEDTRACE")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				specializedTrace = i != 0;
+			}
+			else if (key == "RAYTHRESHOLD")
+			{
+				ss >> x;
+				if (ss.fail()) break;
+				rayThreshold = x;
+			}
+			else if (key == "RUSSIANROULETTE")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				russianRoulette = i != 0;
+			}
+			else if (key == "RAYBUDGET")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				rayBudget = i;
+			}
+			else if (key == "FRAMETIME")
+			{
+				ss >> x;
+				if (ss.fail()) break;
+				frameTime = x;
+			}
+			else if (key == "MINSCALE")
+			{
+				ss >> x;
+				if (ss.fail()) break;
+				minScale = x;
+			}
+			else if (key == "MINANTIALIAS")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				minAntialias = i;
+			}
+			else if (key == "SPARSETRACE")
+			{
+				std::string name;
+				ss >> name;
+				if (ss.fail()) break;
+				if (!ParseSparsePattern(name, sparseTrace))
+					std::cout << "Unknown sparse pattern: " << name << std::endl;
+			}
+			else if (key == "PRIMARYCACHE")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				primaryCache = i != 0;
+			}
+			else if (key == "SHADOWCACHE")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				shadowCacheResolution = i;
+			}
+			else if (key == "SHADOWCACHEERROR")
+			{
+				ss >> x;
+				if (ss.fail()) break;
+				shadowCacheError = x;
+			}
+			else if (key == "HOTRELOAD")
+			{
+				ss >> i;
+				if (ss.fail()) break;
+				hotReload = i != 0;
+			}
+			else if (key == "HEATMAP")
+			{
+				std::string name;
+				ss >> name;
+				if (ss.fail()) break;
+				if (!ParseHeatmapMode(name, heatmap))
+					std::cout << "Unknown heatmap mode: " << name << std::endl;
+			}
+			else if (key == "ACCEL")
+			{
+				std::string name;
+				ss >> name;
+				if (ss.fail()) break;
+				if (!ParseAccelType(name, accelType))
+					std::cout << "Unknown acceleration structure: " << name << std::endl;
+			}
 		}
 	}
+	for (auto g : geometries)
+		g->Build(accelType);
 	return true;
 }
 
 void Scene::UpdateScene()
 {
+	EvaluateAt(frame + 1);
+}
+
+void Scene::EvaluateAt(int t)
+{
+	TimelineScope scope("UpdateScene", t);
+	frame = t;
 	for (auto s : shapes)
-		s->Move();
+		s->MoveTo(t);
+}
+
+void Scene::StorageUsage(size_t& count, size_t& shapeBytes, size_t& materialBytes)
+{
+	count = shapes.size();
+	for (auto g : geometries)
+		count += g->shapes.size();
+	shapeBytes = shapeArena.BytesUsed();
+	materialBytes = materialArena.BytesUsed();
+}
+
+bool Scene::SameSettings(const Scene& other)
+{
+	return backgroundColor == other.backgroundColor && traceDepth == other.traceDepth &&
+		antialiasLevel == other.antialiasLevel && resolution == other.resolution &&
+		accelType == other.accelType && lightCullThreshold == other.lightCullThreshold &&
+		lightSamples == other.lightSamples && numa == other.numa && hugePages == other.hugePages &&
+		pipeline == other.pipeline && pixelOrder == other.pixelOrder && batchShading == other.batchShading &&
+		specializedTrace == other.specializedTrace && rayThreshold == other.rayThreshold &&
+		russianRoulette == other.russianRoulette && rayBudget == other.rayBudget &&
+		frameTime == other.frameTime && minScale == other.minScale && minAntialias == other.minAntialias &&
+		sparseTrace == other.sparseTrace && primaryCache == other.primaryCache &&
+		shadowCacheResolution == other.shadowCacheResolution && shadowCacheError == other.shadowCacheError &&
+		hotReload == other.hotReload && heatmap == other.heatmap;
+}
+
+// Whether b of the other scene can be copied to a: the same kind of shape,
+// and for instances the same geometry
+bool Scene::SameLayout(Shape* a, Shape* b, const Scene& other)
+{
+	if (a->type != b->type)
+		return false;
+	if (a->type != ShapeType::INSTANCE)
+		return true;
+	Geometry* ga = ((Instance*)a)->geometry;
+	Geometry* gb = ((Instance*)b)->geometry;
+	for (size_t k = 0; k < geometries.size(); k++)
+	{
+		if (geometries[k] == ga)
+			return other.geometries[k] == gb;
+	}
+	return false;
+}
+
+static bool SameSurface(const Surface& a, const Surface& b)
+{
+	return a.diff_color == b.diff_color && a.spec_color == b.spec_color &&
+		a.shininess == b.shininess && a.reflectivity == b.reflectivity;
+}
+
+static bool SameMotion(const Motion* a, const Motion* b)
+{
+	if (!a || !b)
+		return a == b;
+	if (a->direction != b->direction || a->distance != b->distance || a->speed != b->speed)
+		return false;
+	for (int k = 0; k < 5; k++)
+	{
+		if (a->origin[k] != b->origin[k])
+			return false;
+	}
+	return true;
+}
+
+// Whether two shapes of the same type are at the same place
+static bool SameGeometry(Shape* a, Shape* b)
+{
+	switch (a->type)
+	{
+	case ShapeType::LIGHT:
+		return a->center == b->center && ((Light*)a)->falloff == ((Light*)b)->falloff;
+	case ShapeType::SPHERE:
+		return a->center == b->center && ((Sphere*)a)->radius == ((Sphere*)b)->radius;
+	case ShapeType::QUAD:
+	{
+		Quad* qa = (Quad*)a;
+		Quad* qb = (Quad*)b;
+		return qa->vertex1 == qb->vertex1 && qa->vertex2 == qb->vertex2 &&
+			qa->vertex3 == qb->vertex3 && qa->vertex4 == qb->vertex4;
+	}
+	case ShapeType::INSTANCE:
+		return a->center == b->center && ((Instance*)a)->localTransform == ((Instance*)b)->localTransform;
+	default:
+		return a->center == b->center;
+	}
+}
+
+int Scene::CopyShape(Shape* dst, Shape* src)
+{
+	int changed = 0;
+	bool overrides = dst->type == ShapeType::INSTANCE && ((Instance*)dst)->overrideMaterial != ((Instance*)src)->overrideMaterial;
+	if (!SameSurface(*dst->surface, *src->surface) || overrides)
+		changed |= EDIT_SURFACE;
+	if (!SameGeometry(dst, src) || !SameMotion(dst->motion, src->motion))
+		changed |= EDIT_GEOMETRY;
+	if (!changed)
+		return 0;
+	// Assignment copies the pointers to the records of the other scene too,
+	// they are put back and the records copied
+	Surface* surface = dst->surface;
+	Motion* motion = dst->motion;
+	switch (dst->type)
+	{
+	case ShapeType::LIGHT:
+		*(Light*)dst = *(Light*)src;
+		break;
+	case ShapeType::SPHERE:
+		*(Sphere*)dst = *(Sphere*)src;
+		break;
+	case ShapeType::QUAD:
+		*(Quad*)dst = *(Quad*)src;
+		break;
+	case ShapeType::INSTANCE:
+	{
+		Geometry* geometry = ((Instance*)dst)->geometry;
+		*(Instance*)dst = *(Instance*)src;
+		((Instance*)dst)->geometry = geometry;
+		break;
+	}
+	default:
+		*dst = *src;
+		break;
+	}
+	dst->surface = surface;
+	*surface = *src->surface;
+	dst->motion = 0;
+	if (src->motion)
+	{
+		dst->motion = motion ? motion : materialArena.New<Motion>();
+		*dst->motion = *src->motion;
+	}
+	return changed;
+}
+
+bool Scene::ApplyEdits(Scene& edited, SceneEdits& edits)
+{
+	if (!SameSettings(edited) || shapes.size() != edited.shapes.size() || geometries.size() != edited.geometries.size())
+		return false;
+	for (size_t k = 0; k < geometries.size(); k++)
+	{
+		Geometry* g = geometries[k];
+		Geometry* e = edited.geometries[k];
+		if (g->name != e->name || g->shapes.size() != e->shapes.size())
+			return false;
+		for (size_t n = 0; n < g->shapes.size(); n++)
+		{
+			if (!SameLayout(g->shapes[n], e->shapes[n], edited))
+				return false;
+		}
+	}
+	for (size_t k = 0; k < shapes.size(); k++)
+	{
+		if (!SameLayout(shapes[k], edited.shapes[k], edited))
+			return false;
+	}
+
+	// Nothing is changed before all shapes are known to match
+	edited.EvaluateAt(frame);
+	for (size_t k = 0; k < geometries.size(); k++)
+	{
+		bool changed = false;
+		for (size_t n = 0; n < geometries[k]->shapes.size(); n++)
+		{
+			int c = CopyShape(geometries[k]->shapes[n], edited.geometries[k]->shapes[n]);
+			if (c)
+				edits.shapes++;
+			if (c & EDIT_GEOMETRY)
+			{
+				edits.moved = true;
+				changed = true;
+			}
+		}
+		if (changed)
+			edits.geometries.push_back(geometries[k]);
+	}
+	for (size_t k = 0; k < shapes.size(); k++)
+	{
+		int c = CopyShape(shapes[k], edited.shapes[k]);
+		if (c)
+			edits.shapes++;
+		if (c & EDIT_GEOMETRY)
+			edits.moved = true;
+	}
+	return true;
 }
@@ -5,7 +5,23 @@
 #include <string>
 #include <glm/glm.hpp>
 
+#include "arena.h"
 #include "shapes.h"
+#include "instance.h"
+#include "pixelorder.h"
+#include "gbuffer.h"
+#include "heatmap.h"
+
+// What Scene::ApplyEdits changed
+class SceneEdits
+{
+public:
+	int shapes;		// Shapes that changed in any way
+	bool moved;		// Some shape changed its geometry or motion
+	std::vector<Geometry*> geometries;	// Geometries with changed shapes
+
+	SceneEdits();
+};
 
 class Scene
 {
@@ -14,13 +30,68 @@ public:
 	int traceDepth;
 	int antialiasLevel;
 	glm::ivec2 resolution;
+	AccelType accelType;
+	float lightCullThreshold;
+	int lightSamples;
+	bool numa;		// Pin render threads and keep data on their NUMA node
+	bool hugePages;	// Back the framebuffer with huge pages
+	bool pipeline;	// Render tiles on a thread pool, overlapping frames
+	PixelOrder pixelOrder;
+	bool batchShading;	// Shade lights in SIMD batches with an approximate pow
+	bool specializedTrace;	// Trace with a kernel compiled for the features of the scene
+	float rayThreshold;	// Reflections whose contribution to the pixel is below this are not traced
+	bool russianRoulette;	// Reflections below rayThreshold are traced by chance and reweighted
+	int rayBudget;	// Reflection rays per frame, 0 for no limit
+	// Frame time the viewer aims for in ms by lowering the render resolution
+	// down to minScale and the antialiasing down to minAntialias, 0 for none
+	float frameTime;
+	float minScale;
+	int minAntialias;
+	SparsePattern sparseTrace;	// Native pixels traced, the rest are reconstructed
+	bool primaryCache;	// Keep primary hits between frames while the camera does not move
+	int shadowCacheResolution;	// Cube face size of the visibility caches of static lights, 0 for none
+	float shadowCacheError;	// Relative depth range a cache texel may cover and still answer
+	bool hotReload;	// Watch the scene file and apply its edits between frames
+	HeatmapMode heatmap;	// Cost of every pixel drawn instead of its color
+	int frame;	// Animation steps taken so far
 
 	std::vector<Shape*> shapes;
+	std::vector<Geometry*> geometries;
+	// All shapes, those of geometries too, are packed in shapeArena in the
+	// order of the scene file. Their surfaces and motions are in materialArena.
+	Arena shapeArena;
+	Arena materialArena;
 
 	Scene();
 	~Scene();
-	bool LoadScene(std::string file);
+	bool LoadScene(std::string file, std::string options = "");
+	// Same as LoadScene, from the contents of a scene file
+	bool LoadSceneText(std::string text);
+	// Contents of the scene file with the options appended
+	static bool ReadSceneFile(std::string file, std::string options, std::string& text);
+	// Advance animations by one step
 	void UpdateScene();
+	// Put every shape where it is after t animation steps, without going
+	// through the steps before
+	void EvaluateAt(int t);
+	// Number of shapes and the bytes they take in each arena
+	void StorageUsage(size_t& count, size_t& shapeBytes, size_t& materialBytes);
+	// Copies the shapes of edited, another parse of the scene file, that
+	// differ from those of this scene. Shapes stay where they are, so
+	// acceleration structures only need a refit. Returns false and changes
+	// nothing unless both have the same settings and the same kinds of
+	// shapes in the same order. Edited is moved to the animation step of
+	// this scene.
+	bool ApplyEdits(Scene& edited, SceneEdits& edits);
+
+private:
+	template <class T> T* NewShape();
+	// Motion of the shape, added the first time it is asked for
+	Motion* Animate(Shape* s);
+	bool SameSettings(const Scene& other);
+	bool SameLayout(Shape* a, Shape* b, const Scene& other);
+	// Copies src of another scene to dst, returns the EDIT_ flags of what changed
+	int CopyShape(Shape* dst, Shape* src);
 };
 
 #endif
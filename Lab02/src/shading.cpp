@@ -0,0 +1,61 @@
+#include "shading.h"
+#include "kernels.h"
+
+void ShadingLights::Update(const std::vector<Light*>& lights)
+{
+	position.resize(lights.size());
+	diffuse.resize(lights.size());
+	specular.resize(lights.size());
+	falloff2.resize(lights.size());
+	for (int i = 0; i < (int)lights.size(); i++)
+	{
+		position[i] = lights[i]->center;
+		diffuse[i] = lights[i]->surface->diff_color;
+		specular[i] = lights[i]->surface->spec_color;
+		falloff2[i] = lights[i]->falloff > 0.0f ? lights[i]->falloff * lights[i]->falloff : 0.0f;
+	}
+}
+
+ShadingBatch::ShadingBatch()
+{
+	count = 0;
+}
+
+void ShadingBatch::Add(glm::vec3 p, glm::vec3 n, glm::vec3 v, const Shape& material, const ShadingLights& lights, int light, float w)
+{
+	int i = count++;
+	px[i] = p.x; py[i] = p.y; pz[i] = p.z;
+	nx[i] = n.x; ny[i] = n.y; nz[i] = n.z;
+	vx[i] = v.x; vy[i] = v.y; vz[i] = v.z;
+	diffR[i] = material.surface->diff_color.r; diffG[i] = material.surface->diff_color.g; diffB[i] = material.surface->diff_color.b;
+	specR[i] = material.surface->spec_color.r; specG[i] = material.surface->spec_color.g; specB[i] = material.surface->spec_color.b;
+	shininess[i] = material.surface->shininess;
+	glm::vec3 lp = lights.position[light];
+	lx[i] = lp.x; ly[i] = lp.y; lz[i] = lp.z;
+	lightDiffR[i] = lights.diffuse[light].r; lightDiffG[i] = lights.diffuse[light].g; lightDiffB[i] = lights.diffuse[light].b;
+	lightSpecR[i] = lights.specular[light].r; lightSpecG[i] = lights.specular[light].g; lightSpecB[i] = lights.specular[light].b;
+	falloff2[i] = lights.falloff2[light];
+	weight[i] = w;
+}
+
+// Unused entries get the values of entry 0
+void ShadingBatch::Pad(int width)
+{
+	int padded = (count + width - 1) / width * width;
+	float* lanes[] = { px, py, pz, nx, ny, nz, vx, vy, vz, diffR, diffG, diffB,
+		specR, specG, specB, shininess, lx, ly, lz, lightDiffR, lightDiffG, lightDiffB,
+		lightSpecR, lightSpecG, lightSpecB, falloff2, weight };
+	for (int i = count; i < padded; i++)
+	{
+		for (float* lane : lanes)
+			lane[i] = lane[0];
+		weight[i] = 0.0f;
+	}
+}
+
+glm::vec3 ShadeBatch(ShadingBatch& batch)
+{
+	float color[3];
+	simdKernels->shadeBatch(batch, color);
+	return glm::vec3(color[0], color[1], color[2]);
+}
@@ -0,0 +1,69 @@
+#ifndef __SHADING_H__
+#define __SHADING_H__
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "shapes.h"
+
+// log2(m) = 2 / ln(2) * atanh(t) with t = (m - 1) / (m + 1). With m in
+// [sqrt(1/2), sqrt(2)), |t| < 0.172 and the series up to t^9 is exact
+// to about 1e-10.
+const float LOG2_C1 = 2.885390082f;		// 2 / ln(2)
+const float LOG2_C3 = 0.961796694f;		// 2 / (3 ln(2))
+const float LOG2_C5 = 0.577078016f;		// 2 / (5 ln(2))
+const float LOG2_C7 = 0.412198583f;		// 2 / (7 ln(2))
+const float LOG2_C9 = 0.320598898f;		// 2 / (9 ln(2))
+// 2^f = e^(f ln(2)) for f in [-0.5, 0.5], Taylor series up to f^6
+const float EXP2_C1 = 0.693147181f;
+const float EXP2_C2 = 0.240226507f;
+const float EXP2_C3 = 0.055504109f;
+const float EXP2_C4 = 0.009618129f;
+const float EXP2_C5 = 0.001333356f;
+const float EXP2_C6 = 0.000154035f;
+const float SQRT2 = 1.414213562f;
+
+// Light values used by shading, kept together for all lights and updated
+// once per frame
+class ShadingLights
+{
+public:
+	std::vector<glm::vec3> position;
+	std::vector<glm::vec3> diffuse;
+	std::vector<glm::vec3> specular;
+	std::vector<float> falloff2;	// Squared falloff radius, 0 for none
+
+	void Update(const std::vector<Light*>& lights);
+};
+
+// Hit points to shade, each against one light, as structure of arrays
+class ShadingBatch
+{
+public:
+	int count;
+	float px[PACKET_SIZE], py[PACKET_SIZE], pz[PACKET_SIZE];	// Position
+	float nx[PACKET_SIZE], ny[PACKET_SIZE], nz[PACKET_SIZE];	// Normal
+	float vx[PACKET_SIZE], vy[PACKET_SIZE], vz[PACKET_SIZE];	// Direction to the viewer
+	// Material
+	float diffR[PACKET_SIZE], diffG[PACKET_SIZE], diffB[PACKET_SIZE];
+	float specR[PACKET_SIZE], specG[PACKET_SIZE], specB[PACKET_SIZE];
+	float shininess[PACKET_SIZE];
+	// Light
+	float lx[PACKET_SIZE], ly[PACKET_SIZE], lz[PACKET_SIZE];
+	float lightDiffR[PACKET_SIZE], lightDiffG[PACKET_SIZE], lightDiffB[PACKET_SIZE];
+	float lightSpecR[PACKET_SIZE], lightSpecG[PACKET_SIZE], lightSpecB[PACKET_SIZE];
+	float falloff2[PACKET_SIZE];
+	float weight[PACKET_SIZE];
+
+	ShadingBatch();
+	void Add(glm::vec3 p, glm::vec3 n, glm::vec3 v, const Shape& material, const ShadingLights& lights, int light, float weight);
+	// Fills unused entries up to a multiple of width with weight 0
+	void Pad(int width);
+};
+
+// Sum over the batch of weight * (diffuse + specular) * attenuation, the
+// same terms as RayTracer::Phong, several hits at a time with the kernels
+// of simdKernels
+glm::vec3 ShadeBatch(ShadingBatch& batch);
+
+#endif
@@ -0,0 +1,128 @@
+#include <thread>
+
+#include "shadowcache.h"
+
+// Rays per texel side when a texel is built
+const int SHADOW_CACHE_SAMPLES = 3;
+
+enum
+{
+	TEXEL_EMPTY,		// Not built yet
+	TEXEL_BUILDING,
+	TEXEL_SURFACE,		// All rays hit, at close depths
+	TEXEL_MIXED,		// Edges or misses, shadow rays are traced
+};
+
+// Direction of (u, v) in [-1, 1]^2 on a cube face
+static glm::vec3 CubeDirection(int face, float u, float v)
+{
+	switch (face)
+	{
+	case 0: return glm::vec3(1.0f, u, v);
+	case 1: return glm::vec3(-1.0f, u, v);
+	case 2: return glm::vec3(u, 1.0f, v);
+	case 3: return glm::vec3(u, -1.0f, v);
+	case 4: return glm::vec3(u, v, 1.0f);
+	default: return glm::vec3(u, v, -1.0f);
+	}
+}
+
+LightVisibilityCache::LightVisibilityCache(glm::vec3 lightPos, int resolution, float errorBound, Accelerator* occluders)
+{
+	this->lightPos = lightPos;
+	this->resolution = resolution;
+	this->errorBound = errorBound;
+	this->occluders = occluders;
+	texels = new Texel[6 * resolution * resolution];
+	for (int i = 0; i < 6 * resolution * resolution; i++)
+		texels[i].state = TEXEL_EMPTY;
+}
+
+LightVisibilityCache::~LightVisibilityCache()
+{
+	delete[] texels;
+}
+
+ShadowState LightVisibilityCache::Lookup(glm::vec3 p)
+{
+	glm::vec3 d = p - lightPos;
+	glm::vec3 a = glm::abs(d);
+	int face;
+	float u, v, m;
+	if (a.x >= a.y && a.x >= a.z)
+	{
+		face = d.x > 0.0f ? 0 : 1;
+		m = a.x; u = d.y; v = d.z;
+	}
+	else if (a.y >= a.z)
+	{
+		face = d.y > 0.0f ? 2 : 3;
+		m = a.y; u = d.x; v = d.z;
+	}
+	else
+	{
+		face = d.z > 0.0f ? 4 : 5;
+		m = a.z; u = d.x; v = d.y;
+	}
+	if (m == 0.0f)
+		return ShadowState::UNKNOWN;
+	int x = glm::clamp((int)((u / m * 0.5f + 0.5f) * resolution), 0, resolution - 1);
+	int y = glm::clamp((int)((v / m * 0.5f + 0.5f) * resolution), 0, resolution - 1);
+	int index = (face * resolution + y) * resolution + x;
+	Texel& texel = texels[index];
+
+	int state = texel.state.load(std::memory_order_acquire);
+	if (state == TEXEL_EMPTY)
+	{
+		int expected = TEXEL_EMPTY;
+		if (texel.state.compare_exchange_strong(expected, TEXEL_BUILDING, std::memory_order_acquire))
+			Build(index, texel);
+	}
+	// Another thread builds it, the answer must not depend on timing
+	while ((state = texel.state.load(std::memory_order_acquire)) == TEXEL_BUILDING)
+		std::this_thread::yield();
+
+	if (state != TEXEL_SURFACE)
+		return ShadowState::UNKNOWN;
+	// Points up to the surface seen through the texel are lit, points
+	// behind it by more than the error bound are in its shadow
+	float dist = glm::length(d);
+	if (dist > texel.maxDepth + errorBound * texel.minDepth)
+		return ShadowState::OCCLUDED;
+	return ShadowState::LIT;
+}
+
+void LightVisibilityCache::Build(int index, Texel& texel)
+{
+	int face = index / (resolution * resolution);
+	int y = index / resolution % resolution;
+	int x = index % resolution;
+	float minDepth = INFINITY;
+	float maxDepth = 0.0f;
+	bool hitAll = true;
+	for (int sy = 0; sy < SHADOW_CACHE_SAMPLES && hitAll; sy++)
+	{
+		for (int sx = 0; sx < SHADOW_CACHE_SAMPLES && hitAll; sx++)
+		{
+			// Corners, edges and inside, so the rays span the texel
+			float u = (x + (float)sx / (SHADOW_CACHE_SAMPLES - 1)) / resolution * 2.0f - 1.0f;
+			float v = (y + (float)sy / (SHADOW_CACHE_SAMPLES - 1)) / resolution * 2.0f - 1.0f;
+			glm::vec3 dir = glm::normalize(CubeDirection(face, u, v));
+			float t = INFINITY;
+			Shape* hitObj = 0;
+			Shape* hitPrim = 0;
+			hitAll = occluders->Intersect(lightPos, dir, 0, 0, t, hitObj, hitPrim);
+			minDepth = glm::min(minDepth, t);
+			maxDepth = glm::max(maxDepth, t);
+		}
+	}
+	texel.minDepth = minDepth;
+	texel.maxDepth = maxDepth;
+	bool surface = hitAll && maxDepth - minDepth <= errorBound * minDepth;
+	texel.state.store(surface ? TEXEL_SURFACE : TEXEL_MIXED, std::memory_order_release);
+}
+
+size_t LightVisibilityCache::MemoryUsage()
+{
+	return (size_t)6 * resolution * resolution * sizeof(Texel);
+}
@@ -0,0 +1,48 @@
+#ifndef __SHADOWCACHE_H__
+#define __SHADOWCACHE_H__
+
+#include <atomic>
+#include <glm/glm.hpp>
+
+#include "accel.h"
+
+// Answer of a visibility cache for a shadow ray
+enum class ShadowState
+{
+	LIT,		// No static occluder between the point and the light
+	OCCLUDED,
+	UNKNOWN,	// The cache can't tell, the ray has to be traced
+};
+
+// Visibility of the static occluders around a static light, as a cube map of
+// distances from the light. Each texel is built the first time a shadow ray
+// falls into it, from SHADOW_CACHE_SAMPLES^2 rays over the texel. A texel
+// where all rays hit at depths within errorBound of each other answers for
+// points behind or on its surface, other texels answer UNKNOWN.
+class LightVisibilityCache
+{
+public:
+	LightVisibilityCache(glm::vec3 lightPos, int resolution, float errorBound, Accelerator* occluders);
+	~LightVisibilityCache();
+	ShadowState Lookup(glm::vec3 p);
+	size_t MemoryUsage();
+
+private:
+	class Texel
+	{
+	public:
+		std::atomic<int> state;	// TEXEL_* in shadowcache.cpp
+		float minDepth;
+		float maxDepth;
+	};
+
+	glm::vec3 lightPos;
+	int resolution;
+	float errorBound;
+	Accelerator* occluders;
+	Texel* texels;
+
+	void Build(int index, Texel& texel);
+};
+
+#endif
@@ -4,60 +4,160 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "shapes.h"
+#include "kernels.h"
 
-Shape::Shape()
+ShadowPacket::ShadowPacket()
+{
+	count = 0;
+	active = 0;
+	for (int i = 0; i < PACKET_SIZE; i++)
+	{
+		dirX[i] = 1.0f;
+		dirY[i] = 0.0f;
+		dirZ[i] = 0.0f;
+		invX[i] = 1.0f;
+		invY[i] = INFINITY;
+		invZ[i] = INFINITY;
+		maxDist[i] = -1.0f;
+	}
+}
+
+void ShadowPacket::Add(glm::vec3 dir, float dist)
+{
+	glm::vec3 inv = 1.0f / dir;
+	dirX[count] = dir.x;
+	dirY[count] = dir.y;
+	dirZ[count] = dir.z;
+	invX[count] = inv.x;
+	invY[count] = inv.y;
+	invZ[count] = inv.z;
+	maxDist[count] = dist;
+	active |= 1 << count;
+	count++;
+}
+
+glm::vec3 ShadowPacket::Dir(int i) const
+{
+	return glm::vec3(dirX[i], dirY[i], dirZ[i]);
+}
+
+AABB::AABB()
+{
+	bmin = glm::vec3(INFINITY);
+	bmax = glm::vec3(-INFINITY);
+}
+
+void AABB::Expand(glm::vec3 p)
+{
+	bmin = glm::min(bmin, p);
+	bmax = glm::max(bmax, p);
+}
+
+void AABB::Expand(const AABB& b)
+{
+	bmin = glm::min(bmin, b.bmin);
+	bmax = glm::max(bmax, b.bmax);
+}
+
+glm::vec3 AABB::Center() const
+{
+	return (bmin + bmax) * 0.5f;
+}
+
+float AABB::Area() const
+{
+	glm::vec3 d = bmax - bmin;
+	if (d.x < 0.0f || d.y < 0.0f || d.z < 0.0f)
+		return 0.0f;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+bool AABB::Hit(glm::vec3 rayOrg, glm::vec3 invDir, float tMax) const
+{
+	glm::vec3 t0 = (bmin - rayOrg) * invDir;
+	glm::vec3 t1 = (bmax - rayOrg) * invDir;
+	glm::vec3 tNear = glm::min(t0, t1);
+	glm::vec3 tFar = glm::max(t0, t1);
+	float enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+	float exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, tMax));
+	return enter <= exit;
+}
+
+unsigned int AABB::HitPacket(glm::vec3 rayOrg, const ShadowPacket& packet, unsigned int mask) const
+{
+	return simdKernels->boxHitPacket(*this, rayOrg, packet, mask);
+}
+
+Surface::Surface()
 {
-	type = ShapeType::NONE;
-	center = glm::vec3(0.0f);
 	diff_color = glm::vec3(0.0f);
 	spec_color = glm::vec3(0.0f);
 	shininess = 0.0f;
 	reflectivity = 0.0f;
-	moveDirection = glm::vec3(0.0f);
-	moveDistance = 0.0f;
-	moveSpeed = 0.0f;
-	offset = 0.0f;
-	moveForward = true;
+}
+
+Motion::Motion()
+{
+	direction = glm::vec3(0.0f);
+	distance = 0.0f;
+	speed = 0.0f;
+	for (glm::vec3& o : origin)
+		o = glm::vec3(0.0f);
+}
+
+Shape::Shape()
+{
+	type = ShapeType::NONE;
+	center = glm::vec3(0.0f);
+	surface = 0;
+	motion = 0;
 }
 
 void Shape::SetCenter(glm::vec3 pos)
 {
 	center = pos;
+	SetOrigin();
 }
 
 void Shape::SetDiff(glm::vec3 diff)
 {
-	diff_color = diff;
+	surface->diff_color = diff;
 }
 
 void Shape::SetSpec(glm::vec3 spec)
 {
-	spec_color = spec;
+	surface->spec_color = spec;
 }
 
 void Shape::SetShininess(float s)
 {
-	shininess = s;
+	surface->shininess = s;
 }
 
 void Shape::SetReflectivity(float r)
 {
-	reflectivity = r;
+	surface->reflectivity = r;
 }
 
 void Shape::SetMoveDirection(glm::vec3 dir)
 {
-	moveDirection = glm::normalize(dir);
+	motion->direction = glm::normalize(dir);
 }
 
 void Shape::SetMoveDistance(float dist)
 {
-	moveDistance = dist;
+	motion->distance = dist;
 }
 
 void Shape::SetMoveSpeed(float speed)
 {
-	moveSpeed = speed;
+	motion->speed = speed;
+}
+
+void Shape::SetOrigin()
+{
+	if (motion)
+		motion->origin[0] = center;
 }
 
 bool Shape::Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth)
@@ -65,34 +165,123 @@ bool Shape::Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth)
 	return false;
 }
 
-void Shape::Move()
+bool Shape::Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* skip, float& hitDepth, Shape*& hitPrim)
 {
-	if (moveDistance == 0.0f || moveSpeed == 0.0f || moveDirection == glm::vec3(0.0f))
-		return;
-	if (offset > moveDistance)
-		moveForward = false;
-	else if (offset < 0.0f)
-		moveForward = true;
-	if (moveForward)
+	if (this == skip)
+		return false;
+	if (!Hit(rayOrg, rayDir, hitDepth))
+		return false;
+	hitPrim = this;
+	return true;
+}
+
+unsigned int Shape::OccludesPacket(glm::vec3 rayOrg, const ShadowPacket& packet, unsigned int mask, Shape* skip)
+{
+	unsigned int res = 0;
+	for (int i = 0; i < packet.count; i++)
 	{
-		offset += moveSpeed;
-		center += moveDirection * moveSpeed;
+		if (!(mask & (1 << i)))
+			continue;
+		float depth = 0.0f;
+		Shape* prim = 0;
+		if (Intersect(rayOrg, packet.Dir(i), skip, depth, prim) && depth < packet.maxDist[i])
+			res |= 1 << i;
 	}
-	else
+	return res;
+}
+
+glm::vec3 Shape::Normal(glm::vec3 p)
+{
+	return glm::vec3(0.0f);
+}
+
+AABB Shape::GetBounds()
+{
+	AABB box;
+	box.Expand(center);
+	return box;
+}
+
+bool Shape::Moves() const
+{
+	return motion && motion->distance != 0.0f && motion->speed != 0.0f && motion->direction != glm::vec3(0.0f);
+}
+
+glm::vec3 Shape::Displacement(int step)
+{
+	if (!Moves() || step <= 0)
+		return glm::vec3(0.0f);
+	float moveDistance = motion->distance;
+	float moveSpeed = motion->speed;
+	// A negative speed never turns around
+	if (moveSpeed < 0.0f)
+		return motion->direction * ((moveDistance < 0.0f ? -step : step) * moveSpeed);
+
+	// Replays the offset the animation used to keep: the speed added in
+	// float every step, turning back once the offset is past moveDistance and
+	// forward once it is below 0. When the offset at a forward turn repeats,
+	// so do the steps after it, and whole rounds are skipped.
+	const int MAX_TURNS = 16;
+	float turnOffset[MAX_TURNS];
+	int turnStep[MAX_TURNS];
+	int turnSteps[MAX_TURNS];
+	int turns = 0;
+	float offset = 0.0f;
+	bool forward = true;
+	int steps = 0;	// Whole speeds forward so far
+	for (int i = 0; i < step; i++)
 	{
-		offset -= moveSpeed;
-		center -= moveDirection * moveSpeed;
+		if (offset > moveDistance)
+			forward = false;
+		else if (offset < 0.0f)
+		{
+			if (!forward)
+			{
+				for (int k = 0; k < turns; k++)
+				{
+					if (turnOffset[k] != offset)
+						continue;
+					int period = i - turnStep[k];
+					int rounds = (step - i) / period;
+					i += rounds * period;
+					steps += rounds * (steps - turnSteps[k]);
+					turns = 0;
+					break;
+				}
+				if (turns < MAX_TURNS)
+				{
+					turnOffset[turns] = offset;
+					turnStep[turns] = i;
+					turnSteps[turns] = steps;
+					turns++;
+				}
+				if (i >= step)
+					break;
+			}
+			forward = true;
+		}
+		offset += forward ? moveSpeed : -moveSpeed;
+		steps += forward ? 1 : -1;
 	}
+	return motion->direction * (steps * moveSpeed);
+}
+
+void Shape::MoveTo(int step)
+{
+	if (motion)
+		center = motion->origin[0] + Displacement(step);
 }
 
 Light::Light()
 {
 	type = ShapeType::LIGHT;
 	center = glm::vec3(0.0f);
-	diff_color = glm::vec3(0.0f);
-	spec_color = glm::vec3(0.0f);
-	shininess = 0.0f;
-	reflectivity = 0.0f;
+	falloff = 0.0f;
+}
+
+void Light::SetFalloff(float f)
+{
+	falloff = f;
 }
 
 Sphere::Sphere()
@@ -100,10 +289,6 @@ Sphere::Sphere()
 	type = ShapeType::SPHERE;
 	center = glm::vec3(0.0f);
 	radius = 0.0f;
-	diff_color = glm::vec3(0.0f);
-	spec_color = glm::vec3(0.0f);
-	shininess = 0.0f;
-	reflectivity = 0.0f;
 }
 
 void Sphere::SetRadius(float r)
@@ -113,25 +298,27 @@ void Sphere::SetRadius(float r)
 
 bool Sphere::Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth)
 {
-	glm::vec3 oc = center - rayOrg;
-	float op = glm::dot(rayDir, oc);
-	if (op < 0.0f)
-		return false;
-	float oc2 = glm::dot(oc, oc);
-	float d2 = oc2 - op * op;
-	if (d2 > radius * radius)
-		return false;
-	float discriminant = radius * radius - d2;
-	if (discriminant < EPSILON)
-		hitDepth = op;
-	else
-	{
-		discriminant = sqrt(discriminant);
-		hitDepth = op - discriminant;
-		if (hitDepth < 0.0f)
-			hitDepth = op + discriminant;
-	}
-	return true;
+	return simdKernels->sphereHit(*this, rayOrg, rayDir, hitDepth);
+}
+
+unsigned int Sphere::OccludesPacket(glm::vec3 rayOrg, const ShadowPacket& packet, unsigned int mask, Shape* skip)
+{
+	if (this == skip)
+		return 0;
+	return simdKernels->sphereOccludesPacket(*this, rayOrg, packet, mask);
+}
+
+glm::vec3 Sphere::Normal(glm::vec3 p)
+{
+	return glm::normalize(p - center);
+}
+
+AABB Sphere::GetBounds()
+{
+	AABB box;
+	box.Expand(center - glm::vec3(radius));
+	box.Expand(center + glm::vec3(radius));
+	return box;
 }
 
 Quad::Quad()
@@ -143,10 +330,6 @@ Quad::Quad()
 	vertex3 = glm::vec3(0.0f);
 	vertex4 = glm::vec3(0.0f);
 	normal = glm::vec3(1.0f, 0.0f, 0.0f);
-	diff_color = glm::vec3(0.0f);
-	spec_color = glm::vec3(0.0f);
-	shininess = 0.0f;
-	reflectivity = 0.0f;
 }
 
 void Quad::SetV1(glm::vec3 v1)
@@ -165,62 +348,55 @@ void Quad::SetV3(glm::vec3 v3)
 	vertex4 = vertex3 + (vertex2 - vertex1);
 	center = (vertex2 + vertex3) * 0.5f;
 	normal = glm::normalize(glm::cross((vertex2 - vertex1), (vertex3 - vertex1)));
+	SetOrigin();
+}
+
+void Quad::SetOrigin()
+{
+	if (!motion)
+		return;
+	motion->origin[0] = center;
+	motion->origin[1] = vertex1;
+	motion->origin[2] = vertex2;
+	motion->origin[3] = vertex3;
+	motion->origin[4] = vertex4;
 }
 
 bool Quad::Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth)
 {
-	if (glm::dot(rayDir, normal) == 0.0f)
-		return false;
-	float d = glm::dot((vertex1 - rayOrg), normal) / glm::dot(rayDir, normal);
-	if (d < EPSILON)
-		return false;
-	glm::vec3 p = d * rayDir + rayOrg;
-
-	float r = 0.0f;
-	glm::vec3 v1 = glm::normalize(vertex1 - p);
-	glm::vec3 v2 = glm::normalize(vertex2 - p);
-	r += glm::acos(glm::dot(v1, v2));
-	v1 = glm::normalize(vertex2 - p);
-	v2 = glm::normalize(vertex4 - p);
-	r += glm::acos(glm::dot(v1, v2));
-	v1 = glm::normalize(vertex4 - p);
-	v2 = glm::normalize(vertex3 - p);
-	r += glm::acos(glm::dot(v1, v2));
-	v1 = glm::normalize(vertex3 - p);
-	v2 = glm::normalize(vertex1 - p);
-	r += glm::acos(glm::dot(v1, v2));
-	if (abs(r - 2.0f * M_PI) < EPSILON)
-	{
-		hitDepth = d;
-		return true;
-	}
-	return false;
+	return simdKernels->quadHit(*this, rayOrg, rayDir, hitDepth);
+}
+
+glm::vec3 Quad::Normal(glm::vec3 p)
+{
+	return normal;
 }
 
-void Quad::Move()
+AABB Quad::GetBounds()
 {
-	if (moveDistance == 0.0f || moveSpeed == 0.0f || moveDirection == glm::vec3(0.0f))
+	AABB box;
+	box.Expand(vertex1);
+	box.Expand(vertex2);
+	box.Expand(vertex3);
+	box.Expand(vertex4);
+	// Hit accepts points whose corner angles add up to 2 pi within EPSILON,
+	// which reach up to about EPSILON / 8 of an edge length outside the quad.
+	// The pad of EPSILON of the diagonal holds all of them, and keeps the box
+	// of the flat quad from degenerating to a plane.
+	float pad = EPSILON * (1.0f + glm::length(box.bmax - box.bmin));
+	box.bmin -= glm::vec3(pad);
+	box.bmax += glm::vec3(pad);
+	return box;
+}
+
+void Quad::MoveTo(int step)
+{
+	if (!motion)
 		return;
-	if (offset > moveDistance)
-		moveForward = false;
-	else if (offset < 0.0f)
-		moveForward = true;
-	if (moveForward)
-	{
-		offset += moveSpeed;
-		center += moveDirection * moveSpeed;
-		vertex1 += moveDirection * moveSpeed;
-		vertex2 += moveDirection * moveSpeed;
-		vertex3 += moveDirection * moveSpeed;
-		vertex4 += moveDirection * moveSpeed;
-	}
-	else
-	{
-		offset -= moveSpeed;
-		center -= moveDirection * moveSpeed;
-		vertex1 -= moveDirection * moveSpeed;
-		vertex2 -= moveDirection * moveSpeed;
-		vertex3 -= moveDirection * moveSpeed;
-		vertex4 -= moveDirection * moveSpeed;
-	}
+	glm::vec3 d = Displacement(step);
+	center = motion->origin[0] + d;
+	vertex1 = motion->origin[1] + d;
+	vertex2 = motion->origin[2] + d;
+	vertex3 = motion->origin[3] + d;
+	vertex4 = motion->origin[4] + d;
 }
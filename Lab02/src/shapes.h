@@ -4,6 +4,7 @@
 #include <glm/glm.hpp>
 
 const float EPSILON = 0.001f;
+const int PACKET_SIZE = 16;
 
 enum class ShapeType
 {
@@ -11,26 +12,80 @@ enum class ShapeType
 	LIGHT,
 	SPHERE,
 	QUAD,
+	INSTANCE,
 };
 
-class Shape
+// Shadow rays from one point to up to PACKET_SIZE lights, traced together.
+// Stored as structure of arrays, unused lanes never hit anything.
+class ShadowPacket
+{
+public:
+	int count;
+	float dirX[PACKET_SIZE];
+	float dirY[PACKET_SIZE];
+	float dirZ[PACKET_SIZE];
+	float invX[PACKET_SIZE];
+	float invY[PACKET_SIZE];
+	float invZ[PACKET_SIZE];
+	float maxDist[PACKET_SIZE];
+	unsigned int active;	// Rays that are not occluded yet
+
+	ShadowPacket();
+	void Add(glm::vec3 dir, float dist);
+	glm::vec3 Dir(int i) const;
+};
+
+// Axis aligned bounding box
+class AABB
+{
+public:
+	glm::vec3 bmin;
+	glm::vec3 bmax;
+
+	AABB();
+	void Expand(glm::vec3 p);
+	void Expand(const AABB& b);
+	glm::vec3 Center() const;
+	float Area() const;
+	bool Hit(glm::vec3 rayOrg, glm::vec3 invDir, float tMax) const;
+	// Mask of the rays in mask that enter the box before their maxDist
+	unsigned int HitPacket(glm::vec3 rayOrg, const ShadowPacket& packet, unsigned int mask) const;
+};
+
+// Shading properties of a shape, only read once a hit is found
+class Surface
 {
 public:
-	ShapeType type;
-	glm::vec3 center;
 	glm::vec3 diff_color;
 	glm::vec3 spec_color;
 	float shininess;
 	float reflectivity;
-	glm::vec3 moveDirection;
-	float moveDistance;
-	float moveSpeed;
 
-protected:
-	float offset;
-	bool moveForward;
+	Surface();
+};
+
+// Animation of a shape, only read when the scene is updated
+class Motion
+{
+public:
+	glm::vec3 direction;
+	float distance;
+	float speed;
+	glm::vec3 origin[5];	// Center, then the vertices of quads, before any animation
+
+	Motion();
+};
 
+// Shapes keep only what intersection reads. Their surface and motion are
+// kept apart, so the shapes of a scene are packed closer together.
+class Shape
+{
 public:
+	ShapeType type;
+	glm::vec3 center;
+	Surface* surface;
+	Motion* motion;	// 0 for shapes that never move
+
 	Shape();
 	void SetCenter(glm::vec3 pos);
 	void SetDiff(glm::vec3 diff);
@@ -40,15 +95,32 @@ public:
 	void SetMoveDirection(glm::vec3 dir);
 	void SetMoveDistance(float dist);
 	void SetMoveSpeed(float speed);
+	// Make the current position the one animations start from
+	virtual void SetOrigin();
 
 	virtual bool Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth);
-	virtual void Move();
+	// Like Hit, but for shape groups also reports the primitive that was hit
+	// and skips the primitive "skip" (used to avoid self intersections)
+	virtual bool Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* skip, float& hitDepth, Shape*& hitPrim);
+	// Mask of the rays in mask that hit the shape before their maxDist
+	virtual unsigned int OccludesPacket(glm::vec3 rayOrg, const ShadowPacket& packet, unsigned int mask, Shape* skip);
+	virtual glm::vec3 Normal(glm::vec3 p);
+	virtual AABB GetBounds();
+	// Offset along the motion direction after the given number of animation
+	// steps. Shapes go back and forth between 0 and the distance, speed per step.
+	glm::vec3 Displacement(int step);
+	// Whether the animation ever moves the shape
+	bool Moves() const;
+	// Place the shape where it is after the given number of steps
+	virtual void MoveTo(int step);
 };
 
 class Light : public Shape
 {
 public:
+	float falloff;	// Distance at which the light is at half intensity, 0 for none
 	Light();
+	void SetFalloff(float f);
 };
 
 class Sphere : public Shape
@@ -59,6 +131,9 @@ public:
 	void SetRadius(float r);
 
 	bool Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth);
+	unsigned int OccludesPacket(glm::vec3 rayOrg, const ShadowPacket& packet, unsigned int mask, Shape* skip);
+	glm::vec3 Normal(glm::vec3 p);
+	AABB GetBounds();
 };
 
 class Quad : public Shape
@@ -69,13 +144,17 @@ public:
 	glm::vec3 vertex3;
 	glm::vec3 vertex4;
 	glm::vec3 normal;
+
 	Quad();
 	void SetV1(glm::vec3 v1);
 	void SetV2(glm::vec3 v2);
 	void SetV3(glm::vec3 v3);
+	void SetOrigin();
 
 	bool Hit(glm::vec3 rayOrg, glm::vec3 rayDir, float& hitDepth);
-	void Move();
+	glm::vec3 Normal(glm::vec3 p);
+	AABB GetBounds();
+	void MoveTo(int step);
 };
 
 #endif
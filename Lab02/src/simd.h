@@ -0,0 +1,20 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+// x86 builds also carry kernels for newer instruction sets, picked at run
+// time, see kernels.h
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define RT_X86
+#endif
+
+// Instruction sets available at compile time
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#define RT_AVX
+#include <immintrin.h>
+#endif
+
+#endif
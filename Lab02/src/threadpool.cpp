@@ -0,0 +1,82 @@
+#include "threadpool.h"
+#include "timeline.h"
+
+TaskGroup::TaskGroup()
+{
+	count = 0;
+}
+
+void TaskGroup::Add(int n)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	count += n;
+}
+
+void TaskGroup::Done()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (--count == 0)
+		finished.notify_all();
+}
+
+void TaskGroup::Wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	finished.wait(lock, [this]() { return count == 0; });
+}
+
+ThreadPool::ThreadPool()
+{
+	stop = false;
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+	for (auto& t : threads)
+		t.join();
+}
+
+void ThreadPool::Start(int count)
+{
+	if (count < 1)
+		count = 1;
+	while ((int)threads.size() < count)
+		threads.push_back(std::thread(&ThreadPool::Loop, this));
+}
+
+int ThreadPool::Size()
+{
+	return (int)threads.size();
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(task);
+	}
+	wake.notify_one();
+}
+
+void ThreadPool::Loop()
+{
+	TimelineNameThread("pool");
+	while (1)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this]() { return stop || !tasks.empty(); });
+			if (stop && tasks.empty())
+				return;
+			task = tasks.front();
+			tasks.pop_front();
+		}
+		task();
+	}
+}
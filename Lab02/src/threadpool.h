@@ -0,0 +1,46 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Number of unfinished tasks of some kind, Wait blocks until it is 0
+class TaskGroup
+{
+public:
+	TaskGroup();
+	void Add(int n);
+	void Done();
+	void Wait();
+
+private:
+	std::mutex mutex;
+	std::condition_variable finished;
+	int count;
+};
+
+// Threads that live as long as the pool and run submitted tasks in order
+class ThreadPool
+{
+public:
+	ThreadPool();
+	~ThreadPool();
+	void Start(int count);
+	int Size();
+	void Submit(std::function<void()> task);
+
+private:
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stop;
+
+	void Loop();
+};
+
+#endif
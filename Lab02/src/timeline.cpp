@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "timeline.h"
+
+#pragma warning(disable : 4996)
+
+std::atomic<bool> timelineOn(false);
+
+class TimelineEvent
+{
+public:
+	const char* name;
+	long long start;
+	long long end;
+	int index;
+};
+
+// Events of one thread. Only the thread writes them, count is published
+// after each event so the file can be written while threads still run.
+class TimelineBuffer
+{
+public:
+	int tid;
+	const char* name;
+	std::vector<TimelineEvent> events;
+	std::atomic<int> count;
+	std::atomic<int> dropped;
+
+	TimelineBuffer(int id) : tid(id), name(0), events(TIMELINE_THREAD_EVENTS), count(0), dropped(0) {}
+};
+
+static std::mutex timelineLock;
+// Kept until the process ends, threads hold pointers to them
+static std::vector<TimelineBuffer*> timelineBuffers;
+static std::string timelineFile;
+static long long timelineOrigin = 0;
+static thread_local TimelineBuffer* threadBuffer = 0;
+
+static TimelineBuffer* ThreadBuffer()
+{
+	if (!threadBuffer)
+	{
+		std::lock_guard<std::mutex> guard(timelineLock);
+		threadBuffer = new TimelineBuffer((int)timelineBuffers.size() + 1);
+		timelineBuffers.push_back(threadBuffer);
+	}
+	return threadBuffer;
+}
+
+long long TimelineNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool TimelineStart(std::string file)
+{
+	std::lock_guard<std::mutex> guard(timelineLock);
+	if (timelineOn || !timelineFile.empty())
+		return false;
+	timelineFile = file;
+	timelineOrigin = TimelineNow();
+	timelineOn = true;
+	return true;
+}
+
+void TimelineNameThread(const char* name)
+{
+	if (timelineOn.load(std::memory_order_relaxed))
+		ThreadBuffer()->name = name;
+}
+
+void TimelineRecord(const char* name, long long start, int index)
+{
+	TimelineBuffer* buffer = ThreadBuffer();
+	int n = buffer->count.load(std::memory_order_relaxed);
+	if (n >= TIMELINE_THREAD_EVENTS)
+	{
+		buffer->dropped++;
+		return;
+	}
+	TimelineEvent& e = buffer->events[n];
+	e.name = name;
+	e.start = start;
+	e.end = TimelineNow();
+	e.index = index;
+	buffer->count.store(n + 1, std::memory_order_release);
+}
+
+bool TimelineStop()
+{
+	if (!timelineOn.exchange(false))
+		return false;
+	std::lock_guard<std::mutex> guard(timelineLock);
+	FILE* f = fopen(timelineFile.c_str(), "w");
+	if (!f)
+	{
+		std::cout << "Can't write timeline: " << timelineFile << std::endl;
+		return false;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Lab02\"}}");
+	long long events = 0;
+	long long dropped = 0;
+	for (TimelineBuffer* buffer : timelineBuffers)
+	{
+		if (buffer->name)
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", buffer->tid, buffer->name);
+		else
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", buffer->tid, buffer->tid);
+		int count = buffer->count.load(std::memory_order_acquire);
+		for (int i = 0; i < count; i++)
+		{
+			const TimelineEvent& e = buffer->events[i];
+			// Complete events, times in microseconds
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", e.name, buffer->tid,
+				(e.start - timelineOrigin) / 1000.0, (e.end - e.start) / 1000.0);
+			if (e.index >= 0)
+				fprintf(f, ",\"args\":{\"index\":%d}", e.index);
+			fprintf(f, "}");
+		}
+		events += count;
+		dropped += buffer->dropped;
+	}
+	fprintf(f, "\n]}\n");
+	bool ok = fclose(f) == 0;
+	if (!ok)
+		std::cout << "Can't write timeline: " << timelineFile << std::endl;
+	else
+		std::cout << "Timeline of " << timelineBuffers.size() << " threads, " << events << " events written to " << timelineFile << std::endl;
+	if (dropped > 0)
+		std::cout << "Timeline: " << dropped << " events dropped, more than " << TIMELINE_THREAD_EVENTS << " on a thread" << std::endl;
+	return ok;
+}
@@ -0,0 +1,46 @@
+#ifndef __TIMELINE_H__
+#define __TIMELINE_H__
+
+#include <string>
+#include <atomic>
+
+// Events a thread can record, later ones are dropped
+const int TIMELINE_THREAD_EVENTS = 1 << 18;
+
+// Set while a timeline is recorded. Never set otherwise, so every event
+// point costs one load and a branch that is always predicted.
+extern std::atomic<bool> timelineOn;
+
+// Starts recording what every thread does, to be written to file as
+// Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev)
+bool TimelineStart(std::string file);
+// Stops recording and writes the file. Threads may still be rendering,
+// only their finished events are written.
+bool TimelineStop();
+// Name of the calling thread in the timeline, "thread n" if it has none
+void TimelineNameThread(const char* name);
+
+long long TimelineNow();
+void TimelineRecord(const char* name, long long start, int index);
+
+// Records the time from construction to the end of the scope on the
+// calling thread as an event. name must outlive the timeline, index is
+// shown with the event when it is not negative.
+class TimelineScope
+{
+public:
+	TimelineScope(const char* name, int index = -1)
+		: name(name), index(index), start(timelineOn.load(std::memory_order_relaxed) ? TimelineNow() : 0) {}
+	~TimelineScope()
+	{
+		if (start)
+			TimelineRecord(name, start, index);
+	}
+
+private:
+	const char* name;
+	int index;
+	long long start;
+};
+
+#endif
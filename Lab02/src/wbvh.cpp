@@ -0,0 +1,368 @@
+#include <math.h>
+
+#include "wbvh.h"
+#include "bvh.h"
+#include "heatmap.h"
+#include "kernels.h"
+
+const int WBVH_STACK_SIZE = 256;
+
+// Child box tests of the kernels in use, see SimdKernels
+static int HitChildren(const WideBVHNode<4>& node, glm::vec3 rayOrg, glm::vec3 invDir, float tMax, float* tEnter)
+{
+	return simdKernels->childBoxHit4(node, rayOrg, invDir, tMax, tEnter);
+}
+
+static int HitChildren(const WideBVHNode<8>& node, glm::vec3 rayOrg, glm::vec3 invDir, float tMax, float* tEnter)
+{
+	return simdKernels->childBoxHit8(node, rayOrg, invDir, tMax, tEnter);
+}
+
+template <int N>
+void WideBVH<N>::SetChildBounds(WideBVHNode<N>& node, int c, const AABB& box)
+{
+	node.minX[c] = box.bmin.x;
+	node.minY[c] = box.bmin.y;
+	node.minZ[c] = box.bmin.z;
+	node.maxX[c] = box.bmax.x;
+	node.maxY[c] = box.bmax.y;
+	node.maxZ[c] = box.bmax.z;
+}
+
+template <int N>
+void WideBVH<N>::Build(const std::vector<Shape*>& shapes)
+{
+	nodes.clear();
+	prims.clear();
+	primIndex.clear();
+	rootBox = AABB();
+	binaryNodes = 0;
+	if (shapes.empty())
+		return;
+
+	BVH bvh;
+	bvh.Build(shapes);
+	prims = bvh.prims;
+	primIndex = bvh.primIndex;
+	binaryNodes = (int)bvh.nodes.size();
+	nodes.reserve(bvh.nodes.size() / 2);
+	Collapse(bvh, 0);
+	nodes.shrink_to_fit();
+	Refit();
+}
+
+template <int N>
+int WideBVH<N>::Collapse(const BVH& bvh, int node)
+{
+	// Open the largest inner node among the children until all N slots are used
+	int slots[N];
+	int n = 0;
+	if (bvh.nodes[node].count > 0)
+		slots[n++] = node;
+	else
+	{
+		slots[n++] = bvh.nodes[node].left;
+		slots[n++] = bvh.nodes[node].left + 1;
+	}
+	while (n < N)
+	{
+		int best = -1;
+		float bestArea = -1.0f;
+		for (int i = 0; i < n; i++)
+		{
+			const BVHNode& b = bvh.nodes[slots[i]];
+			if (b.count == 0 && b.box.Area() > bestArea)
+			{
+				bestArea = b.box.Area();
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+		int opened = slots[best];
+		slots[best] = bvh.nodes[opened].left;
+		slots[n++] = bvh.nodes[opened].left + 1;
+	}
+
+	// Nodes are stored in pre-order, children always after their parent
+	int index = (int)nodes.size();
+	nodes.push_back(WideBVHNode<N>());
+	for (int c = 0; c < N; c++)
+	{
+		nodes[index].child[c] = -1;
+		nodes[index].count[c] = 0;
+		nodes[index].first[c] = 0;
+	}
+	for (int c = 0; c < n; c++)
+	{
+		const BVHNode& b = bvh.nodes[slots[c]];
+		if (b.count > 0)
+		{
+			nodes[index].first[c] = b.first;
+			nodes[index].count[c] = b.count;
+		}
+		else
+		{
+			int child = Collapse(bvh, slots[c]);
+			nodes[index].child[c] = child;
+		}
+	}
+	return index;
+}
+
+template <int N>
+void WideBVH<N>::Refit()
+{
+	AABB empty;
+	empty.bmin = glm::vec3(INFINITY);
+	empty.bmax = glm::vec3(INFINITY);
+	std::vector<AABB> boxes(nodes.size());
+	for (int i = (int)nodes.size() - 1; i >= 0; i--)
+	{
+		WideBVHNode<N>& node = nodes[i];
+		AABB nodeBox;
+		for (int c = 0; c < N; c++)
+		{
+			AABB box;
+			if (node.count[c] > 0)
+			{
+				for (int j = node.first[c]; j < node.first[c] + node.count[c]; j++)
+					box.Expand(prims[j]->GetBounds());
+			}
+			else if (node.child[c] >= 0)
+				box = boxes[node.child[c]];
+			else
+			{
+				SetChildBounds(node, c, empty);
+				continue;
+			}
+			SetChildBounds(node, c, box);
+			nodeBox.Expand(box);
+		}
+		boxes[i] = nodeBox;
+	}
+	rootBox = nodes.empty() ? AABB() : boxes[0];
+}
+
+template <int N>
+AABB WideBVH<N>::GetBounds()
+{
+	return rootBox;
+}
+
+template <int N>
+template <bool CountTests>
+bool WideBVH<N>::ClosestHit(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim)
+{
+	if (nodes.empty())
+		return false;
+	glm::vec3 invDir = 1.0f / rayDir;
+	float currDepth = INFINITY;
+	int currIndex = -1;
+
+	int stack[WBVH_STACK_SIZE];
+	float enters[WBVH_STACK_SIZE];
+	int top = 0;
+	stack[top] = 0;
+	enters[top] = 0.0f;
+	top++;
+	while (top > 0)
+	{
+		top--;
+		if (enters[top] > currDepth)
+			continue;
+		const WideBVHNode<N>& node = nodes[stack[top]];
+		float tEnter[N];
+		int mask = HitChildren(node, rayOrg, invDir, currDepth, tEnter);
+		if (!mask)
+			continue;
+
+		// Sort the children that were hit by entry distance
+		int order[N];
+		int n = 0;
+		for (int c = 0; c < N; c++)
+		{
+			if (!(mask & (1 << c)))
+				continue;
+			int k = n++;
+			while (k > 0 && tEnter[order[k - 1]] > tEnter[c])
+			{
+				order[k] = order[k - 1];
+				k--;
+			}
+			order[k] = c;
+		}
+
+		// Leaves are tested nearest first, inner nodes pushed farthest first
+		for (int k = 0; k < n; k++)
+		{
+			int c = order[k];
+			if (node.count[c] == 0 || tEnter[c] > currDepth)
+				continue;
+			if (CountTests)
+				heatCounters.tests += node.count[c];
+			for (int j = node.first[c]; j < node.first[c] + node.count[c]; j++)
+			{
+				Shape* s = prims[j];
+				float depth = 0.0f;
+				Shape* prim = 0;
+				if (s->Intersect(rayOrg, rayDir, s == self ? skip : 0, depth, prim))
+				{
+					if (depth < currDepth || (depth == currDepth && primIndex[j] < currIndex))
+					{
+						currDepth = depth;
+						currIndex = primIndex[j];
+						hitObj = s;
+						hitPrim = prim;
+					}
+				}
+			}
+		}
+		for (int k = n - 1; k >= 0; k--)
+		{
+			int c = order[k];
+			if (node.child[c] < 0 || tEnter[c] > currDepth)
+				continue;
+			stack[top] = node.child[c];
+			enters[top] = tEnter[c];
+			top++;
+		}
+	}
+	if (currIndex < 0)
+		return false;
+	hitDepth = currDepth;
+	return true;
+}
+
+template <int N>
+bool WideBVH<N>::Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim)
+{
+	if (countTests)
+		return ClosestHit<true>(rayOrg, rayDir, self, skip, hitDepth, hitObj, hitPrim);
+	return ClosestHit<false>(rayOrg, rayDir, self, skip, hitDepth, hitObj, hitPrim);
+}
+
+template <int N>
+template <bool CountTests>
+bool WideBVH<N>::AnyHit(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip)
+{
+	if (nodes.empty())
+		return false;
+	glm::vec3 invDir = 1.0f / rayDir;
+
+	int stack[WBVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const WideBVHNode<N>& node = nodes[stack[--top]];
+		float tEnter[N];
+		int mask = HitChildren(node, rayOrg, invDir, maxDist, tEnter);
+		for (int c = 0; c < N; c++)
+		{
+			if (!(mask & (1 << c)))
+				continue;
+			if (node.child[c] >= 0)
+			{
+				stack[top++] = node.child[c];
+				continue;
+			}
+			if (CountTests)
+				heatCounters.tests += node.count[c];
+			for (int j = node.first[c]; j < node.first[c] + node.count[c]; j++)
+			{
+				Shape* s = prims[j];
+				float depth = 0.0f;
+				Shape* prim = 0;
+				if (s->Intersect(rayOrg, rayDir, s == self ? skip : 0, depth, prim))
+				{
+					if (depth < maxDist)
+						return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+template <int N>
+bool WideBVH<N>::Occluded(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip)
+{
+	if (countTests)
+		return AnyHit<true>(rayOrg, rayDir, maxDist, self, skip);
+	return AnyHit<false>(rayOrg, rayDir, maxDist, self, skip);
+}
+
+template <int N>
+template <bool CountTests>
+void WideBVH<N>::AnyHitPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip)
+{
+	if (nodes.empty())
+		return;
+
+	int stack[WBVH_STACK_SIZE];
+	unsigned int masks[WBVH_STACK_SIZE];
+	int top = 0;
+	stack[top] = 0;
+	masks[top] = packet.active;
+	top++;
+	while (top > 0)
+	{
+		top--;
+		const WideBVHNode<N>& node = nodes[stack[top]];
+		unsigned int parentMask = masks[top];
+		for (int c = 0; c < N; c++)
+		{
+			if (node.child[c] < 0 && node.count[c] == 0)
+				continue;
+			AABB box;
+			box.bmin = glm::vec3(node.minX[c], node.minY[c], node.minZ[c]);
+			box.bmax = glm::vec3(node.maxX[c], node.maxY[c], node.maxZ[c]);
+			unsigned int mask = box.HitPacket(rayOrg, packet, parentMask & packet.active);
+			if (!mask)
+				continue;
+			if (node.child[c] >= 0)
+			{
+				stack[top] = node.child[c];
+				masks[top] = mask;
+				top++;
+				continue;
+			}
+			if (CountTests)
+				heatCounters.tests += node.count[c];
+			for (int j = node.first[c]; j < node.first[c] + node.count[c] && mask; j++)
+			{
+				Shape* s = prims[j];
+				unsigned int occluded = s->OccludesPacket(rayOrg, packet, mask, s == self ? skip : 0);
+				packet.active &= ~occluded;
+				mask &= ~occluded;
+			}
+			if (!packet.active)
+				return;
+		}
+	}
+}
+
+template <int N>
+void WideBVH<N>::OccludedPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip)
+{
+	if (countTests)
+		AnyHitPacket<true>(rayOrg, packet, self, skip);
+	else
+		AnyHitPacket<false>(rayOrg, packet, self, skip);
+}
+
+template <int N>
+size_t WideBVH<N>::MemoryUsage()
+{
+	return nodes.size() * sizeof(WideBVHNode<N>) + prims.size() * (sizeof(Shape*) + sizeof(int));
+}
+
+template <int N>
+size_t WideBVH<N>::UncompressedMemoryUsage()
+{
+	return binaryNodes * sizeof(BVHNode) + prims.size() * (sizeof(Shape*) + sizeof(int));
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
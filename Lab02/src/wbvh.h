@@ -0,0 +1,64 @@
+#ifndef __WBVH_H__
+#define __WBVH_H__
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "shapes.h"
+#include "accel.h"
+
+class BVH;
+
+// Node with up to N children, child boxes are stored as structure of arrays
+// so one ray is tested against all of them at once
+template <int N>
+class WideBVHNode
+{
+public:
+	float minX[N];
+	float minY[N];
+	float minZ[N];
+	float maxX[N];
+	float maxY[N];
+	float maxZ[N];
+	int child[N];	// Node index, -1 for leaves and empty slots
+	int first[N];	// First primitive of a leaf
+	int count[N];	// Number of primitives, 0 for inner nodes and empty slots
+};
+
+// BVH collapsed from a binary BVH into N-ary nodes (N = 4 or 8)
+template <int N>
+class WideBVH : public Accelerator
+{
+public:
+	std::vector<WideBVHNode<N>> nodes;
+	std::vector<Shape*> prims;
+	std::vector<int> primIndex;
+	AABB rootBox;
+
+	void Build(const std::vector<Shape*>& shapes);
+	void Refit();
+	AABB GetBounds();
+
+	bool Intersect(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim);
+	bool Occluded(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip);
+	void OccludedPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip);
+
+	size_t MemoryUsage();
+	size_t UncompressedMemoryUsage();
+
+private:
+	// Traversals of the queries above, CountTests adds the primitives tested
+	// to heatCounters
+	template <bool CountTests>
+	bool ClosestHit(glm::vec3 rayOrg, glm::vec3 rayDir, Shape* self, Shape* skip, float& hitDepth, Shape*& hitObj, Shape*& hitPrim);
+	template <bool CountTests>
+	bool AnyHit(glm::vec3 rayOrg, glm::vec3 rayDir, float maxDist, Shape* self, Shape* skip);
+	template <bool CountTests>
+	void AnyHitPacket(glm::vec3 rayOrg, ShadowPacket& packet, Shape* self, Shape* skip);
+	int binaryNodes;
+	int Collapse(const BVH& bvh, int node);
+	void SetChildBounds(WideBVHNode<N>& node, int c, const AABB& box);
+};
+
+#endif